@@ -43,6 +43,12 @@
 #define LPT2PDF_VERSION "1.0-006"
 #define VERSION_REQUIRED "1."
 
+/* fallocate is a GNU extension */
+
+#if defined (__linux__) && !defined (_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include <ctype.h>
 #include <errno.h>
 #include <setjmp.h>
@@ -50,6 +56,9 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <stdio.h>
+#if defined (_MSC_VER) && _MSC_VER < 1900
+#define vsnprintf _vsnprintf
+#endif
 #if defined (_MSC_VER) && _MSC_VER < 1600
 typedef __int32 int32_t;
 typedef unsigned __int32 uint32_t;
@@ -74,6 +83,48 @@ typedef __int16 int_least16_t;
 #include <sys/file.h>
 #define USE_FLOCK
 #endif
+#if !defined (VMS) && !defined (PDF_NO_FDOUT)
+#include <sys/uio.h>
+#define USE_FDOUT
+#endif
+#if !defined (VMS) && !defined (PDF_NO_MMAP)
+#include <sys/mman.h>
+#define USE_MMAP
+#endif
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#define USE_KCOPY
+#ifdef FALLOC_FL_KEEP_SIZE
+#define USE_FALLOCATE
+#endif
+#endif
+#if defined (PDF_MAIN) && defined (__linux__)
+#include <poll.h>
+#include <sys/inotify.h>
+#define USE_INOTIFY
+#endif
+#endif
+#ifdef PDF_MAIN
+#include <signal.h>
+#endif
+
+/* Pages can be rendered, compressed and written by worker threads */
+
+#if !defined (_WIN32) && !defined (VMS) && defined (__GNUC__) && !defined (PDF_NO_THREADS)
+#include <pthread.h>
+#define USE_THREADS
+#endif
+
+/* Runs of printable ASCII are scanned and copied with vector instructions */
+
+#if defined (__AVX2__)
+#include <immintrin.h>
+#elif defined (__SSE2__) || defined (_M_X64)
+#include <emmintrin.h>
+#define USE_SSE2
 #endif
 
 #define PDF_BUILD_
@@ -87,6 +138,41 @@ typedef __int16 int_least16_t;
 #define COPY_BUFSIZE (8192)
 #endif
 
+/* Buffer size for copying files that the kernel can't copy itself */
+
+#ifndef FCOPY_BUFSIZE
+#define FCOPY_BUFSIZE (1024 * 1024)
+#endif
+
+/* Size of the output buffer, and its alignment */
+
+#ifndef OBUF_SIZE
+#define OBUF_SIZE (256 * 1024)
+#endif
+#define OBUF_ALIGN (4096)
+
+/* Write a file's data to storage.  fdatasync skips metadata that
+ * isn't needed to read it back.
+ */
+
+#if defined (_WIN32)
+#define fdsync(fd) _commit (fd)
+#elif defined (_POSIX_SYNCHRONIZED_IO) && _POSIX_SYNCHRONIZED_IO > 0
+#define fdsync(fd) fdatasync (fd)
+#else
+#define fdsync(fd) fsync (fd)
+#endif
+
+/* Nanoseconds of a file's modification time, where stat has them */
+
+#if defined (__APPLE__)
+#define ST_MTIME_NSEC(sb) ((int64_t) (sb).st_mtimespec.tv_nsec)
+#elif defined (_WIN32) || defined (VMS)
+#define ST_MTIME_NSEC(sb) ((int64_t) 0)
+#else
+#define ST_MTIME_NSEC(sb) ((int64_t) (sb).st_mtim.tv_nsec)
+#endif
+
 /* Colors:
  *
  * PDF RGB takes values from 0 to 1.0
@@ -154,6 +240,15 @@ static const char *const validFonts[] = {
     NULL
 };
 
+/* Width of the space character in each of the fonts, in 1/1000 text space units */
+
+static const unsigned short fontSpace[] = {
+    600, 600, 600, 600,
+    250, 250, 250, 250,
+    278, 278, 278, 278,
+    250, 278,
+};
+
 /* Character set maps from 0x20 - 0xFF (96) or 0x21 - 0xFE (94)
  * The 94-char maps have translations for all 96 for simplicity.
  * 0x2426 is used for all undefined/reserved codes.
@@ -439,53 +534,79 @@ CHSEND
 };
 
 /* Translate Unicode to PDFDocEncoding
- * These are the exceptions.  20-7E and A1 - FF are 1:1.
+ * 20-7E and A1 - FF are 1:1.  The exceptions are in pages of 256 code
+ * points, selected by the high byte.  An entry is the PDFDocEncoding
+ * XOR the low byte, which is never 0.  Other code points above FF have
+ * no equivalent, and are printed as ?.
  */
-static const struct {
-    unsigned short ucode;
-    short pdfcode;
-} utran[] = {
-#define T(uc,pc) {0x##uc, 0x##pc},
-    T (2D8,18)
-    T (2C7,19)
-    T (2C6,1A)
-    T (2D9,1B)
-    T (2DD,1C)
-    T (2DB,1D)
-    T (2DA,1E)
-    T (2DC,1F)
-    T (2022,80)
-    T (2020,81)
-    T (2021,82)
-    T (2026,83)
-    T (2014,84)
-    T (2013,85)
-    T (192,86)
-    T (2044,87)
-    T (2039,88)
-    T (203A,89)
-    T (2212,8A)
-    T (2030,8B)
-    T (201E,8C)
-    T (201C,8D)
-    T (201D,8E)
-    T (2018,8F)
-    T (2019,90)
-    T (201A,91)
-    T (2122,92)
-    T (FB01,93)
-    T (FB02,94)
-    T (141,95)
-    T (152,96)
-    T (160,97)
-    T (178,98)
-    T (17D,99)
-    T (131,9A)
-    T (142,9B)
-    T (153,9C)
-    T (161,9D)
-    T (17E,9E)
-    T (20AC,A0)
+
+#define PDFDOC_X(u) (pdfdoc[pdfpage[((u) >> 8) & 0xFF]][(u) & 0xFF])
+#define PDFDOC(u) ((uint8_t) (((u) < 0x100 || PDFDOC_X (u))? (u) ^ PDFDOC_X (u): '?'))
+
+static const uint8_t pdfpage[256] = {
+    [0x01] = 1,
+    [0x02] = 2,
+    [0x20] = 3,
+    [0x21] = 4,
+    [0x22] = 5,
+    [0xFB] = 6,
+};
+
+static const uint8_t pdfdoc[7][256] = {
+#define T(uc,pc) [0x##uc & 0xFF] = 0x##pc ^ (0x##uc & 0xFF),
+    { 0 },                              /* Latin-1 and unlisted */
+    {                                   /* U+01xx */
+        T (192,86)
+        T (141,95)
+        T (152,96)
+        T (160,97)
+        T (178,98)
+        T (17D,99)
+        T (131,9A)
+        T (142,9B)
+        T (153,9C)
+        T (161,9D)
+        T (17E,9E)
+    },
+    {                                   /* U+02xx */
+        T (2D8,18)
+        T (2C7,19)
+        T (2C6,1A)
+        T (2D9,1B)
+        T (2DD,1C)
+        T (2DB,1D)
+        T (2DA,1E)
+        T (2DC,1F)
+    },
+    {                                   /* U+20xx */
+        T (2022,80)
+        T (2020,81)
+        T (2021,82)
+        T (2026,83)
+        T (2014,84)
+        T (2013,85)
+        T (2044,87)
+        T (2039,88)
+        T (203A,89)
+        T (2030,8B)
+        T (201E,8C)
+        T (201C,8D)
+        T (201D,8E)
+        T (2018,8F)
+        T (2019,90)
+        T (201A,91)
+        T (20AC,A0)
+    },
+    {                                   /* U+21xx */
+        T (2122,92)
+    },
+    {                                   /* U+22xx */
+        T (2212,8A)
+    },
+    {                                   /* U+FBxx */
+        T (FB01,93)
+        T (FB02,94)
+    },
 #undef T
 };
 
@@ -568,13 +689,120 @@ typedef struct {
     char *formfile;         /* File containing form image */
     double barh;            /* Height of form bar */
     unsigned int lpp;       /* Lines per page (requested) */
+    unsigned int threads;   /* Worker threads, 0 for none */
+    unsigned int codec;     /* Stream compression */
+#define PDF_CODEC_NONE   (0)/*  Not compressed */
+#define PDF_CODEC_LZW    (1)/*  LZWDecode */
+#define PDF_CODEC_FLATE  (2)/*  FlateDecode */
+#define PDF_CODEC_AUTO   (3)/*  Smaller of LZW and Flate, per stream */
+    unsigned int level;     /* Flate compression level, 1-9 */
+    unsigned int compact;   /* Compact text encoding */
+    unsigned int prealloc;  /* Preallocation extent, MB, 0 for none */
+    unsigned int durability;/* When the file is synced to storage */
+#define PDF_SYNC_NONE    (0)/*  Never */
+#define PDF_SYNC_JOB     (1)/*  When it is closed */
+#define PDF_SYNC_CHECKPOINT (2)/* Also at each checkpoint */
+#define PDF_SYNC_PAGE    (3)/*  Also after each page */
 } SETP;
 
+/* The text of a page: rows x cols 8-bit cells in one allocation.
+ * A row with a character above 0xFF, or that overprinting has made
+ * wider than the page, is moved to a 16-bit buffer in the side table.
+ * The rows are a ring; base is the physical row of the first line.
+ */
+
+typedef struct {
+    unsigned int rows;      /* Lines per page, including TOF offset */
+    unsigned int cols;      /* Cells per row */
+    unsigned int base;      /* Physical row of the first line */
+    uint8_t *cells;         /* Character cells */
+    size_t csize;           /* Allocation of cells */
+    unsigned int *len;      /* Characters in each row */
+    short **wide;           /* Data of a row not in the cells, or NULL */
+    size_t *wsize;          /* Allocation of each wide row (shorts) */
+} GRID;
+
+#define GRID_ROW(g, l) (((g)->base + (l)) % (g)->rows)
+
+/* Content streams written in this file, by hash of their data.
+ * A page whose stream matches an earlier one refers to that object,
+ * so repeated banner, separator and blank pages are stored once.
+ *
+ * Every page gets a cheap 64-bit key.  SHA1, which is much slower, is
+ * only computed for a page whose key is already in the table, and only
+ * a SHA1 match makes a page a duplicate.  The first page with a key is
+ * entered without its SHA1, so the entry is replaced by the second,
+ * and the copies after that are shared.
+ *
+ * Sharing the second copy would mean computing SHA1 for every page,
+ * since the first page's data is gone by the time the second arrives.
+ * That makes a listing with no repeated pages about 40% slower, to save
+ * one copy of each repeated page.  Pages that repeat usually do so many
+ * times, so one extra copy is the better bargain.
+ * Open addressing; size is a power of 2, and obj 0 is an empty slot.
+ */
+
+typedef struct {
+    uint64_t key;           /* Cheap hash */
+    uint8_t hash[SHA1HashSize]; /* SHA1, if hashed */
+    int hashed;
+} PHKEY;
+
+typedef struct {
+    PHKEY k;
+    unsigned int obj;       /* Content object */
+} PHASH;
+
+typedef struct {
+    PHASH *ent;
+    size_t size;            /* Slots allocated */
+    size_t used;            /* Slots used */
+} PHTAB;
+
+/* The parameters that a form without an image depends on */
+
+typedef struct {
+    unsigned int formtype;
+    double top, bot, margin, lno, wid, len, barh;
+} FORMKEY;
+
+/* The page tree of a session.
+ * Each page's leaf is written with the page.  Leaves are gathered into
+ * nodes of PAGE_NODE kids, which are gathered into nodes a level up, and
+ * so on.  A node is written when it is full, so only the node being
+ * filled at each level is written by a checkpoint or close.  Each of those
+ * has the one below as its last kid; the top one is the only kid of the
+ * session's page list.  The objects are numbered when the session's first
+ * page is written.
+ */
+
+#define PAGE_NODE   (32)    /* Kids per node */
+#define PAGE_LEVELS (7)     /* More pages than a page number can count */
+
+typedef struct {
+    unsigned int obj;       /* Node being filled, 0 if none */
+    unsigned int kids[PAGE_NODE];
+    unsigned int nkids;
+    unsigned int count;     /* Pages under its kids */
+} PTNODE;
+
+typedef struct {
+    unsigned int form;      /* Form XObject, 0 until the first page */
+    unsigned int plist;     /* Page list of the session */
+    unsigned int fonts;     /* Font dictionary */
+    PTNODE lvl[PAGE_LEVELS]; /* Nodes being filled; leaves are kids of level 0 */
+    char leaf[256];         /* Leaf object from its number to the contents */
+    size_t leaflen;
+} PTREE;
+
 typedef struct {
     char key[3];            /* Handle validator */
     SETP p;                 /* User-settable parameters */
     const CHARSET *gset[4]; /* Designated graphics sets */
     const CHARSET *gl, *gr;
+    unsigned int glset;     /* Gset invoked in GL */
+    unsigned int grset;     /* Gset invoked in GR */
+    short xlat[256];        /* Graphics thru GL and GR to Unicode */
 
     /* Below this point initialized to zero
      * Be sure to update pdf_reopen for additions.
@@ -584,6 +812,12 @@ typedef struct {
     int errnum;             /* Last error */
     FILE *pdf;              /* Output file handle */
     FILE *outf;             /* Final output */
+    char *obuf;             /* Output not yet written */
+    size_t oused;           /* Bytes in obuf */
+    t_fpos opos;            /* File position of obuf */
+    t_fpos oalloc;          /* File is preallocated to here */
+    int ofd;                /* File descriptor written, -1 for stdio */
+    int oerr;               /* First write error */
 #ifdef _WIN32
     char *tmpname;          /* Temporary file name */
 #endif
@@ -625,11 +859,23 @@ typedef struct {
     t_fpos anchorp;         /* Anchor object location for previous session */
     t_fpos anchorpp;        /* Position to rewrite parentof previous session */
     t_fpos checkpp;         /* File position at checkpoint */
+    char *snapname;         /* Last snapshot */
+    t_fpos snapsize;        /* Its size */
+    time_t snapmtime;       /* Its modification time */
+    t_fpos snaplen;         /* Bytes of it still the same as the file */
     unsigned int aobj;      /* Anchor object number */
     unsigned int obj;       /* Last object number assigned */
     t_fpos xpos;            /* Location of xref */
+    char *view;             /* Existing file, while it is read for update */
+    size_t vsize;           /* Its size */
+    int vmapped;            /* view is mapped, rather than read */
     t_fpos *xref;           /* Xref - file position of each object */
     size_t xsize;           /* Max objects in current xref allocation */
+    t_fpos xprev;           /* Xref of the last checkpoint, 0 if none */
+    unsigned int xmark;     /* Objects it located */
+    unsigned int *xmoved;   /* Objects it located that have moved since */
+    size_t xmsize, xmused;
+    size_t xdelta;          /* Entries in updates since the last full xref */
     unsigned int flags;
 #define PDF_ACTIVE        0x0001 /* Printing active (no more SETs) */
 #define PDF_UPDATING      0x0002 /* Updating existing file (append) */
@@ -639,16 +885,20 @@ typedef struct {
 #define PDF_RESUMED       0x0020 /* Resumed from a checkpoint */
 #define PDF_REOPENED      0x0040 /* Reopened (and thus must append) */
 #define PDF_TMPFILE       0x0080 /* Using tmpfile for non-seekable output (e.g. stdout) */
+#define PDF_STREAM        0x0100 /* Writing non-seekable output directly, never seeking back */
 
     unsigned int lpp;       /* Lines per page */
-    short **lines;          /* Data for each line */
-    unsigned int  nlines;   /* Number of lines allocated */
-    unsigned int *linesize; /* Allocation for each line */
-    unsigned int *linelen;  /* Highest column written */
+    GRID grid;              /* Text of the page */
+    unsigned int  nlines;   /* Number of lines used */
     unsigned int page;      /* Current page number */
     unsigned int line;      /* Current line number, 0 if nothing written */
     SHA1Context sha1;       /* Context for document ID hash */
     unsigned int pbase;     /* Object number of sessions page data */
+    char prolog[256];       /* Start of each page's stream, pre-rendered */
+    size_t prologlen;       /* Length of prolog, 0 if not rendered */
+    char mbox[64];          /* MediaBox of the pages, pre-rendered */
+    PTREE pt;               /* Page tree of the session */
+    PHTAB phtab;            /* Content streams by hash */
     unsigned int iobj;      /* Doc information object number */
     short *parsebuf;        /* Buffer with input controls expanded */
     size_t parsesize;       /* Allocated size in shorts */
@@ -662,10 +912,20 @@ typedef struct {
     size_t lzwsize;         /* Allocated size */
     size_t lzwused;         /* Bytes used */
 #define LZWBUF &pdf->lzwbuf, &pdf->lzwsize, &pdf->lzwused
+    char *cbuf;             /* Alternate compressed page (AUTO) */
+    size_t csize;           /* Allocated size */
+    size_t cused;           /* Bytes used */
+#define CBUF &pdf->cbuf, &pdf->csize, &pdf->cused
+    size_t pbmark;          /* Recent page size high-water mark */
+    struct pipe *pipe;      /* Page pipeline, if threaded */
 } PDF;
 
 #define QS(str) (str), (sizeof (str) -1)
 
+/* Current output position */
+
+#define otell(pdf) ((pdf)->opos + (t_fpos) (pdf)->oused)
+
 /* Used to initialize new contexts.
  * Note that any strings:
  *  Must be copied to malloc'ed memory if a user can pdf_set them
@@ -699,9 +959,17 @@ static const PDF defaults = {
         NULL,                    /* formfile */
         0.500,                   /* barh */
         0,                       /* lines per page (requested) */
+        0,                       /* threads */
+        PDF_CODEC_LZW,           /* codec */
+        6,                       /* level */
+        0,                       /* compact */
+        0,                       /* prealloc */
+        PDF_SYNC_NONE,           /* durability */
     },
     { CHS_ASCII, CHS_ASCII, CHS_LATIN_1, CHS_LATIN_1 }, /* G0-G3 */
     CHS_ASCII, CHS_LATIN_1,      /* GL, GR */
+    0, 2,                        /* G0 in GL, G2 in GR */
+    { 0 },                       /* xlat, built by setxlat */
 };
 
 #define ps ((PDF *)pdf)
@@ -729,6 +997,16 @@ typedef struct {
     size_t ssize, sused;
 } IMG;
 
+/* What an encoded form image depends on */
+
+typedef struct {
+    const char *path;
+    int64_t size, mtime;    /* Of the image file */
+    int64_t mtimensec;      /* Nanoseconds of mtime, 0 if unknown */
+    uint64_t ino;           /* Inode, 0 if unknown */
+    int codec, level, uncompressed;
+} IMGKEY;
+
 /* Forward references */
 
 static int dupstrs (PDF *pdf);
@@ -738,11 +1016,68 @@ static int pdfset ( PDF *pdf, int arg, va_list ap);
 static int checkfont (const char *newfont);
 static void pdfinit (PDF *pdf);
 static int checkupdate (PDF *pdf);
+static int rdupdate (PDF *pdf);
+static char *rdxref (PDF *pdf, t_fpos pos, t_fpos *prev);
+static int vopen (PDF *pdf, t_fpos size);
+static void seekback (PDF *pdf, t_fpos pos);
+static int snapshot (PDF *pdf, const char *filename, int update);
+static int fcopy (FILE *in, FILE *out, t_fpos pos, t_fpos len);
+static int oopen (PDF *pdf);
+static void owrite (PDF *pdf, const char *data, size_t len);
+static void oprintf (PDF *pdf, const char *fmt, ...);
+static void oseek (PDF *pdf, t_fpos pos);
+static int oflush (PDF *pdf);
+static void oput (PDF *pdf, const char *data, size_t len);
+static int osync (PDF *pdf);
+static void vclose (PDF *pdf);
+static const char *vline (PDF *pdf, const char *p);
 static void wrhdr (PDF *pdf);
 static void wrpage (PDF *pdf);
+static void prerender (PDF *pdf);
+static void rdpage (PDF *pdf, char **buf, size_t *bufsize, size_t *used,
+                    GRID *g, unsigned int nlines);
+static void rdline (PDF *pdf, char **buf, size_t *bufsize, size_t *used,
+                    const uint8_t *text, unsigned int len);
+static size_t scanplain (const uint8_t *text, size_t length);
+static void rdcompact (PDF *pdf, char **buf, size_t *bufsize, size_t *used,
+                       const uint8_t *text, unsigned int len, unsigned int *skip);
+static void rdtext (PDF *pdf, char **buf, size_t *bufsize, size_t *used,
+                    const uint8_t *text, size_t len);
+static int cpcontent (PDF *pdf, char *pagebuf, size_t pbused);
+static void wrcontent (PDF *pdf, unsigned int obj, const char *dict, char *pagebuf, size_t pbused,
+                       int codec, char *cbuf, size_t cused);
+static void phkey (const char *pagebuf, size_t pbused, PHKEY *k);
+static void phhash (const char *pagebuf, size_t pbused, PHKEY *k);
+static int phseen (const PHTAB *t, const PHKEY *k);
+static unsigned int phfind (const PHTAB *t, const PHKEY *k);
+static unsigned int phlookup (const PHTAB *t, PHKEY *k, const char *pagebuf, size_t pbused);
+static void phadd (PHTAB *t, const PHKEY *k, unsigned int obj);
+static void ptstart (PDF *pdf);
+static void wrleaf (PDF *pdf, unsigned int content);
+static void ptadd (PDF *pdf, unsigned int l, unsigned int obj, unsigned int count);
+static void ptflush (PDF *pdf);
+static void wrlist (PDF *pdf, unsigned int obj, const unsigned int *kids, unsigned int n,
+                    unsigned int count, unsigned int parent);
+static void setobj (PDF *pdf, unsigned int obj);
+static void wrxref (PDF *pdf, unsigned int first, unsigned int count);
+static int objcmp (const void *a, const void *b);
+static void wrform (PDF *pdf, unsigned int obj, unsigned int fonts);
+#ifdef USE_THREADS
+static int pipe_start (PDF *pdf);
+static void pipe_page (PDF *pdf);
+static int pipe_stop (PDF *pdf);
+static void pipe_free (PDF *pdf);
+static void *pipe_render (void *arg);
+static void *pipe_write (void *arg);
+#endif
 static void setform (PDF *pdf);
+static void formkey (PDF *pdf, FORMKEY *key);
+static int formget (PDF *pdf, const FORMKEY *key);
+static void formput (const FORMKEY *key, const char *buf, size_t len);
 static void barform (PDF *pdf);
 static void imageform (PDF *pdf);
+static int imgget (PDF *pdf, const IMGKEY *key, double *width, double *height);
+static void imgput (const IMGKEY *key, double width, double height, char *obj, size_t len);
 static int jpeg_image (PDF *pdf, IMG *img);
 static int png_image (PDF *pdf, IMG *img);
 static uint32_t crc32 (uint32_t initial, const uint8_t *string, uint32_t length);
@@ -752,14 +1087,32 @@ static unsigned int getint (PDF *pdf, char *buf, const char *name, const char **
 static char *getstr (PDF *pdf, char *buf, const char *name);
 static char *getstr (PDF *pdf, char *buf, const char *name);
 static int parsestr (PDF *pdf, const char *string, size_t length, int initial);
+static size_t scanprint (const char *string, size_t length);
+static void storeprint (PDF *pdf, const char *string, size_t length);
 static void designateChs (PDF *pdf, const int set, const uint16_t size,
                           const uint16_t nint, const char *ints, const char final );
+static void invokeChs (PDF *pdf, const int right, const unsigned int set);
+static void setxlat (PDF *pdf);
 static int pdfclose (PDF *pdf, int checkpoint);
+static int closefiles (PDF *pdf, int r, int copy);
 static void pdf_free (PDF *pdf);
 static void wrstmf (PDF *pdf, char **buf, size_t *len, size_t *used, const char *fmt, ...);
+static char *fmts (char *p, const char *string, size_t length);
+static char *fmtu (char *p, uint64_t v);
+static char *fmtz (char *p, uint64_t v, unsigned int width);
+static char *fmtf (char *p, double d, unsigned int prec);
 static void wrstm (PDF *pdf, char **buf, size_t *bufsize, size_t *used, char *string, size_t length);
 static void wrstw (PDF *pdf, short **buf, size_t *bufsize, size_t *used, short *string, size_t length);
+static void *growbuf (PDF *pdf, void *buf, size_t *size, size_t need, size_t elsize);
+static void trimpage (PDF *pdf, char **pagebuf, size_t *pbsize, size_t pbused,
+                      char **lzwbuf, size_t *lzwsize);
+static void *pool_get (size_t min, size_t *size);
+static void pool_put (void *buf, size_t size);
 static t_fpos readobj (PDF *pdf, unsigned int obj, char **buf, size_t *len);
+static void gridsize (PDF *pdf, GRID *g, unsigned int rows, unsigned int cols);
+static void gridadd (PDF *pdf, GRID *g, unsigned int l, const short *text, size_t textlen);
+static void gridclear (GRID *g, unsigned int r);
+static void gridfree (GRID *g);
 static void add2line (PDF *pdf, const short *text, size_t textlen);
 static void circle (PDF *pdf, double x, double y, double r);
 static int xstrcasecmp (const char *s1, const char *s2);
@@ -792,28 +1145,30 @@ static int xstrcasecmp (const char *s1, const char *s2);
 #define LZW_MAXBITS   (12)                /* Largest permitted codesize */
 #define LZW_DSIZE     (1 << LZW_MAXBITS)  /* Size of LZW directory */
 
-typedef uint16_t t_lzwCode;
+/* The directory is an open-addressed hash table keyed on (prefix, char).
+ * It is twice the size of the directory, so probe sequences are short.
+ */
 
-#define TREE_NULL ((t_lzwCode)~0u)        /* Null code in directory tree */
+#define LZW_HBITS     (LZW_MAXBITS +1)    /* Size of hash table (bits) */
+#define LZW_HSIZE     (1 << LZW_HBITS)
+#define LZW_HASH(key) ((uint32_t)((key) * 2654435761u) >> (32 - LZW_HBITS))
 
-typedef struct {
-    t_lzwCode  prev;
-    t_lzwCode  first;
-    t_lzwCode  next;
-    short      ch;
-} t_lzwNode;
+typedef uint16_t t_lzwCode;
+
+#define TREE_NULL ((t_lzwCode)~0u)        /* Null code in directory */
 
 typedef struct {
     FILE         *fh;                     /* File handle for output */
     uint8_t      **outbuf;                /* Buffer for output */
     size_t       *outsize;                /* Size of output buffer */
     size_t       *outused;                /* Data in output buffer */
-    uint32_t      bitbuf;                 /* Bit packing buffer */
-#if LZ_MAXBITS > 32
-#error t_lzw.bitbuf is too small to hold LZ_MAXBITS, reduce or find a larger datatype
+    uint64_t      bitbuf;                 /* Bit packing buffer */
+#if LZW_MAXBITS > 32
+#error t_lzw.bitbuf is too small to hold LZW_MAXBITS, reduce or find a larger datatype
 #endif
     unsigned int  nbits;                  /* Number of bits pending in buffer */
-    t_lzwNode     dict[LZW_DSIZE];        /* Standard LZW prefix directory */
+    uint32_t      key[LZW_HSIZE];         /* (prefix << 8 | char) +1, 0 if free */
+    t_lzwCode     code[LZW_HSIZE];        /* Code for key */
     t_lzwCode     assigned;               /* Highest code assigned */
     uint16_t      codesize;               /* Size of current code (bits) */
 } t_lzw;
@@ -825,14 +1180,17 @@ static void lzw_init(t_lzw *lzw, int mode, ...);
 #define LZW_BUFALCQ (512)
 
 static void lzw_encode (t_lzw *lzw, char *stream, size_t len);
-static t_lzwCode lzw_add_str (t_lzw *lzw, t_lzwCode code, char c);
-static t_lzwCode lzw_lookup_str (t_lzw *lzw, t_lzwCode code, char c);
+static t_lzwCode lzw_add_str (t_lzw *lzw, unsigned int slot, t_lzwCode code, int c);
+static t_lzwCode lzw_lookup_str (t_lzw *lzw, t_lzwCode code, int c, unsigned int *slot);
+static void lzw_putword (t_lzw *lzw, uint32_t word, unsigned int nbytes);
 static void lzw_writebits (t_lzw *lzw, unsigned int bits, unsigned int nbits);
 static void lzw_flushbits (t_lzw *lzw);
 
 /* *** End LZW *** */
 
 static int encstm (PDF *pdf, char *stream, size_t len);
+static void deflate (PDF *pdf, const char *stream, size_t len,
+                     char **buf, size_t *bufsize, size_t *bufused);
 
 
 #if defined (PDF_MAIN) || defined (FONT_IMPORT)
@@ -841,6 +1199,18 @@ static int encstm (PDF *pdf, char *stream, size_t len);
 
 #define SET(_key, _code, _type, _def, _help) { "-" #_key, PDF_##_code, AT_##_type, #_def, #_help },
 
+/* Options that are processed by the utility, rather than by pdf_set */
+
+#define OPT(_key, _code, _type, _def, _help) { "--" #_key, OPT_##_code, AT_##_type, #_def, #_help },
+#define OPT_BASE     (1000)
+#define OPT_NOSBE    (OPT_BASE + 0)
+#define OPT_SPOOL    (OPT_BASE + 1)
+#define OPT_CCLINES  (OPT_BASE + 2)
+#define OPT_FOLLOW   (OPT_BASE + 3)
+#define OPT_JOBSTREAM (OPT_BASE + 4)
+#define OPT_CKEVERY  (OPT_BASE + 5)
+#define OPT_CKINTERVAL (OPT_BASE + 6)
+
 typedef struct {
     const char *const keyword;
     int arg;
@@ -848,6 +1218,7 @@ typedef struct {
 #define AT_STRING  1
 #define AT_NUMBER  2
 #define AT_INTEGER 3
+#define AT_FLAG    4  /* No argument */
     const char *const def;
     const char *const help;
 } ARG;
@@ -855,37 +1226,122 @@ static const ARG argtable [] = {
     SET (bar,     BAR_HEIGHT,     NUMBER,  0.500in,     (Specifies the height of the bar on forms.))
     SET (bottom,  BOTTOM_MARGIN,  NUMBER,  0.500in,     (Specifies the height of the bottom margin in inches.  Below this there is no bar.))
     SET (columns, COLS,           INTEGER, 132,         (Specifies the number of columns to be printed.  Used to center output))
+    SET (compact, COMPACT,        INTEGER, 0,           (Specifies compact encoding of page text when 1: trailing blanks are dropped and blank lines become moves.  Long runs of spaces also become moves when -compress is NONE.  The pages look the same.))
+    SET (compress, COMPRESSION,   STRING,  LZW,         (Specifies the compression of page and image streams.  One of:\nLZW, FLATE (smaller, slower), AUTO (the smaller of the two for each page) or NONE.))
     SET (cpi,     CPI,            NUMBER,  10,          (Specifies the characters per inch (horizontal pitch).  Fractional pitch is supported.))
+    SET (durability, DURABILITY,  STRING,  none,        (Specifies when the output file is synced to storage, so that it survives a crash of the system.  One of:\nNONE, JOB (when it is closed), CHECKPOINT (also at each checkpoint) or PAGE (also after each page is written).))
     SET (font,    TEXT_FONT,      STRING,  Courier,     (Specifies the name of the font to use for rendering the input data.  Accepted are:%F))
     SET (form,    FORM_TYPE,      STRING,  greenbar,    (Specifies the form background to be applied. One of:%fPlain is white page.))
     SET (image,   FORM_IMAGE,     STRING,  <none>,      (Specifies a .jpg or .png image to be used as the form background\nIt will be scaled to fill the area within the margins.\nIt is rendered over the form; for just the image, use -form Plain.))
     SET (length,  PAGE_LENGTH,    NUMBER,  11.000in,    (Specifies the length of the page in inches, inclusive of all margins.  Calculated automatically if -lpp is used.))
+    SET (level,   FLATE_LEVEL,    INTEGER, 6,           (Specifies the effort of FLATE and AUTO compression, from 1 (fastest) to 9 (smallest).))
     SET (lfont,   LABEL_FONT,     STRING,  Times-Bold,  (Specifies the name of the font used to render labels on the form))
     SET (lno,     LNO_WIDTH,      NUMBER,  0.100in,     (Specifies the width of the line number column on the form; 0 to omit cols.))
     SET (lpi,     LPI,            INTEGER, 6,           (Specifies the lines per inch (vertical pitch): 6 or 8 are supported.))
     SET (lpp,     LPP,            INTEGER, 66,          (Specifies the page length in lines.  If used, takes precedence over length.))
     SET (nfont,   LNO_FONT,       STRING,  Times-Roman, (Specifies the name of the font used to render the numbers on the form))
+    SET (preallocate, PREALLOCATE, INTEGER, 0,          (Specifies, in megabytes, how far ahead of the data space is reserved for the output file, so that a file that is appended to for a long time is not fragmented.\n0 does not reserve space.  Only used on Linux.))
     SET (require, FILE_REQUIRE,   STRING,  new,         (Specifies how to treat the output file.  \nNEW will create the file, or if it exists, the file must be empty.\nAPPEND will create the file, or if it exists and is in PDF fomat, data will be appended.\nREPLACE will completely replace the contents of an existing file.))
     SET (side,    SIDE_MARGIN,    NUMBER,  0.470,       (Specifies the width of the tractor feed margin on each side of the page.))
+    SET (threads, THREADS,        INTEGER, 0,           (Specifies the number of threads that render and compress pages while the input is read.\nPages are written in order by another thread.  0 does all the work in one thread.\nUse the number of cores for large files.))
     SET (title,   TITLE,          STRING, ("Lineprinter data"),
                                                         (Specifies the title embedded in the PDF document))
     SET (tof,     TOF_OFFSET,     INTEGER, (topmargin (6 lines at 6LPI, 8 at 8LPI)),
                                                         (Specifies the offset of the logical top of form from the top of page.\nThis is the line on to which <FF> advances, similar to the offset that\noccurs when an operator positions a form with respect to a carriage))
     SET (top,     TOP_MARGIN,     NUMBER,  1.000in,     (Specifies the height of the top margin in inches -- above first bar.))
     SET (width,   PAGE_WIDTH,     NUMBER,  14.875in,    (Specifies the width of the page in inches, inclusive of all margins))
+
+    OPT (cclines, CCLINES,        INTEGER, 60,          (With --nosbe, specifies the page length in lines assumed by the C (skip to last line) control.))
+    OPT (checkpoint-every, CKEVERY, INTEGER, 0,         (Checkpoints the output file after this many pages, so it can be viewed while being written and survives a crash.\n0 does not checkpoint by pages.))
+    OPT (checkpoint-interval, CKINTERVAL, INTEGER, 0,   (Checkpoints the output file when there is new output and this many seconds have passed since the last checkpoint.\n0 does not checkpoint by time.))
+    OPT (follow,  FOLLOW,         FLAG,    off,         (Keeps reading the input file as it grows, until SIGINT or SIGTERM.\nOnly one input file may be specified.))
+    OPT (jobstream, JOBSTREAM,    FLAG,    off,         (Reads a stream of print jobs from stdin, each written to its own file.\nThe stream consists of the commands\n  begin job filename\n  data n      followed by n bytes of print data\n  end job\n  quit\nEach command is a line.  No input or output files are specified.))
+    OPT (nosbe,   NOSBE,          FLAG,    off,         (The input is NOS/BE printer output (LP5xx_C12_E5) with ANSI carriage control in column 1.\nA job ends with the second END OF LIST line.))
+    OPT (spool,   SPOOL,          STRING,  <none>,      (With --nosbe, writes each job to a new file in this directory, named print_YYYY_MM_DD_HH_MM_SS.pdf\nNo output file is specified.))
 };
 
-static void do_file (PDF_HANDLE pdf, FILE *fh, const char *filename);
+/* Utility options */
+
+static struct {
+    int nosbe;                  /* Input has NOS/BE carriage control */
+    const char *spool;          /* Directory for per-job output files */
+    int follow;                 /* Wait for input file to grow */
+    int jobstream;              /* Jobs framed by commands on stdin */
+    unsigned int cclines;       /* Page length assumed by carriage control */
+    unsigned int ckevery;       /* Pages between checkpoints */
+    unsigned int ckinterval;    /* Seconds between checkpoints */
+} opts = { 0, NULL, 0, 0, 60, 0, 0 };
+
+/* Input and NOS/BE print job state */
+
+typedef struct {
+    PDF_HANDLE pdf;             /* Output of current (or last) job */
+    char name[FILENAME_MAX];    /* Its file name, when spooling */
+    int argc;                   /* Command line, for options of first file */
+    char **argv;
+    int injob;                  /* A job is being output */
+    unsigned int njobs;         /* Jobs started */
+    unsigned int eoj;           /* END OF LIST lines seen in job */
+    unsigned int pages;         /* Page ejects seen in job */
+    unsigned int lines;         /* Lines advanced on current page */
+    char *ibuf;                 /* Input buffer */
+    size_t isize;
+    char *lbuf;                 /* Partial line carried between reads */
+    size_t lsize, lused;
+    char *obuf;                 /* Translated data for pdf_print */
+    size_t osize, oused;
+    size_t ckpage, ckline;      /* Position of the last checkpoint */
+    time_t cktime;              /* Time of the last checkpoint */
+} JOB;
+
+/* Job trailer, printed twice at the end of each job */
+#define NOSBE_EOJ " //// END OF LIST ////  "
+
+/* Size of input reads and output batches */
+#define INPUT_BUFSIZE (256 * 1024)
+
+/* --follow polling interval (ms), where change notification is not available */
+#define FOLLOW_POLL_MS (250)
+
+/* Set by SIGINT/SIGTERM to end --follow */
+static volatile sig_atomic_t stopping = 0;
+
+static void do_file (JOB *job, FILE *fh, const char *filename);
+static void do_follow (JOB *job, const char *filename);
+static void do_jobstream (JOB *job);
+static void do_checkpoint (JOB *job, int force);
+static void ckreset (JOB *job);
+static int stream_begin (JOB *job, const char *name);
+static void stop_follow (int sig);
+static size_t do_read (JOB *job, FILE *fh);
+static size_t readin (FILE *fh, char *buf, size_t size);
+static void nosbe_data (JOB *job, const char *data, size_t len);
+static void nosbe_line (JOB *job, const char *line, size_t len);
+static void nosbe_begin (JOB *job);
+static void nosbe_end (JOB *job);
+static void nosbe_flush (JOB *job);
+static void nosbe_out (JOB *job, const char *data, size_t len);
+static const ARG *findarg (const char *sw);
+static void setopt (const ARG *arg, const char *value);
+static void setopts (PDF_HANDLE pdf, int argc, char **argv);
 static int usage (const ARG *argtable, size_t nargs);
 static void print_hlplist (FILE *file, const char *const *list, int adjcase);
 
 int main (int argc, char **argv, char **env) {
-    PDF_HANDLE pdf;
+    PDF_HANDLE pdf = NULL;
     int i, of;
     int r;
-    char *infile = NULL, *outfile = NULL;
+    char *outfile = NULL;
+    JOB job;
+
+    /* Utility options are processed first, as they determine
+     * what the arguments mean.  pdf_set options are applied
+     * once the output file is open.
+     */
 
     for (i = 1; i < argc; i++) {
+        const ARG *a;
+
         if (!strcmp (argv[i], "--")) {
             i++;
             break;
@@ -893,1973 +1349,4065 @@ int main (int argc, char **argv, char **env) {
         if (!strcmp (argv[i], "--help") || !strcmp (argv[i], "-h")) {
             exit (usage(argtable, DIM(argtable)));
         }
-        if (argv[i][0] == '-') {
-            i++;
+        if (argv[i][0] != '-') {
+            break;
+        }
+        if (!(a = findarg (argv[i]))) {
+            fprintf (stderr, "Unknown switch %s, --help for usage\n", argv[i]);
+            exit (3);
+        }
+        if (a->atype == AT_FLAG) {
+            setopt (a, NULL);
             continue;
         }
-        break;
-    }
-
-    of = 0;
-    if (i < argc) {
-        of = argc -1;
-
-        if (strcmp (argv[of], "-")) {
-            outfile = argv[of];
+        if (!argv[++i]) {
+            fprintf (stderr, "? %s requires an argument\n", argv[i-1]);
+            exit (3);
         }
+        setopt (a, argv[i]);
     }
 
-    if (!outfile) {
-        outfile = "-";
-    }
-    pdf = pdf_open (outfile);
-    if (!pdf) {
-        pdf_perror (NULL, outfile);
-        exit (2);
-    }
-
-    for (i = 1; i < argc; i++) {
-        const char *sw = argv[i];
-        size_t k;
+    memset (&job, 0, sizeof (job));
+    job.argc = argc;
+    job.argv = argv;
+    ckreset (&job);
 
-        if (!strcmp (sw, "--")) {
-            i++;
-            break;
+    if (opts.jobstream) {
+        if (opts.nosbe || opts.follow || i < argc) {
+            fprintf (stderr, "? --jobstream does not accept --nosbe, --follow or files\n");
+            exit (3);
         }
-        if (sw[0] != '-') {
-            break;
+        of = argc;
+    } else if (opts.spool) {
+        struct stat statbuf;
+
+        if (!opts.nosbe) {
+            fprintf (stderr, "? --spool requires --nosbe\n");
+            exit (3);
         }
-        if (!argv[++i]) {
-            fprintf (stderr, "? %s requires an argument\n", argv[i-1]);
+        if (stat (opts.spool, &statbuf) || !(statbuf.st_mode & S_IFDIR)) {
+            fprintf (stderr, "? spool directory %s does not exist\n", opts.spool);
             exit (3);
         }
 
-        for (k = 0; k < DIM (argtable); k++) {
-            if (!strcmp (sw, argtable[k].keyword) ) {
-                double arg;
-                char *ep;
-                long iarg;
+        /* Output files are opened as jobs start; all arguments are input */
 
-                switch (argtable[k].atype) {
-                case AT_STRING:
-                    r = pdf_set (pdf, argtable[k].arg, argv[i]);
-                    break;
-                case AT_INTEGER:
-                    iarg = strtol (argv[i], &ep, 10);
-                    if (!*argv[i] ||*ep || ep == argv[i]) {
-                        fprintf (stderr, "? not an integer for %s value: %s\n",
-                                 argtable[k].keyword, ep);
-                        exit (3);
-                    }
-                    arg = (double) iarg;
-                    r = pdf_set (pdf, argtable[k].arg, arg);
-                    break;
-                case AT_NUMBER:
-                    if (!*argv[i]) {
-                        fprintf (stderr, "?Missing value for %s\n", argtable[k].keyword);
-                        exit (3);
-                    }
-                    arg = strtod (argv[i], &ep);
-                    if (*ep) {
-                        if (!strcmp (ep, "cm")) {
-                            arg /= 2.54;
-                        } else {
-                            if (!strcmp (ep, "mm")) {
-                                arg /= 25.4;
-                            } else if (strcmp (ep, "in")) {
-                                fprintf (stderr, "?Unknown qualifier for %s value: %s\n",
-                                                 argtable[k].keyword,  ep);
-                                exit (3);
-                            }
-                        }
-                    }
-                    r = pdf_set (pdf, argtable[k].arg, arg);
-                    break;
-                default:
-                    exit (3);
-                }
-                if (r != PDF_OK) {
-                    pdf_perror (pdf, argv[i]);
-                    exit (3);
-                }
-                break;
+        of = argc;
+    } else {
+        of = 0;
+        if (i < argc) {
+            of = argc -1;
+
+            if (strcmp (argv[of], "-")) {
+                outfile = argv[of];
             }
         }
-        if (k < DIM (argtable)) {
-            continue;
-        }
 
-        fprintf (stderr, "Unknown switch %s, --help for usage\n", sw);
-        exit (3);
+        if (!outfile) {
+            outfile = "-";
+        }
+        pdf = pdf_open (outfile);
+        if (!pdf) {
+            pdf_perror (NULL, outfile);
+            exit (2);
+        }
+        setopts (pdf, argc, argv);
     }
+    job.pdf = pdf;
 
     /* And after all that: */
 
-    if (i >= of ) {
-        do_file (pdf, stdin, "<stdin>");
+    if (opts.jobstream) {
+        do_jobstream (&job);
+    } else if (opts.follow) {
+        if (of - i != 1 || !strcmp (argv[i], "-")) {
+            fprintf (stderr, "? --follow requires exactly one input file\n");
+            exit (3);
+        }
+        do_follow (&job, argv[i]);
+    } else if (i >= of ) {
+        do_file (&job, stdin, "<stdin>");
     } else {
         while (i < of) {
-            infile = argv[i];
                 if (!strcmp (argv[i], "-")) {
-                    do_file (pdf, stdin, "<stdin>");
+                    do_file (&job, stdin, "<stdin>");
                 } else {
-                    FILE *fh = fopen (argv[i], "r" );
+                    FILE *fh = fopen (argv[i], opts.nosbe? "rb": "r" );
                     if (!fh) {
                         pdf_perror (NULL, argv[i]);
                         exit (1);
                     }
-                    do_file (pdf, fh, argv[i]);
+                    do_file (&job, fh, argv[i]);
                     fclose (fh);
                 }
             i++;
         }
     }
 
-    r = pdf_close (pdf);
-    if (r) {
-        pdf_perror (NULL, "pdf_close failed");
-        exit (4);
+    if (opts.nosbe) {
+        if (job.lused) {                    /* Unterminated last line */
+            nosbe_line (&job, job.lbuf, job.lused);
+            job.lused = 0;
+        }
+        nosbe_flush (&job);
+        pdf = job.pdf;
+        free (job.lbuf);
+        free (job.obuf);
+    }
+    free (job.ibuf);
+
+    if (pdf) {
+        r = pdf_close (pdf);
+        if (r) {
+            pdf_perror (NULL, "pdf_close failed");
+            exit (4);
+        }
     }
 
     exit (0);
 }
 
-/* Process an input file */
+/* Find a switch in the argument table */
 
-static void do_file (PDF_HANDLE pdf, FILE *fh, const char *filename) {
-    int c;
-    size_t page = 0, line = 0;
-    char lbuf[60];
-    long bc = 0;
+static const ARG *findarg (const char *sw) {
+    size_t k;
+
+    for (k = 0; k < DIM (argtable); k++) {
+        if (!strcmp (sw, argtable[k].keyword) ) {
+            return argtable + k;
+        }
+    }
+    return NULL;
+}
 
-    while (fgets (lbuf, sizeof (lbuf), fh)) {
-        size_t len = strlen (lbuf);
-        bc += len;
+/* Process a utility option.  pdf_set options are ignored here.
+ */
 
-        c = pdf_print (pdf, lbuf, len);
-        if (c) {
-            pdf_perror (pdf, "pdf_print failed");
-            exit (4);
+static void setopt (const ARG *arg, const char *value) {
+    long iarg;
+    char *ep;
+
+    switch (arg->arg) {
+    case OPT_NOSBE:
+        opts.nosbe = 1;
+        break;
+
+    case OPT_SPOOL:
+        opts.spool = value;
+        break;
+
+    case OPT_FOLLOW:
+        opts.follow = 1;
+        break;
+
+    case OPT_JOBSTREAM:
+        opts.jobstream = 1;
+        break;
+
+    case OPT_CCLINES:
+        iarg = strtol (value, &ep, 10);
+        if (!*value || *ep || iarg < 40 || iarg > 80) {
+            fprintf (stderr, "? %s must be an integer from 40 to 80: %s\n",
+                     arg->keyword, value);
+            exit (3);
+        }
+        opts.cclines = (unsigned int) iarg;
+        break;
+
+    case OPT_CKEVERY:
+    case OPT_CKINTERVAL:
+        iarg = strtol (value, &ep, 10);
+        if (!*value || *ep || iarg < 0 || iarg > 1000000) {
+            fprintf (stderr, "? %s must be an integer from 0 to 1000000: %s\n",
+                     arg->keyword, value);
+            exit (3);
+        }
+        if (arg->arg == OPT_CKEVERY) {
+            opts.ckevery = (unsigned int) iarg;
+        } else {
+            opts.ckinterval = (unsigned int) iarg;
+        }
+        break;
+
+    default:
+        break;
+    }
+    return;
+}
+
+/* Apply the pdf_set options on the command line to a handle.
+ */
+
+static void setopts (PDF_HANDLE pdf, int argc, char **argv) {
+    int i, r;
+
+    for (i = 1; i < argc; i++) {
+        const char *sw = argv[i];
+        const ARG *a;
+        double arg;
+        char *ep;
+        long iarg;
+
+        if (!strcmp (sw, "--")) {
+            break;
+        }
+        if (sw[0] != '-') {
+            break;
+        }
+        if (!(a = findarg (sw))) {
+            fprintf (stderr, "Unknown switch %s, --help for usage\n", sw);
+            exit (3);
+        }
+        if (a->atype == AT_FLAG) {
+            continue;
+        }
+        if (!argv[++i]) {
+            fprintf (stderr, "? %s requires an argument\n", argv[i-1]);
+            exit (3);
+        }
+        if (a->arg >= OPT_BASE) {
+            continue;
+        }
+
+        switch (a->atype) {
+        case AT_STRING:
+            r = pdf_set (pdf, a->arg, argv[i]);
+            break;
+        case AT_INTEGER:
+            iarg = strtol (argv[i], &ep, 10);
+            if (!*argv[i] ||*ep || ep == argv[i]) {
+                fprintf (stderr, "? not an integer for %s value: %s\n",
+                         a->keyword, ep);
+                exit (3);
+            }
+            arg = (double) iarg;
+            r = pdf_set (pdf, a->arg, arg);
+            break;
+        case AT_NUMBER:
+            if (!*argv[i]) {
+                fprintf (stderr, "?Missing value for %s\n", a->keyword);
+                exit (3);
+            }
+            arg = strtod (argv[i], &ep);
+            if (*ep) {
+                if (!strcmp (ep, "cm")) {
+                    arg /= 2.54;
+                } else {
+                    if (!strcmp (ep, "mm")) {
+                        arg /= 25.4;
+                    } else if (strcmp (ep, "in")) {
+                        fprintf (stderr, "?Unknown qualifier for %s value: %s\n",
+                                         a->keyword,  ep);
+                        exit (3);
+                    }
+                }
+            }
+            r = pdf_set (pdf, a->arg, arg);
+            break;
+        default:
+            exit (3);
+        }
+        if (r != PDF_OK) {
+            pdf_perror (pdf, argv[i]);
+            exit (3);
         }
     }
+    return;
+}
+
+/* Process an input file */
+
+static void do_file (JOB *job, FILE *fh, const char *filename) {
+    size_t page = 0, line = 0;
+    size_t bc;
+
+    bc = do_read (job, fh);
 
     if (bc) {
-        fprintf (stderr, "Read %lu characters from %s\n", bc, filename);
+        fprintf (stderr, "Read %lu characters from %s\n", (unsigned long)bc, filename);
     }
-    if (ferror (fh)) {
-        pdf_perror (NULL, "Error reading input");
+    if (!job->pdf || opts.spool) {
+        return;
     }
-    if (pdf_where (pdf, &page, &line)) {
-        pdf_perror (pdf, "Error getting position");
+    if (pdf_where (job->pdf, &page, &line)) {
+        pdf_perror (job->pdf, "Error getting position");
     }
-#if 0
-    pdf_checkpoint (pdf);
-#endif
+    do_checkpoint (job, 1);
     fprintf (stderr, "End of %s, at page %u line %u\n", filename, (int)page, (int)line);
     return;
 }
 
-/* Utility usage */
+/* Follow an input file as it is written.
+ *
+ * Everything available is read, then we wait for the file to be
+ * modified.  On Linux, inotify wakes us as soon as data is written;
+ * elsewhere, the file is polled.  If the file is truncated (e.g. the
+ * emulator restarted), reading resumes at the beginning.
+ *
+ * SIGINT or SIGTERM end the wait; the output is then closed normally.
+ */
 
-static int usage (const ARG *argtable, size_t nargs) {
-    size_t i;
+static void stop_follow (int sig) {
+    stopping = sig;
+}
 
-    fprintf (stderr, "Usage:\n\
-lpt2pdf [-options] infiles outile\n\
-\n\
-lpt2pdf will turn an ASCII input file into a PDF file on simulated paper.\n\
-\n\
-The defaults are for a standard lineprinter - 14.875 x 11.000 in,\n\
-6LPI, 10 CPI.  (Lines and Characters per inch.)\n\
-\n\
-Default is to read from stdin and write to stdout.  Because PDF is\n\
-a binary format, the output file must not be a terminal.\n\n"
+static void do_follow (JOB *job, const char *filename) {
+    FILE *fh;
+    size_t bc = 0;
+#ifdef USE_INOTIFY
+    int ifd;
+#endif
 #ifdef _WIN32
-"If the output file is stdout, an intermediate temporary files is used\n"
+    struct _stati64 statbuf;
+
+    signal (SIGINT, stop_follow);
+    signal (SIGTERM, stop_follow);
 #else
-"If the output file is not a regular file, an intermediate temporary file\n\
-is used.\n"
+    struct stat statbuf;
+    struct sigaction sa;
+
+    memset (&sa, 0, sizeof (sa));
+    sa.sa_handler = stop_follow;    /* No SA_RESTART: interrupt the wait */
+    sigemptyset (&sa.sa_mask);
+    sigaction (SIGINT, &sa, NULL);
+    sigaction (SIGTERM, &sa, NULL);
 #endif
-"'-' for either input or output is interpreted as stdin/stdout respectivey.\n"
-"Any output file must be seekable, generally a disk\n\
-\n\
-Options, naturally are optional:\n");
 
-    /* List options & their help from the table */
+    if (!(fh = fopen (filename, opts.nosbe? "rb": "r"))) {
+        pdf_perror (NULL, filename);
+        exit (1);
+    }
 
-    for (i = 0; i < nargs; i++, argtable++) {
-        char c;
-        const char *p;
+#ifdef USE_INOTIFY
+    /* Watch before reading, so no write is missed */
 
-        fprintf (stderr, "    %s %s\n        ", 
-                 argtable->keyword, (argtable->atype == AT_NUMBER)? "n.m":
-                                        (argtable->atype == AT_INTEGER)? "integer": "string");
-        p = argtable->help;
-        if (*p == '(') {
-            p++;
-        }
-        for (; *p && (*p != ')' || p[1]); p++) {
-            c = *p;
-            if (c == '%') {
-                c = *++p;
-                switch (c) {
-                case 'F':
-                    print_hlplist( stderr, pdf_get_fontlist (NULL), 0);
-                    break;
-                case 'f': {
-                    print_hlplist( stderr, pdf_get_formlist (NULL), 1);
-                    break;
-                }
-                default:
-                    fprintf (stderr, "Help bug\n");
-                    exit (7);
-                }
-                continue;
-            }
+    ifd = inotify_init1 (IN_CLOEXEC);
+    if (ifd < 0 || inotify_add_watch (ifd, filename, IN_MODIFY) < 0) {
+        pdf_perror (NULL, filename);
+        exit (1);
+    }
+#endif
+    fprintf (stderr, "Following %s\n", filename);
 
-            fputc (c, stderr);
-            if (c == '\n') {
-                fputs ("        ", stderr);
-            }
-        }
-        fputs ("\n        Default: ", stderr );
-        p = argtable->def;
-        if (*p == '(') {
-            p++;
+    while (!stopping) {
+        long pos;
+
+        bc += do_read (job, fh);
+        if (opts.nosbe) {
+            nosbe_flush (job);
         }
-        for (; *p && (*p != ')' || p[1]); p++) {
-            fputc (*p, stderr);
+        if (stopping) {
+            break;
         }
-        fputs ("\n\n", stderr);
-    }
 
-    fprintf (stderr, "\
-     Font notes:\n\
-        Fonts may only be one of of the default fonts supported by PDF.  The utility\n\
-        does not embed fonts in the PDF file (messy licensing issues.)\n\
-        Stick with monspace fonts for the correct effects.  Better to use -cpi.\n\
-        Font names are case-sensitive\n");
+        /* Wait for a change */
 
-    fprintf (stderr, "\n\
-    Linear dimensions may be specified in cm or mm by suffixing the number with cm or mm\n\
-    respectively.\n\
-\n\
-    In general, you don't need any options to get usable output\n\
-\n\
-    Bugs, praise to litt@acm.org\n\
-");
-    exit (0);
-}
+#ifdef USE_INOTIFY
+        {
+            char evbuf[4096];
+            struct pollfd pfd;
 
-static void print_hlplist (FILE *file, const char *const *list, int adjcase) {
-    if (list) {
-        fputc ('\n', file);
-        while (*list) {
-            const char *r = *list++;
-            char c = *r++;
-            fprintf (file, "            %c", adjcase? toupper (c): c);
-            while ((c = *r++)) {
-                fputc ((adjcase? tolower (c): c), file);
+            /* The timeout covers a signal that arrives just before the wait */
+
+            pfd.fd = ifd;
+            pfd.events = POLLIN;
+            if (poll (&pfd, 1, 1000) > 0) {
+                if (read (ifd, evbuf, sizeof (evbuf)) < 0 && errno != EINTR) {
+                    pdf_perror (NULL, "Error waiting for input");
+                    exit (1);
+                }
             }
-            fputc ('\n', file);
         }
-    }
-    return;
-}
-/* *** End of stand-alone utility *** */
+#elif defined (_WIN32)
+        Sleep (FOLLOW_POLL_MS);
+#else
+        usleep (FOLLOW_POLL_MS * 1000);
 #endif
 
-/* *** Start of public API *** */
+        /* Output that was waiting for the interval */
 
-/* open a pdf file for output (or update)
- * returns handle.  If NULL, see errno.
- * Attempts to open for update
- * Will not write until first output.
- * If I/O has to be done to a temporary file, the temporary
- * file is created.  In this case, the semantics are replace,
- * since temporary files are used only when output is a special file.
- */
+        do_checkpoint (job, 0);
 
-PDF_HANDLE pdf_open (const char *filename) {
-    PDF *pdf;
-    int r;
-    const char *p;
- #ifdef _WIN32
-    struct _stati64 statbuf;
+        /* Restart if the file was truncated */
+
+#ifdef _WIN32
+        pos = _lseek (_fileno (fh), 0, SEEK_CUR);
+        if (!_fstati64 (_fileno (fh), &statbuf) && statbuf.st_size < pos) {
+            _lseek (_fileno (fh), 0, SEEK_SET);
 #else
-   struct stat statbuf;
+        pos = (long) lseek (fileno (fh), 0, SEEK_CUR);
+        if (!fstat (fileno (fh), &statbuf) && statbuf.st_size < pos) {
+            lseek (fileno (fh), 0, SEEK_SET);
 #endif
-
-    if (!filename) {
-        errno = E(BAD_FILENAME);
-        return NULL;
-    }
-
-    pdf = (PDF *) malloc (sizeof (PDF));
-    if (!pdf) {
-        return NULL;
+            job->lused = 0;
+            fprintf (stderr, "%s was truncated, restarting\n", filename);
+        }
     }
-    memcpy (pdf, &defaults, sizeof (PDF));
 
-    if (!strcmp (filename, "-")) {
-#ifdef _WIN32                                   /* stdout is probably not seekable */
-        pdf->flags |= PDF_TMPFILE;
-        _setmode (_fileno (stdout), _O_BINARY);
+#ifdef USE_INOTIFY
+    close (ifd);
 #endif
-        pdf->pdf = stdout;
-    } else {    
-        p = strrchr (filename, '.');
-        if (p) {
-            const char *fn, *ext = "pdf";
-            int islc = islower (p[1]);
-            for (fn = p + 1;
-#if defined (VMS)
-                           (*fn && (*fn != ';'));
-#else
-                            *fn;
+    fclose (fh);
+    fprintf (stderr, "Read %lu characters from %s, stopping\n", (unsigned long)bc, filename);
+    return;
+}
+
+/* Process a stream of jobs from stdin.
+ *
+ * Each job is framed by commands:
+ *   begin job <file>
+ *   data <n>           followed by exactly n bytes
+ *   end job
+ *   quit
+ *
+ * The process and the PDF handle persist across jobs.  When a job ends,
+ * its file is completed with pdf_reopen; the next job's file is created
+ * with pdf_newfile, which inherits the settings and the form graphics.
+ * Errors are reported, and affect only the current job.
+ */
+
+static void do_jobstream (JOB *job) {
+    char cmd[FILENAME_MAX + 32];
+    PDF_HANDLE failed = NULL;
+
+    job->isize = INPUT_BUFSIZE;
+    if (!(job->ibuf = (char *) malloc (job->isize))) {
+        pdf_perror (NULL, "Allocating input buffer");
+        exit (4);
+    }
+#ifdef _WIN32
+    _setmode (_fileno (stdin), _O_BINARY);
 #endif
-                             fn++, ext++) {
-                if ((islc? (*fn != *ext): (*fn != toupper (*ext)))) {
-                    free (pdf);
-                    errno = E(BAD_FILENAME);
-                    return NULL;
-                }
+
+    while (fgets (cmd, sizeof (cmd), stdin)) {
+        size_t len = strlen (cmd);
+        unsigned long count;
+        char *ep;
+
+        while (len && (cmd[len-1] == '\n' || cmd[len-1] == '\r')) {
+            cmd[--len] = '\0';
+        }
+
+        if (!strncmp (cmd, "data ", 5)) {
+            count = strtoul (cmd + 5, &ep, 10);
+            if (ep == cmd + 5 || *ep) {
+                fprintf (stderr, "? Invalid data count: %s\n", cmd);
+                break;                      /* Framing is lost */
             }
-            if (*ext) {
-                free (pdf);
-                errno = E(BAD_FILENAME);
-                return NULL;
+            if (!job->injob) {
+                fprintf (stderr, "? data outside of a job, %lu bytes ignored\n", count);
             }
-        } else {
-            free (pdf);
-            errno = E(BAD_FILENAME);
-        }
-        pdf->pdf = pdf_open_exclusive (filename, "rb+");
-    }
+            while (count) {
+                size_t n = (count < job->isize)? (size_t) count: job->isize;
 
-    r = PDF_OK;
- #ifdef _WIN32
-    if (pdf->pdf && !_fstati64 (_fileno (pdf->pdf), &statbuf)) {
-       if (statbuf.st_mode & _S_IFDIR) {
-           r = E(BAD_FILENAME);
-       } else {
-           if (!(statbuf.st_mode & _S_IFREG)) {
-               pdf->flags |= PDF_TMPFILE;
-           }
-       }
-    }
-#else
-    if (pdf->pdf && !fstat (fileno (pdf->pdf), &statbuf)) {
-        if (S_ISDIR (statbuf.st_mode)) {
-            r = E(BAD_FILENAME);
-        } else {
-            if (!S_ISREG (statbuf.st_mode)) {
-                pdf->flags |= PDF_TMPFILE;
+                if ((n = fread (job->ibuf, 1, n, stdin)) == 0) {
+                    break;
+                }
+                count -= n;
+                if (job->injob && pdf_print (job->pdf, job->ibuf, n)) {
+                    pdf_perror (job->pdf, job->name);
+                    failed = job->pdf;
+                    job->pdf = NULL;
+                    job->injob = 0;
+                }
+            }
+            if (job->injob) {
+                do_checkpoint (job, 0);
+            }
+            if (count) {
+                fprintf (stderr, "? Input ended in data\n");
+                break;
             }
+            continue;
         }
-    }
-#endif
-    if (r != PDF_OK) {
-        if (pdf->pdf != stdout) {
-            fclose (pdf->pdf);
+        if (!strncmp (cmd, "begin job ", 10)) {
+            if (failed) {
+                (void) pdf_close (failed);
+                failed = NULL;
+            }
+            if (job->injob) {
+                fprintf (stderr, "? %s: job %s has not ended\n", cmd, job->name);
+                continue;
+            }
+            if (!stream_begin (job, cmd + 10)) {
+                job->injob = 1;
+                job->njobs++;
+            }
+            continue;
         }
-        free (pdf);
-        errno = r;
-        return NULL;
-    }
-    if (pdf->pdf && (pdf->flags & PDF_TMPFILE)) {
-#ifdef _WIN32
-        char *tname;
-        /* tmpfile() will only create files in the root directory, which is protected.
-         */
-        pdf->outf = pdf->pdf;
-        tname = _tempnam (NULL, "lpt2pdf");
-        if (tname) {
-            pdf->pdf = pdf_open_exclusive (tname, "xrb+");
-            if (pdf->pdf) {
-                pdf->tmpname = tname;
+        if (!strcmp (cmd, "end job")) {
+            if (failed) {
+                (void) pdf_close (failed);
+                failed = NULL;
+                continue;
             }
-        } else {
-            pdf->pdf = NULL;
-            errno = EINVAL;
+            if (!job->injob) {
+                fprintf (stderr, "? end job without begin job\n");
+                continue;
+            }
+            job->injob = 0;
+            if (pdf_reopen (job->pdf)) {
+                pdf_perror (job->pdf, job->name);
+                (void) pdf_close (job->pdf);
+                job->pdf = NULL;
+                continue;
+            }
+            fprintf (stderr, "End of job %u, %s\n", job->njobs, job->name);
+            continue;
+        }
+        if (!strcmp (cmd, "quit")) {
+            break;
+        }
+        if (len) {
+            fprintf (stderr, "? Unknown command: %s\n", cmd);
         }
-#else
-        pdf->outf = pdf->pdf;
-        pdf->pdf = tmpfile();
-#endif
     }
 
-    if (!pdf->pdf) {
-        r = errno;
-        if (pdf->outf && pdf->outf != stdout) {
-            fclose (pdf->outf);
-        }
-        free (pdf);
-        errno = r;
-        return NULL;
+    if (failed) {
+        (void) pdf_close (failed);
+    }
+    if (job->injob) {
+        fprintf (stderr, "? Job %s did not end, closing\n", job->name);
     }
+    return;
+}
 
-    /* pdf->pdf is the file that will be processed.
-     * If it is a temporary file,
-     * pdf->outf is the file that will receive the final pdf.
-     */
+/* Start a job of a job stream.  Returns 0 if successful.
+ *
+ * The first job opens its file and applies the command line settings.
+ * Later jobs inherit everything from the previous handle.  A job to the
+ * same file as the previous one is appended.
+ */
 
-    if ((r = dupstrs (ps)) != PDF_OK) {
-        free (pdf);
-        errno = r;
-        return NULL;
+static int stream_begin (JOB *job, const char *name) {
+    PDF_HANDLE newpdf;
+
+    if (strlen (name) >= sizeof (job->name) || !*name) {
+        fprintf (stderr, "? Invalid file name: %s\n", name);
+        return 1;
     }
 
-    return (void *)pdf;    
+    if (!job->pdf) {
+        if (!(job->pdf = pdf_open (name))) {
+            pdf_perror (NULL, name);
+            return 1;
+        }
+        setopts (job->pdf, job->argc, job->argv);
+    } else if (strcmp (name, job->name)) {
+        if (!(newpdf = pdf_newfile (job->pdf, name))) {
+            pdf_perror (NULL, name);
+            return 1;
+        }
+        if (pdf_close (job->pdf)) {
+            pdf_perror (NULL, job->name);
+        }
+        job->pdf = newpdf;
+    }
+    strcpy (job->name, name);
+    ckreset (job);
+    return 0;
 }
 
-/* Open a new file based on an existing handle.
- * Does not close existing handle.  Any errors closing the existing
- * handle are reported in *status.
+/* Read all available input, returning the number of bytes read.
+ *
+ * Input is read in large blocks.  Plain text goes straight to
+ * pdf_print; NOS/BE print files are translated first.
  */
 
-PDF_HANDLE pdf_newfile (PDF_HANDLE pdf, const char *filename) {
-    PDF *newpdf;
-    int r;
+static size_t do_read (JOB *job, FILE *fh) {
+    size_t n, bc = 0;
 
-    newpdf = (PDF *) pdf_open (filename);
-    if (!newpdf) {
-        return NULL;
+    if (!job->ibuf) {
+        job->isize = INPUT_BUFSIZE;
+        if (!(job->ibuf = (char *) malloc (job->isize))) {
+            pdf_perror (NULL, "Allocating input buffer");
+            exit (4);
+        }
     }
 
-    /* Copy all pdf_set parameters from old handle to new */
+    /* Read whatever is available, so that a job arriving on a pipe
+     * is completed without waiting for the next one.
+     */
 
-    memcpy (&newpdf->p, &ps->p, sizeof (ps->p));
-
-    if ((r = dupstrs (newpdf)) != PDF_OK) {
-        fclose (newpdf->pdf);
-        free (newpdf);
-        errno = r;
-        return NULL;
+    while ((n = readin (fh, job->ibuf, job->isize)) != 0) {
+        bc += n;
+        if (opts.nosbe) {
+            nosbe_data (job, job->ibuf, n);
+            nosbe_flush (job);
+        } else if (pdf_print (job->pdf, job->ibuf, n)) {
+            pdf_perror (job->pdf, "pdf_print failed");
+            exit (4);
+        }
+        do_checkpoint (job, 0);
     }
-    newpdf->flags &= PDF_TMPFILE;
-    newpdf->flags |= ps->flags & (PDF_ACTIVE | PDF_UNCOMPRESSED);
 
-    return (PDF_HANDLE)newpdf;
+    if (errno && !(errno == EINTR && stopping)) {
+        pdf_perror (NULL, "Error reading input");
+    }
+    return bc;
 }
 
-/* Open a new file for output with an exclusive lock.
- *
- * Shared with sim_pdflpt, not a formal part of the API.
- *
- * Open for read/write, creating if non-existent but not truncating if exists.
- * This can't be done without a race condition with fopen.  So,
- * system-dependent code follows.  Open for exclusive access if possible to allow
- * file watchers to know when the file is complete, and to prevent complaints about
- * file "corruption" due to the file being incomplete.
- */
- 
-FILE *pdf_open_exclusive (const char *filename, const char *mode) {
-    int fd;
-    FILE *fh;
-    int omode;
+/* Read available input, returning 0 at EOF or on error (errno set) */
 
+static size_t readin (FILE *fh, char *buf, size_t size) {
 #ifdef _WIN32
-    omode = _O_BINARY|_O_CREAT|_O_RDWR;
-    if (mode[0] == 'x') {
-        omode |= _O_EXCL;
-        mode++;
-    }
-    fd = _sopen (filename, omode, _SH_DENYRW, _S_IREAD | _S_IWRITE);
-#else
-    omode =  O_CREAT | O_RDWR;
-    if (mode[0] == 'x') {
-        omode |= O_EXCL;
-        mode++;
-    }
-    fd = open (filename, omode, S_IRUSR | S_IWUSR |
-                                S_IRGRP | S_IWGRP |
-                                S_IROTH | S_IWOTH
-    #ifdef VMS
-                       , "alq=32", "deq=4096",
-                         "mbf=6", "mbc=127", "fop=cbt,tef",
-                         "rop=rah,wbh", "shr=nil", "ctx=stm"
-    #endif
-        );
-#endif
-    if (fd == -1) {
-        return NULL;
-    }
-#ifdef USE_FLOCK
-    if (flock (fd, LOCK_EX | LOCK_NB) == -1) {
-        close (fd);
-        return NULL;
-    }
-#endif
+    int n;
 
-#ifdef _WIN32
-    fh = _fdopen (fd, mode);
-    if (!fh) {
-        _close (fd);
-    }
+    do {
+        errno = 0;
+        n = _read (_fileno (fh), buf, (unsigned int) size);
+    } while (n < 0 && errno == EINTR && !stopping);
 #else
-    fh = fdopen (fd, mode);
-    if (!fh) {
-        close (fd);
-    }
-#endif
+    ssize_t n;
 
-    return fh;
+    do {
+        errno = 0;
+        n = read (fileno (fh), buf, size);
+    } while (n < 0 && errno == EINTR && !stopping);
+#endif
+    if (n <= 0) {
+        return 0;
+    }
+    return (size_t) n;
 }
 
-/* Helper to copy constant strings to dynamic memory
- * Used so default strings aren't a special case if they are
- * replaced - they can just be free()'d.  Also used when
- * copying parameters to a new file.
+/* Checkpoint the output if one is due.
+ *
+ * One is due when --checkpoint-every pages or --checkpoint-interval
+ * seconds have passed since the last, and there is new output.  They are
+ * only taken between input batches, and at most once a second, so a
+ * burst of input costs one checkpoint rather than one per page.  force
+ * takes one whenever there is new output, e.g. at the end of a file.
  */
 
-static int dupstrs (PDF *pdf) {
-    int r;
+static void do_checkpoint (JOB *job, int force) {
+    size_t page = 0, line = 0;
+    time_t now;
 
-    if ((r = dupstr (pdf, &pdf->p.font)) != PDF_OK) {
-        return r;
+    if (!job->pdf || !(opts.ckevery || opts.ckinterval)) {
+        return;
     }
-    if ((r = dupstr (pdf, &pdf->p.nfont)) != PDF_OK) {
-        free (pdf->p.font);
-        pdf->p.font = NULL;
-        return r;
+    if (pdf_where (job->pdf, &page, &line) ||
+        (page == job->ckpage && line == job->ckline)) {
+        return;
     }
-    if ((r = dupstr (pdf, &pdf->p.nbold)) != PDF_OK) {
-        free (pdf->p.font);
-        pdf->p.font = NULL;
-        free (pdf->p.nfont);
-        pdf->p.nfont = NULL;
-        return r;
+    if (page < job->ckpage) {                   /* A new file */
+        job->ckpage = 0;
     }
-    if ((r = dupstr (pdf, &pdf->p.title)) != PDF_OK) {
-        free (pdf->p.font);
-        pdf->p.font = NULL;
-        free (pdf->p.nfont);
-        pdf->p.nfont = NULL;
-        free (pdf->p.nbold);
-        pdf->p.nbold = NULL;
-        return r;
+    time (&now);
+    if (!force) {
+        if (now == job->cktime) {
+            return;
+        }
+        if (!(opts.ckevery && page - job->ckpage >= opts.ckevery) &&
+            !(opts.ckinterval && now - job->cktime >= (time_t) opts.ckinterval)) {
+            return;
+        }
     }
-    if ((r = dupstr (pdf, &pdf->p.formfile)) != PDF_OK) {
-        free (pdf->p.font);
-        pdf->p.font = NULL;
-        free (pdf->p.nfont);
-        pdf->p.nfont = NULL;
-        free (pdf->p.nbold);
-        pdf->p.nbold = NULL;
-        free (pdf->p.title);
-        pdf->p.title = NULL;
-        return r;
+    if (pdf_checkpoint (job->pdf)) {
+        pdf_perror (job->pdf, "Checkpoint failed");
+        exit (4);
     }
-    return r;
+    job->ckpage = page;
+    job->ckline = line;
+    job->cktime = now;
+    return;
 }
- 
-static int dupstr (PDF *pdf, char **ptr) {
-    char *p;
-
-    if (!*ptr) {
-        return PDF_OK;
-    }
 
-    p = (char *) malloc (strlen (*ptr) +1);
-    if (!p) {
-        pdf_free (pdf);
-        return errno;
-    }
-    strcpy (p, *ptr);
-    *ptr = p;
+/* Start counting towards a checkpoint, for a new output file */
 
-    return PDF_OK;
+static void ckreset (JOB *job) {
+    job->ckpage = 0;
+    job->ckline = 0;
+    time (&job->cktime);
+    return;
 }
 
-/* Set parameters.
+/* Split NOS/BE print data into lines.
  *
- * Applies some gross sanity checks (the magic numbers are based on
- * what reasonable hardware limits are).  Try to avoid ugly overflow;
+ * A line split by a block boundary is carried to the next block.
  */
-int pdf_set (PDF_HANDLE pdf, int arg, ...) {
-    int r;
-    va_list ap;
-    valarg (ps);
 
-    va_start (ap, arg);
-    r = pdfset (ps, arg, ap);
-    if (r != PDF_OK) {
-        ps->errnum = r;
-    }
-    va_end (ap);
+static void nosbe_data (JOB *job, const char *data, size_t len) {
+    const char *p = data, *end = data + len;
 
-    return r;
+    while (p < end) {
+        const char *nl = (const char *) memchr (p, '\n', (size_t)(end - p));
+        size_t n = (size_t)((nl? nl: end) - p);
+
+        if (nl && !job->lused) {
+            nosbe_line (job, p, n);
+            p = nl + 1;
+            continue;
+        }
+        if (job->lused + n > job->lsize) {
+            char *nb;
+
+            job->lsize = job->lused + n + 256;
+            if (!(nb = (char *) realloc (job->lbuf, job->lsize))) {
+                pdf_perror (NULL, "Allocating line buffer");
+                exit (4);
+            }
+            job->lbuf = nb;
+        }
+        memcpy (job->lbuf + job->lused, p, n);
+        job->lused += n;
+        if (!nl) {                          /* Save partial line */
+            break;
+        }
+        nosbe_line (job, job->lbuf, job->lused);
+        job->lused = 0;
+        p = nl + 1;
+    }
+    return;
 }
 
-/* Print a string to the pdf file
- * Parses string into lines and pages.
- * Handles <FF>, <LF> and <CR>.
- * Updates state - string does not need to be a complete
- * line or page.  If the length is available, supply it.
- * otherwise, specify PDF_USE_STRLEN for the obvious.
- * Note that \0s do not terminate the string if a length is specified.
+/* Translate one line of NOS/BE printer output.
+ *
+ * Column 1 is ANSI carriage control:
+ *   ' ' single space        '0' double space        '-' triple space
+ *   '1' page eject          '+' overprint           'C' skip to last line
+ * Lines with any other control are not printed.
+ *
+ * JANUS prints the banner pages of a job at 8 LPI, so triple spacing is
+ * reduced to double spacing on the first two pages.
+ *
+ * The job ends with the second END OF LIST line.
  */
 
-int pdf_print (PDF_HANDLE pdf, const char *string, size_t length) {
-    int r;
-    short lbuf[150];
-    size_t nc = 0;
-    short *parsed;
+static void nosbe_line (JOB *job, const char *line, size_t len) {
+    static const char nls[] = "\n\n\n";
+    size_t elen = sizeof (NOSBE_EOJ) - 1;
+    unsigned int n;
 
-    valarg (ps);
+    if (!len) {
+        return;
+    }
 
-    r = setjmp (ps->env);
-    if (r) {
-        ps->errnum = r;
-        return r;
+    if (len >= elen) {
+        const char *p = line, *end = line + len - elen;
+
+        while ((p = (const char *) memchr (p, NOSBE_EOJ[0], (size_t)(end - p) + 1)) != NULL) {
+            if (!memcmp (p, NOSBE_EOJ, elen)) {
+                job->eoj++;
+                break;
+            }
+            if (p++ == end) {
+                break;
+            }
+        }
     }
 
-    if (length == PDF_USE_STRLEN) {
-        length = strlen (string);
+    switch (line[0]) {
+    case ' ':
+    case '0':
+    case '-':
+    case '1':
+    case '+':
+    case 'C':
+        break;
+    default:
+        return;
     }
 
-    if (!(ps->flags & PDF_WRITTEN)) {
-#define pdf ps
-        if (pdf->p.lpp) {
-            pdf->lpp = pdf->p.lpp;
-            pdf->p.len = ((double)pdf->p.lpp) / (double)pdf->p.lpi;
-        } else {
-            pdf->lpp = (long) (pdf->p.len * pdf->p.lpi);
-        }
+    if (!job->injob) {
+        nosbe_begin (job);
+    }
 
-        if (pdf->p.tof == ~0u) {
-            pdf->p.tof = ((unsigned int) (pdf->p.top * pdf->p.lpi));
-        }
+    switch (line[0]) {
+    case ' ':
+        nosbe_out (job, nls, 1);
+        job->lines++;
+        break;
 
-        /* Some more checks - make sure there is a reasonable printable area.
-         * VFUs impose a 2.0 in limit; tractors 3.0.  Done here because the
-         * values interact & can't be validated until all have been set.
-         */
+    case '1':
+        job->pages++;
+        job->lines = 1;
+        if (job->pages > 1 || (job->njobs > 1 && !opts.spool)) {
+            nosbe_out (job, "\f", 1);
+        }   /* Else, the first eject in the file is not printed */
+        break;
 
-        /* Min printable area 2.0 in high. Note that top/bot don't prevent printing. */
-        if ( ((int)(pdf->p.len)) < 2.0 ) {
-            ABORT (E(INCON_GEO));
-        }
+    case '0':
+        nosbe_out (job, nls, 2);
+        job->lines += 2;
+        break;
 
-        /* Min printable area 3.0 in wide */
-        if ( ((int)(pdf->p.wid - (2*(pdf->p.margin + pdf->p.lno)))) < 3.0 ) {
-            ABORT (E(INCON_GEO));
+    case '-':
+        nosbe_out (job, nls, 2);
+        job->lines += 2;
+        if (job->pages > 2) {
+            nosbe_out (job, nls, 1);
+            job->lines++;
         }
+        break;
 
-        /* Selected cols must fit in printable width */
-        if ( ((int)(pdf->p.wid - (2*(pdf->p.margin + pdf->p.lno)))) < (int)(pdf->p.cols / pdf->p.cpi) ) {
-            ABORT (E(INCON_GEO));
+    case 'C':
+        for (n = job->lines; n < opts.cclines; n++) {
+            nosbe_out (job, nls, 1);
         }
+        break;
 
-        /* Printable height must have room for 4 lines */
-        if ( (pdf->p.len * pdf->p.lpi) < 4 ) {
-            ABORT (E(INCON_GEO));
-        }
+    case '+':
+        nosbe_out (job, "\r", 1);
+        break;
+    }
 
-        /* TOF offset can't be more than a page. */
-        if ( pdf->p.tof > (pdf->p.len * pdf->p.lpi)) {
-            ABORT (E(INCON_GEO));
+    nosbe_out (job, line + 1, len - 1);
+
+    if (job->eoj >= 2) {
+        nosbe_out (job, nls, 1);
+        nosbe_end (job);
+    }
+    return;
+}
+
+/* Start a print job.
+ *
+ * When spooling, each job is written to a new file named for the time
+ * that the job starts.  The handle of the previous job is kept, so its
+ * settings are inherited without re-processing the command line.
+ */
+
+static void nosbe_begin (JOB *job) {
+    job->injob = 1;
+    job->njobs++;
+    job->eoj = 0;
+    job->pages = 0;
+    job->lines = 0;
+
+    if (opts.spool) {
+        char name[FILENAME_MAX];
+        time_t now;
+        struct tm *tm;
+        size_t dl = strlen (opts.spool);
+
+        time (&now);
+        tm = localtime (&now);
+        if (dl + sizeof ("/print_YYYY_MM_DD_HH_MM_SS.pdf") > sizeof (name)) {
+            fprintf (stderr, "? spool directory name is too long\n");
+            exit (3);
         }
-        /* Bar height must be at least one line */
-        if (pdf->p.formtype != PDF_PLAIN && pdf->p.barh < 1.0 / (double)pdf->p.lpi) {
-            ABORT (E(INCON_GEO));
+        memcpy (name, opts.spool, dl);
+        if (dl && opts.spool[dl-1] != '/'
+#ifdef _WIN32
+               && opts.spool[dl-1] != '\\'
+#endif
+            ) {
+            name[dl++] = '/';
         }
-#undef pdf
+        strftime (name + dl, sizeof (name) - dl, "print_%Y_%m_%d_%H_%M_%S.pdf", tm);
 
-        /* Lock down context as init may allocate objects */
+        if (!job->pdf) {
+            if (!(job->pdf = pdf_open (name))) {
+                pdf_perror (NULL, name);
+                exit (2);
+            }
+            setopts (job->pdf, job->argc, job->argv);
+        } else if (strcmp (name, job->name)) {
+            PDF_HANDLE newpdf;
+
+            if (!(newpdf = pdf_newfile (job->pdf, name))) {
+                pdf_perror (NULL, name);
+                exit (2);
+            }
+            if (pdf_close (job->pdf)) {
+                pdf_perror (NULL, job->name);
+                exit (4);
+            }
+            job->pdf = newpdf;
+        }
+        /* Otherwise, a job started in the same second is appended */
+
+        strcpy (job->name, name);
+        ckreset (job);
+        fprintf (stderr, "Job %u: writing %s\n", job->njobs, name);
+    } else {
+        fprintf (stderr, "Job %u\n", job->njobs);
+    }
+    return;
+}
+
+/* End a print job.
+ *
+ * When spooling, the file is completed so that it can be viewed,
+ * but remains open in case the next job starts in the same second.
+ */
+
+static void nosbe_end (JOB *job) {
+    size_t page = 0, line = 0;
+
+    nosbe_flush (job);
+    job->injob = 0;
+    job->eoj = 0;
+
+    if (pdf_where (job->pdf, &page, &line)) {
+        pdf_perror (job->pdf, "Error getting position");
+    }
+    fprintf (stderr, "End of job %u, at page %u line %u\n", job->njobs, (int)page, (int)line);
+
+    if (opts.spool) {
+        if (pdf_reopen (job->pdf)) {
+            pdf_perror (job->pdf, job->name);
+            exit (4);
+        }
+    }
+    return;
+}
+
+/* Send translated data to the PDF file */
+
+static void nosbe_flush (JOB *job) {
+    if (job->oused) {
+        if (pdf_print (job->pdf, job->obuf, job->oused)) {
+            pdf_perror (job->pdf, "pdf_print failed");
+            exit (4);
+        }
+        job->oused = 0;
+    }
+    return;
+}
+
+/* Add translated data to the output buffer */
+
+static void nosbe_out (JOB *job, const char *data, size_t len) {
+    if (job->oused + len > job->osize) {
+        char *nb;
+
+        if (job->oused >= INPUT_BUFSIZE) {
+            nosbe_flush (job);
+        }
+        if (job->oused + len > job->osize) {
+            job->osize = job->oused + len + INPUT_BUFSIZE;
+            if (!(nb = (char *) realloc (job->obuf, job->osize))) {
+                pdf_perror (NULL, "Allocating output buffer");
+                exit (4);
+            }
+            job->obuf = nb;
+        }
+    }
+    memcpy (job->obuf + job->oused, data, len);
+    job->oused += len;
+    return;
+}
+
+/* Utility usage */
+
+static int usage (const ARG *argtable, size_t nargs) {
+    size_t i;
+
+    fprintf (stderr, "Usage:\n\
+lpt2pdf [-options] infiles outile\n\
+lpt2pdf --nosbe --spool dir [-options] infiles\n\
+\n\
+lpt2pdf will turn an ASCII input file into a PDF file on simulated paper.\n\
+\n\
+The defaults are for a standard lineprinter - 14.875 x 11.000 in,\n\
+6LPI, 10 CPI.  (Lines and Characters per inch.)\n\
+\n\
+Default is to read from stdin and write to stdout.  Because PDF is\n\
+a binary format, the output file must not be a terminal.\n\n\
+With --nosbe, the input is NOS/BE printer output.  Column 1 is carriage\n\
+control, and jobs are separated by the END OF LIST trailer.  With --spool,\n\
+each job is written to its own file in the spool directory.\n\n"
+"If the output file is not a regular file, such as a pipe, the PDF is\n\
+written as it is produced.\n"
+"'-' for either input or output is interpreted as stdin/stdout respectivey.\n"
+"Appending requires a seekable output file, generally a disk.\n\
+\n\
+Options, naturally are optional:\n");
+
+    /* List options & their help from the table */
+
+    for (i = 0; i < nargs; i++, argtable++) {
+        char c;
+        const char *p;
+
+        fprintf (stderr, "    %s %s\n        ", 
+                 argtable->keyword, (argtable->atype == AT_NUMBER)? "n.m":
+                                        (argtable->atype == AT_INTEGER)? "integer":
+                                        (argtable->atype == AT_FLAG)? "": "string");
+        p = argtable->help;
+        if (*p == '(') {
+            p++;
+        }
+        for (; *p && (*p != ')' || p[1]); p++) {
+            c = *p;
+            if (c == '%') {
+                c = *++p;
+                switch (c) {
+                case 'F':
+                    print_hlplist( stderr, pdf_get_fontlist (NULL), 0);
+                    break;
+                case 'f': {
+                    print_hlplist( stderr, pdf_get_formlist (NULL), 1);
+                    break;
+                }
+                default:
+                    fprintf (stderr, "Help bug\n");
+                    exit (7);
+                }
+                continue;
+            }
+
+            fputc (c, stderr);
+            if (c == '\n') {
+                fputs ("        ", stderr);
+            }
+        }
+        fputs ("\n        Default: ", stderr );
+        p = argtable->def;
+        if (*p == '(') {
+            p++;
+        }
+        for (; *p && (*p != ')' || p[1]); p++) {
+            fputc (*p, stderr);
+        }
+        fputs ("\n\n", stderr);
+    }
+
+    fprintf (stderr, "\
+     Font notes:\n\
+        Fonts may only be one of of the default fonts supported by PDF.  The utility\n\
+        does not embed fonts in the PDF file (messy licensing issues.)\n\
+        Stick with monspace fonts for the correct effects.  Better to use -cpi.\n\
+        Font names are case-sensitive\n");
+
+    fprintf (stderr, "\n\
+    Linear dimensions may be specified in cm or mm by suffixing the number with cm or mm\n\
+    respectively.\n\
+\n\
+    In general, you don't need any options to get usable output\n\
+\n\
+    Bugs, praise to litt@acm.org\n\
+");
+    exit (0);
+}
+
+static void print_hlplist (FILE *file, const char *const *list, int adjcase) {
+    if (list) {
+        fputc ('\n', file);
+        while (*list) {
+            const char *r = *list++;
+            char c = *r++;
+            fprintf (file, "            %c", adjcase? toupper (c): c);
+            while ((c = *r++)) {
+                fputc ((adjcase? tolower (c): c), file);
+            }
+            fputc ('\n', file);
+        }
+    }
+    return;
+}
+/* *** End of stand-alone utility *** */
+#endif
+
+/* *** Start of public API *** */
+
+/* open a pdf file for output (or update)
+ * returns handle.  If NULL, see errno.
+ * Attempts to open for update
+ * Will not write until first output.
+ * If I/O has to be done to a temporary file, the temporary
+ * file is created.  In this case, the semantics are replace,
+ * since temporary files are used only when output is a special file.
+ */
+
+PDF_HANDLE pdf_open (const char *filename) {
+    PDF *pdf;
+    int r;
+    const char *p;
+ #ifdef _WIN32
+    struct _stati64 statbuf;
+#else
+   struct stat statbuf;
+#endif
+
+    if (!filename) {
+        errno = E(BAD_FILENAME);
+        return NULL;
+    }
+
+    pdf = (PDF *) malloc (sizeof (PDF));
+    if (!pdf) {
+        return NULL;
+    }
+    memcpy (pdf, &defaults, sizeof (PDF));
+    setxlat (pdf);
+
+    if (!strcmp (filename, "-")) {
+#ifdef _WIN32                                   /* stdout is probably not seekable */
+        pdf->flags |= PDF_TMPFILE;
+        _setmode (_fileno (stdout), _O_BINARY);
+#endif
+        pdf->pdf = stdout;
+    } else {    
+        p = strrchr (filename, '.');
+        if (p) {
+            const char *fn, *ext = "pdf";
+            int islc = islower (p[1]);
+            for (fn = p + 1;
+#if defined (VMS)
+                           (*fn && (*fn != ';'));
+#else
+                            *fn;
+#endif
+                             fn++, ext++) {
+                if ((islc? (*fn != *ext): (*fn != toupper (*ext)))) {
+                    free (pdf);
+                    errno = E(BAD_FILENAME);
+                    return NULL;
+                }
+            }
+            if (*ext) {
+                free (pdf);
+                errno = E(BAD_FILENAME);
+                return NULL;
+            }
+        } else {
+            free (pdf);
+            errno = E(BAD_FILENAME);
+        }
+        pdf->pdf = pdf_open_exclusive (filename, "rb+");
+    }
+
+    r = PDF_OK;
+ #ifdef _WIN32
+    if (pdf->pdf && !_fstati64 (_fileno (pdf->pdf), &statbuf)) {
+       if (statbuf.st_mode & _S_IFDIR) {
+           r = E(BAD_FILENAME);
+       } else {
+           if (!(statbuf.st_mode & _S_IFREG)) {
+               pdf->flags |= PDF_TMPFILE;
+           }
+       }
+    }
+#else
+    if (pdf->pdf && !fstat (fileno (pdf->pdf), &statbuf)) {
+        if (S_ISDIR (statbuf.st_mode)) {
+            r = E(BAD_FILENAME);
+        } else {
+            if (!S_ISREG (statbuf.st_mode)) {
+#ifdef USE_FDOUT
+                pdf->flags |= PDF_STREAM;
+#else
+                pdf->flags |= PDF_TMPFILE;
+#endif
+            }
+        }
+    }
+#endif
+    if (r != PDF_OK) {
+        if (pdf->pdf != stdout) {
+            fclose (pdf->pdf);
+        }
+        free (pdf);
+        errno = r;
+        return NULL;
+    }
+    if (pdf->pdf && (pdf->flags & PDF_TMPFILE)) {
+#ifdef _WIN32
+        char *tname;
+        /* tmpfile() will only create files in the root directory, which is protected.
+         */
+        pdf->outf = pdf->pdf;
+        tname = _tempnam (NULL, "lpt2pdf");
+        if (tname) {
+            pdf->pdf = pdf_open_exclusive (tname, "xrb+");
+            if (pdf->pdf) {
+                pdf->tmpname = tname;
+            }
+        } else {
+            pdf->pdf = NULL;
+            errno = EINVAL;
+        }
+#else
+        pdf->outf = pdf->pdf;
+        pdf->pdf = tmpfile();
+#endif
+    }
+
+    if (!pdf->pdf) {
+        r = errno;
+        if (pdf->outf && pdf->outf != stdout) {
+            fclose (pdf->outf);
+        }
+        free (pdf);
+        errno = r;
+        return NULL;
+    }
+
+    /* pdf->pdf is the file that will be processed.
+     * If it is a temporary file,
+     * pdf->outf is the file that will receive the final pdf.
+     * A non-seekable file that is written directly is a stream.
+     */
+
+    if ((r = oopen (pdf)) != PDF_OK) {
+        if (pdf->pdf != stdout) {
+            fclose (pdf->pdf);
+        }
+        if (pdf->outf && pdf->outf != stdout) {
+            fclose (pdf->outf);
+        }
+        free (pdf);
+        errno = r;
+        return NULL;
+    }
+
+    if ((r = dupstrs (ps)) != PDF_OK) {
+        free (pdf->obuf);
+        free (pdf);
+        errno = r;
+        return NULL;
+    }
+
+    return (void *)pdf;    
+}
+
+/* Open a new file based on an existing handle.
+ * Does not close existing handle.  Any errors closing the existing
+ * handle are reported in *status.
+ */
+
+PDF_HANDLE pdf_newfile (PDF_HANDLE pdf, const char *filename) {
+    PDF *newpdf;
+    int r;
+
+    newpdf = (PDF *) pdf_open (filename);
+    if (!newpdf) {
+        return NULL;
+    }
+
+    /* Copy all pdf_set parameters from old handle to new */
+
+    free (newpdf->p.font);
+    free (newpdf->p.nfont);
+    free (newpdf->p.nbold);
+    free (newpdf->p.title);
+    free (newpdf->p.formfile);
+    memcpy (&newpdf->p, &ps->p, sizeof (ps->p));
+
+    if ((r = dupstrs (newpdf)) != PDF_OK) {
+        fclose (newpdf->pdf);
+        free (newpdf);
+        errno = r;
+        return NULL;
+    }
+    newpdf->flags &= PDF_TMPFILE | PDF_STREAM;
+    newpdf->flags |= ps->flags & (PDF_ACTIVE | PDF_UNCOMPRESSED);
+
+    /* A form without an image comes from the form cache */
+
+    return (PDF_HANDLE)newpdf;
+}
+
+/* Open a new file for output with an exclusive lock.
+ *
+ * Shared with sim_pdflpt, not a formal part of the API.
+ *
+ * Open for read/write, creating if non-existent but not truncating if exists.
+ * This can't be done without a race condition with fopen.  So,
+ * system-dependent code follows.  Open for exclusive access if possible to allow
+ * file watchers to know when the file is complete, and to prevent complaints about
+ * file "corruption" due to the file being incomplete.
+ */
+ 
+FILE *pdf_open_exclusive (const char *filename, const char *mode) {
+    int fd;
+    FILE *fh;
+    int omode;
+
+#ifdef _WIN32
+    omode = _O_BINARY|_O_CREAT|_O_RDWR;
+    if (mode[0] == 'x') {
+        omode |= _O_EXCL;
+        mode++;
+    }
+    fd = _sopen (filename, omode, _SH_DENYRW, _S_IREAD | _S_IWRITE);
+#else
+    omode =  O_CREAT | O_RDWR;
+    if (mode[0] == 'x') {
+        omode |= O_EXCL;
+        mode++;
+    }
+    fd = open (filename, omode, S_IRUSR | S_IWUSR |
+                                S_IRGRP | S_IWGRP |
+                                S_IROTH | S_IWOTH
+    #ifdef VMS
+                       , "alq=32", "deq=4096",
+                         "mbf=6", "mbc=127", "fop=cbt,tef",
+                         "rop=rah,wbh", "shr=nil", "ctx=stm"
+    #endif
+        );
+#endif
+    if (fd == -1) {
+        return NULL;
+    }
+#ifdef USE_FLOCK
+    if (flock (fd, LOCK_EX | LOCK_NB) == -1) {
+        close (fd);
+        return NULL;
+    }
+#endif
+
+#ifdef _WIN32
+    fh = _fdopen (fd, mode);
+    if (!fh) {
+        _close (fd);
+    }
+#else
+    fh = fdopen (fd, mode);
+    if (!fh) {
+        close (fd);
+    }
+#endif
+
+    return fh;
+}
+
+/* Helper to copy constant strings to dynamic memory
+ * Used so default strings aren't a special case if they are
+ * replaced - they can just be free()'d.  Also used when
+ * copying parameters to a new file.
+ */
+
+static int dupstrs (PDF *pdf) {
+    int r;
+
+    if ((r = dupstr (pdf, &pdf->p.font)) != PDF_OK) {
+        return r;
+    }
+    if ((r = dupstr (pdf, &pdf->p.nfont)) != PDF_OK) {
+        free (pdf->p.font);
+        pdf->p.font = NULL;
+        return r;
+    }
+    if ((r = dupstr (pdf, &pdf->p.nbold)) != PDF_OK) {
+        free (pdf->p.font);
+        pdf->p.font = NULL;
+        free (pdf->p.nfont);
+        pdf->p.nfont = NULL;
+        return r;
+    }
+    if ((r = dupstr (pdf, &pdf->p.title)) != PDF_OK) {
+        free (pdf->p.font);
+        pdf->p.font = NULL;
+        free (pdf->p.nfont);
+        pdf->p.nfont = NULL;
+        free (pdf->p.nbold);
+        pdf->p.nbold = NULL;
+        return r;
+    }
+    if ((r = dupstr (pdf, &pdf->p.formfile)) != PDF_OK) {
+        free (pdf->p.font);
+        pdf->p.font = NULL;
+        free (pdf->p.nfont);
+        pdf->p.nfont = NULL;
+        free (pdf->p.nbold);
+        pdf->p.nbold = NULL;
+        free (pdf->p.title);
+        pdf->p.title = NULL;
+        return r;
+    }
+    return r;
+}
+ 
+static int dupstr (PDF *pdf, char **ptr) {
+    char *p;
+
+    if (!*ptr) {
+        return PDF_OK;
+    }
+
+    p = (char *) malloc (strlen (*ptr) +1);
+    if (!p) {
+        pdf_free (pdf);
+        return errno;
+    }
+    strcpy (p, *ptr);
+    *ptr = p;
+
+    return PDF_OK;
+}
+
+/* Set parameters.
+ *
+ * Applies some gross sanity checks (the magic numbers are based on
+ * what reasonable hardware limits are).  Try to avoid ugly overflow;
+ */
+int pdf_set (PDF_HANDLE pdf, int arg, ...) {
+    int r;
+    va_list ap;
+    valarg (ps);
+
+    va_start (ap, arg);
+    r = pdfset (ps, arg, ap);
+    if (r != PDF_OK) {
+        ps->errnum = r;
+    }
+    va_end (ap);
+
+    return r;
+}
+
+/* Print a string to the pdf file
+ * Parses string into lines and pages.
+ * Handles <FF>, <LF> and <CR>.
+ * Updates state - string does not need to be a complete
+ * line or page.  If the length is available, supply it.
+ * otherwise, specify PDF_USE_STRLEN for the obvious.
+ * Note that \0s do not terminate the string if a length is specified.
+ */
+
+int pdf_print (PDF_HANDLE pdf, const char *string, size_t length) {
+    int r;
+    short lbuf[150];
+    size_t nc = 0;
+    short *parsed;
+
+    valarg (ps);
+
+    r = setjmp (ps->env);
+    if (r) {
+        ps->errnum = r;
+        return r;
+    }
+
+    if (length == PDF_USE_STRLEN) {
+        length = strlen (string);
+    }
+
+    if (!(ps->flags & PDF_WRITTEN)) {
+#define pdf ps
+        if (pdf->p.lpp) {
+            pdf->lpp = pdf->p.lpp;
+            pdf->p.len = ((double)pdf->p.lpp) / (double)pdf->p.lpi;
+        } else {
+            pdf->lpp = (long) (pdf->p.len * pdf->p.lpi);
+        }
+
+        if (pdf->p.tof == ~0u) {
+            pdf->p.tof = ((unsigned int) (pdf->p.top * pdf->p.lpi));
+        }
+
+        /* Some more checks - make sure there is a reasonable printable area.
+         * VFUs impose a 2.0 in limit; tractors 3.0.  Done here because the
+         * values interact & can't be validated until all have been set.
+         */
+
+        /* Min printable area 2.0 in high. Note that top/bot don't prevent printing. */
+        if ( ((int)(pdf->p.len)) < 2.0 ) {
+            ABORT (E(INCON_GEO));
+        }
+
+        /* Min printable area 3.0 in wide */
+        if ( ((int)(pdf->p.wid - (2*(pdf->p.margin + pdf->p.lno)))) < 3.0 ) {
+            ABORT (E(INCON_GEO));
+        }
+
+        /* Selected cols must fit in printable width */
+        if ( ((int)(pdf->p.wid - (2*(pdf->p.margin + pdf->p.lno)))) < (int)(pdf->p.cols / pdf->p.cpi) ) {
+            ABORT (E(INCON_GEO));
+        }
+
+        /* Printable height must have room for 4 lines */
+        if ( (pdf->p.len * pdf->p.lpi) < 4 ) {
+            ABORT (E(INCON_GEO));
+        }
+
+        /* TOF offset can't be more than a page. */
+        if ( pdf->p.tof > (pdf->p.len * pdf->p.lpi)) {
+            ABORT (E(INCON_GEO));
+        }
+        /* Bar height must be at least one line */
+        if (pdf->p.formtype != PDF_PLAIN && pdf->p.barh < 1.0 / (double)pdf->p.lpi) {
+            ABORT (E(INCON_GEO));
+        }
+#undef pdf
+
+        /* Lock down context as init may allocate objects */
 
         ps->flags |= PDF_ACTIVE;
 
-        errno = 0;
-        if (!(ps->flags & PDF_INIT)) {
-            pdfinit (ps);
-            ps->flags |= PDF_INIT;
+        errno = 0;
+        if (!(ps->flags & PDF_INIT)) {
+            pdfinit (ps);
+            ps->flags |= PDF_INIT;
+        }
+
+        /* Initial formfeed (sometimes with <cr> is common for printers, but would 
+         * produce a blank page here.  If present, discard it (but include in the hash).
+         * Do this only for the initial write to the file - not after resuming from a
+         * checkpoint.
+         */
+
+        ps->parseused = 0;
+        r = parsestr (ps, string, length, !(ps->flags & PDF_RESUMED));
+
+        length = ps->parseused;
+        ps->parseused = 0;
+
+        ps->flags &= ~PDF_RESUMED;
+
+        /* A write of length zero is useful because the file structure of
+         * an updated file, as well as all pdf_set parameters, has been validated.
+         * This early return ensures that the file won't be written until there is
+         * new data in the file.  If a FF was seen and stripped, that counts as data
+         * (otherwise another FF in the next call would also be removed.)
+         */
+        if (!length && !r) {
+            return PDF_OK;
+        }
+
+        /* This is the actual first write, the file will be modified
+         * There is similar code in pdfclose.
+         */
+
+        wrhdr (ps);
+        if (!ps->formlen) {
+            setform (ps);
+        }
+
+        /* PDF_WRITTEN has been set */
+
+        if (errno) {
+            ps->errnum = errno;
+            ABORTps (errno);
+        }
+    } else {
+        (void) parsestr (ps, string, length, 0);
+        length = ps->parseused;
+    }
+    ps->parseused = 0;
+
+    if (ps->errnum) {
+        return ps->errnum;
+    }
+
+    if (!length) {
+        return PDF_OK;
+    }
+
+    /* Line buffer must be flushed before any reference to state that
+     * printing it might update.  It's effective for long strings of
+     * text.
+     */
+
+#define FLUSH_LBUF { if (nc) {                   \
+    add2line (ps, lbuf, nc);                     \
+    nc = 0;                                      \
+}}
+
+    for(parsed = ps->parsebuf; length--;) {
+        short c = *parsed++;
+
+        if (c == '\f') {
+            if (ps->line == 0) {
+                ps->line = ps->p.tof +1;
+            }
+            FLUSH_LBUF;
+            wrpage (ps);
+            continue;
+        } 
+        if (ps->line > ps->lpp + ps->p.tof) {
+            FLUSH_LBUF;
+            wrpage (ps);
+        }
+        if (c == '\n') {
+            if (ps->line == 0) {
+                ps->line = ps->p.tof +1;
+            }
+            FLUSH_LBUF;
+            ps->line++;
+            continue;
+        }
+        /* Ordinary data.  If first on page, set line to TOF. */
+        if (ps->line == 0) {
+            ps->line = ps->p.tof +1;
+        }
+
+        lbuf[nc++] = c;
+
+        if (nc >= DIM (lbuf) -1) {
+            FLUSH_LBUF;
+        }
+    }
+    FLUSH_LBUF;
+#undef FLUSH_LBUF
+
+    return ps->errnum;
+}
+
+/* Return current location
+ *
+ * This is the physical location on the page, 1-based numbering.
+ */
+
+int pdf_where (PDF_HANDLE pdf, size_t *page, size_t *line) {
+    size_t p, l;
+
+    valarg (ps);
+
+    p = ps->page +1;
+    l = ps->line;
+    if (l == 0) {
+        l = ps->p.tof +1;
+    }
+    if (l > ps->lpp) {
+        l -= (ps->lpp -1);
+        p++;
+    }
+    p += ps->prevpc;
+
+    if (page) {
+        *page = p;
+    }
+    if (line) {
+        *line = l;
+    }
+    return PDF_OK;
+}
+
+/* Determine if file is empty
+ */
+
+int pdf_is_empty (PDF_HANDLE pdf) {
+    valarg (ps);
+
+    if (ps->prevpc || ps->page || ps->line) {
+        return 0;
+    }
+    return 1;
+}
+
+/* Get list of known font names */
+
+const char *const* pdf_get_fontlist ( size_t *length ) {
+    if (length) {
+        *length = DIM (validFonts) -1;
+    }
+    return validFonts;
+}
+/* Get list of known form names */
+
+const char *const* pdf_get_formlist ( size_t *length ) {
+    size_t i;
+
+    if (formlist) {
+        return formlist;
+    }
+    formlist = (const char **)malloc ((DIM(colors) + 1) * sizeof (const char *));
+    if (!formlist) {
+        if (length) {
+            *length = 0;
+        }
+        return NULL;
+    }
+    for (i = 0; i < DIM(colors); i++) {
+        formlist[i] = colors[i].name;
+    }
+    formlist[i] = NULL;
+    if (length) {
+        *length = i;
+    }
+
+    return formlist;
+}
+
+/* Checkpoint a pdf file
+ * This writes the metadata for the file and flushes
+ * I/O buffers.  The first write thereafter will corrupt it again.
+ * the file remains open and the PDF_HANDLE remains valid.
+ * The file is positioned to overwrite the new metadata with page data.  This allows
+ * processes (such as simulated LPTs) that leave files open for long periods
+ * between bursts of writing to have some chance of surviving a crash.
+ */
+
+int pdf_checkpoint (PDF_HANDLE pdf) {
+    int r = PDF_OK;
+    unsigned int obj;
+    SHA1Context sha1;
+
+    valarg (ps);
+
+    if (ps->flags & PDF_WRITTEN) {
+        unsigned int line = ps->line;
+
+#ifdef USE_THREADS
+        if ((r = pipe_stop (ps)) != PDF_OK) {
+            ps->errnum = r;
+            return r;
+        }
+#endif
+        ps->line = 0;
+
+        obj = ps->obj;
+        memcpy (&sha1, &ps->sha1, sizeof (sha1));
+
+        r = pdfclose (ps, 2);
+
+        /* Writing resumes after the trailer, and the metadata objects
+         * are numbered again at the next checkpoint.
+         */
+        memcpy (&ps->sha1, &sha1, sizeof (sha1));
+        oseek (ps, ps->checkpp);
+        ps->obj = (r == PDF_OK)? ps->xmark: obj;
+        ps->line = line;
+
+        ps->flags &= ~PDF_WRITTEN;
+        ps->flags |= PDF_RESUMED;
+ 
+        if (r != PDF_OK) {
+            ps->errnum = r;
+        }
+    }
+    return r;
+}
+
+/* re-open an active file
+ * Checkpoints the current state.
+ * Resets to "just opened" + resumed + all sets.
+ * Allows changing forms mid-stream.
+ */
+
+int pdf_reopen (PDF_HANDLE pdf) {
+    int r;
+
+    valarg (ps);
+
+    ps->errnum = 0;
+
+    /* A stream can't be read back to append to */
+
+    if (ps->flags & PDF_STREAM) {
+        return ps->errnum = E(NOT_SEEKABLE);
+    }
+
+    r = setjmp (ps->env);
+    if (r) {
+        return r;
+    }
+
+    return pdfreopen (ps);
+}
+
+/* Obtain a snapshot of an active file.
+ *
+ * Checkpoints the active file and copies it in a consistent state to
+ * the specified file.
+ *
+ */
+
+int pdf_snapshot (PDF_HANDLE pdf, const char *filename) {
+    valarg (ps);
+
+    return snapshot (ps, filename, 0);
+}
+
+/* Update a snapshot of an active file.
+ *
+ * As pdf_snapshot, but if the file is the last snapshot of this handle,
+ * and hasn't been modified since, only what has changed is copied.
+ */
+
+int pdf_snapshot_update (PDF_HANDLE pdf, const char *filename) {
+    valarg (ps);
+
+    return snapshot (ps, filename, 1);
+}
+
+/* close a pdf file
+ *
+ * Writes updated metadata
+ */
+
+int pdf_close (PDF_HANDLE pdf) {
+    valarg (ps);
+
+    return pdfclose (ps, 0);
+}
+
+/* Test if a file seems to be a PDF file.
+ * Simple header check.
+ *
+ * PDF_OK if it passes.
+ */
+
+int pdf_file (const char *name) {
+    FILE *fh;
+    char buf[100];
+    char *p;
+
+    if (!(fh = fopen (name, "rb"))) {
+        return errno;
+    }
+    if (!fgets (buf, sizeof (buf), fh)) {
+        fclose (fh);
+        return errno;
+    }
+    fclose (fh);
+    if (strncmp (buf, "%PDF-1.", 7)) {
+        return E(NOT_PDF);
+    }
+    p = buf + 7;
+
+    while (*p && isdigit (*p)) {
+        p++;
+    }
+    if (*p == '\n') {
+        return PDF_OK;
+    }
+    return E(NOT_PDF);
+}
+
+/* Print string with last error.
+ */
+
+void pdf_perror (PDF_HANDLE pdf, const char *s) {
+
+    if (s && *s) {
+        fprintf (stderr, "%s: ", s);
+    }
+
+    fprintf (stderr, "%s\n", pdf_strerror (pdf_error(pdf)));
+
+    return;
+}
+
+/* Get string for error number
+ */
+
+const char *pdf_strerror (int errnum) {
+
+    if (!errnum) {
+        return "Success";
+    }
+
+    if (errnum >= E(BASE)) {
+        errnum -= E(BASE);
+        if (((size_t)errnum) >= DIM(errortext)) {
+            errnum = 0;
+        }
+        return errortext[errnum];
+    } else {
+        return strerror (errnum);
+    }
+}
+
+/* Get last error
+ */
+
+int pdf_error (PDF_HANDLE pdf) {
+    int err;
+
+    if (ps) {
+        err = ps->errnum;
+    } else {
+        err = errno;
+    }
+
+    if (((size_t)err) >= E(BASE)) {
+        if (((size_t)(err - E(BASE))) >= DIM(errortext)) {
+            err = E(BAD_ERRNO);
+        }
+    }
+
+    return err;
+}
+
+/* Clear last error */
+
+void pdf_clearerr (PDF_HANDLE pdf) {
+
+    if (!pdf) {
+        errno = E(BAD_HANDLE);
+        return;
+    }
+    ps->errnum = errno = 0;
+
+    return;
+}
+
+
+/* *** End of public API *** */
+
+static int pdfreopen (PDF *pdf) {
+    int r;
+
+    /* Commit everything to the current file */
+
+    r = pdfclose (pdf, 1);
+
+    if (r != PDF_OK) {
+        return r;
+    }
+
+    /* Reset all state to "just opened"
+     * Exceptions:
+     *  flags - retain preferences
+     *          Suppress initial FF removal
+     *          Remember reopen to force append at first output
+     *  buffers - don't deallocate, but set current used to 0
+     * character set selections.
+     */
+
+    oseek (pdf, 0);
+
+    pdf->flags = pdf->flags & (PDF_TMPFILE | PDF_STREAM | PDF_UNCOMPRESSED);
+    pdf->flags |= PDF_RESUMED | PDF_REOPENED;
+
+    pdf->escstate = ESC_IDLE;
+    /* Leave CHARSET *: gset, gl, gr, ssg and their xlat */
+
+    /* A form without an image has no objects in the file, so it
+     * can be used for the next session.
+     */
+
+    if (pdf->formobj) {
+        pdf->formlen = 0;
+    }
+    pdf->formobj =
+        pdf->prevpc =
+        pdf->anchorp =
+        pdf->anchorpp =
+        pdf->checkpp =
+        pdf->aobj =
+        pdf->obj =
+        pdf->xpos =
+        pdf->lpp =
+        pdf->page =
+        pdf->line =
+        pdf->pbase =
+        pdf->prologlen =
+        pdf->pt.form =
+        pdf->pt.plist =
+        pdf->pt.fonts =
+        pdf->pt.leaflen =
+        pdf->xprev =
+        pdf->xmark =
+        pdf->xmused =
+        pdf->xdelta =
+        pdf->iobj =
+        pdf->parseused =
+        pdf->pbused = 
+        pdf->lzwused = 0;
+    free (pdf->trail);
+    pdf->trail = NULL;
+
+    /* The next session may start a new file, without the content objects */
+
+    if (pdf->phtab.ent) {
+        memset (pdf->phtab.ent, 0, pdf->phtab.size * sizeof (PHASH));
+    }
+    pdf->phtab.used = 0;
+
+    return PDF_OK;
+}
+
+/* The work of pdf_set
+ */
+
+#define REJECT_NULL { if (svalue == NULL) {         \
+                        pdf->errnum = E(INVAL);     \
+                        return pdf->errnum; } }
+
+static int pdfset (PDF *pdf, int arg, va_list ap) {
+    unsigned int ivalue;
+    double dvalue;
+    const char *svalue = NULL;
+    char **font = NULL;
+    char *oldf;
+    PDF oldvals;
+    char tbuf[PDF_C_LINELEN -2]; /* Title is in () */
+    int r = PDF_OK;
+    size_t i;
+    FILE *fh;
+
+    if (pdf->flags & PDF_ACTIVE) {
+        return E(ACTIVE);
+    }
+
+    /* Any saved form may no longer be valid */
+
+    pdf->formlen = 0;
+
+    switch (arg) {
+    case PDF_FILE_REQUIRE:
+        svalue = va_arg (ap, const char *);
+        REJECT_NULL
+        if (!xstrcasecmp (svalue, "NEW")) {
+            pdf->p.frequire = PDF_FILE_NEW;
+        } else if (!xstrcasecmp (svalue, "APPEND")) {
+            pdf->p.frequire = PDF_FILE_APPEND;
+        } else if (!xstrcasecmp (svalue, "REPLACE")) {
+            pdf->p.frequire = PDF_FILE_REPLACE;
+        } else {
+            return E(BAD_SET);
         }
+        return PDF_OK;
 
-        /* Initial formfeed (sometimes with <cr> is common for printers, but would 
-         * produce a blank page here.  If present, discard it (but include in the hash).
-         * Do this only for the initial write to the file - not after resuming from a
-         * checkpoint.
-         */
+    case PDF_COMPRESSION:
+        svalue = va_arg (ap, const char *);
+        REJECT_NULL
+        if (!xstrcasecmp (svalue, "LZW")) {
+            pdf->p.codec = PDF_CODEC_LZW;
+        } else if (!xstrcasecmp (svalue, "FLATE")) {
+            pdf->p.codec = PDF_CODEC_FLATE;
+        } else if (!xstrcasecmp (svalue, "NONE")) {
+            pdf->p.codec = PDF_CODEC_NONE;
+        } else if (!xstrcasecmp (svalue, "AUTO")) {
+            pdf->p.codec = PDF_CODEC_AUTO;
+        } else {
+            return E(BAD_SET);
+        }
+        return PDF_OK;
 
-        ps->parseused = 0;
-        r = parsestr (ps, string, length, !(ps->flags & PDF_RESUMED));
+    case PDF_DURABILITY:
+        svalue = va_arg (ap, const char *);
+        REJECT_NULL
+        if (!xstrcasecmp (svalue, "NONE")) {
+            pdf->p.durability = PDF_SYNC_NONE;
+        } else if (!xstrcasecmp (svalue, "JOB")) {
+            pdf->p.durability = PDF_SYNC_JOB;
+        } else if (!xstrcasecmp (svalue, "CHECKPOINT")) {
+            pdf->p.durability = PDF_SYNC_CHECKPOINT;
+        } else if (!xstrcasecmp (svalue, "PAGE")) {
+            pdf->p.durability = PDF_SYNC_PAGE;
+        } else {
+            return E(BAD_SET);
+        }
+        return PDF_OK;
 
-        length = ps->parseused;
-        ps->parseused = 0;
+    case PDF_FORM_TYPE:
+        svalue = va_arg (ap, const char *);
+        REJECT_NULL
+        for (i = 0; i < DIM (colors); i++) {
+            if (!xstrcasecmp (svalue, colors[i].name)) {
+                pdf->p.formtype = i;
+                return PDF_OK;
+            }
+        }
+        return E(UNKNOWN_FORM);
 
-        ps->flags &= ~PDF_RESUMED;
+    case PDF_TEXT_FONT:
+        svalue = va_arg (ap, const char *);
+        font = &pdf->p.font;
+        r = checkfont (svalue);
+        break;
 
-        /* A write of length zero is useful because the file structure of
-         * an updated file, as well as all pdf_set parameters, has been validated.
-         * This early return ensures that the file won't be written until there is
-         * new data in the file.  If a FF was seen and stripped, that counts as data
-         * (otherwise another FF in the next call would also be removed.)
-         */
-        if (!length && !r) {
+    case PDF_LNO_FONT:
+        svalue = va_arg (ap, const char *);
+        font = &pdf->p.font;
+        r = checkfont (svalue);
+        break;
+
+    case PDF_LABEL_FONT:
+        svalue = va_arg (ap, const char *);
+        font = &pdf->p.font;
+        r = checkfont (svalue);
+        break;
+
+    case PDF_FORM_IMAGE:
+        svalue = va_arg (ap, const char *);
+        if (svalue == NULL) {
+            free (pdf->p.formfile);
+            pdf->p.formfile = NULL;
             return PDF_OK;
         }
+        if (!(fh = fopen (svalue, "rb"))){
+            return errno;
+        }
+        fclose (fh);
+        font = &pdf->p.formfile;
+        break;
+
+    case PDF_TITLE:
+        svalue = va_arg (ap, const char *);
+        REJECT_NULL
+        font = &pdf->p.title;
+        oldf = tbuf;
+
+        for (r = 0; svalue[r] && r < ((int)sizeof (tbuf)) -2; r++) {
+            if (svalue[r] == '\\' || svalue[r] == '(' || svalue[r] == ')') {
+                *oldf++ = '\\';
+            }
+            *oldf++ = svalue[r];
+        }
+        *oldf = '\0';
+
+        svalue = tbuf;
+        r = PDF_OK;
+        break;
+
+    default:
+        break;
+    }
+
+    if (font) {
+        if (r != PDF_OK) {
+            pdf->errnum = r;
+            return r;
+        }
+
+        oldf = *font;
+        *font = (char *) realloc (*font, strlen (svalue) + 1);
+        if (!*font) {
+            *font = oldf;
+            return errno;
+        }
+        strcpy (*font, svalue);
+        return PDF_OK;
+    }
+
+    dvalue = va_arg (ap, double);
+    ivalue = (unsigned int) dvalue;
+
+    if (dvalue < 0) {
+        return E(NEGVAL);
+    }
+
+    memcpy (&oldvals, pdf, sizeof (PDF));
+
+    r = setjmp (pdf->env);
+    if (r) {
+        memcpy (pdf, &oldvals, sizeof (PDF));
+        return r;
+    }
+
+    switch (arg) {
+    case PDF_NO_LZW: /* Debugging only */
+        if (dvalue) 
+            pdf->flags |= PDF_UNCOMPRESSED;
+        else 
+            pdf->flags &= ~PDF_UNCOMPRESSED;
+        return PDF_OK;
+
+    case PDF_TOP_MARGIN:
+        pdf->p.top = dvalue;
+        break;
+
+    case PDF_TOF_OFFSET:
+        pdf->p.tof = ivalue;
+        break;
+
+    case PDF_BOTTOM_MARGIN:
+        pdf->p.bot = dvalue;
+        break;
 
-        /* This is the actual first write, the file will be modified
-         * There is similar code in pdfclose.
-         */
+    case PDF_SIDE_MARGIN:
+        if (dvalue < 0.350) {
+            ABORT (E(INVAL));
+        }
+        pdf->p.margin = dvalue;
+        break;
 
-        wrhdr (ps);
-        if (!ps->formlen) {
-            setform (ps);
+    case PDF_LNO_WIDTH:
+        if (dvalue && dvalue < 0.1) {
+            ABORT (E(INVAL));
         }
+        pdf->p.lno = dvalue;
+        break;
 
-        /* PDF_WRITTEN has been set */
+    case PDF_BAR_HEIGHT:
+        if (dvalue < 0.0) {
+            ABORT (E(INVAL));
+        }
+        pdf->p.barh = dvalue;
+        break;
 
-        if (errno) {
-            ps->errnum = errno;
-            ABORTps (errno);
+    case PDF_CPI:
+        if (dvalue < 1.0 || dvalue > 20.0) {
+            ABORT (E(INVAL));
         }
-    } else {
-        (void) parsestr (ps, string, length, 0);
-        length = ps->parseused;
-    }
-    ps->parseused = 0;
+        pdf->p.cpi = dvalue;
+        return PDF_OK;
 
-    if (ps->errnum) {
-        return ps->errnum;
-    }
+    case PDF_LPI:
+        if (dvalue != 6.0 && dvalue != 8.0) {
+            ABORT (E(INVAL));
+        }
+        pdf->p.lpi = ivalue;
+        return PDF_OK;
 
-    if (!length) {
+    case PDF_LPP:
+         pdf->p.lpp = ivalue;
         return PDF_OK;
-    }
 
-    /* Line buffer must be flushed before any reference to state that
-     * printing it might update.  It's effective for long strings of
-     * text.
-     */
+    case PDF_THREADS:
+        if (ivalue > 64) {
+            ABORT (E(INVAL));
+        }
+        pdf->p.threads = ivalue;
+        return PDF_OK;
 
-#define FLUSH_LBUF { if (nc) {                   \
-    add2line (ps, lbuf, nc);                     \
-    nc = 0;                                      \
-}}
+    case PDF_FLATE_LEVEL:
+        if (ivalue < 1 || ivalue > 9) {
+            ABORT (E(INVAL));
+        }
+        pdf->p.level = ivalue;
+        return PDF_OK;
 
-    for(parsed = ps->parsebuf; length--;) {
-        short c = *parsed++;
+    case PDF_COMPACT:
+        pdf->p.compact = (ivalue != 0);
+        return PDF_OK;
 
-        if (c == '\f') {
-            if (ps->line == 0) {
-                ps->line = ps->p.tof +1;
-            }
-            FLUSH_LBUF;
-            wrpage (ps);
-            continue;
-        } 
-        if (ps->line > ps->lpp + ps->p.tof) {
-            FLUSH_LBUF;
-            wrpage (ps);
+    case PDF_PREALLOCATE:
+        if (ivalue > 1024) {
+            ABORT (E(INVAL));
         }
-        if (c == '\n') {
-            if (ps->line == 0) {
-                ps->line = ps->p.tof +1;
-            }
-            FLUSH_LBUF;
-            ps->line++;
-            continue;
+        pdf->p.prealloc = ivalue;
+        return PDF_OK;
+
+    case PDF_PAGE_WIDTH:
+        if (dvalue < 3.0) {
+            ABORT (E(INVAL));
         }
-        /* Ordinary data.  If first on page, set line to TOF. */
-        if (ps->line == 0) {
-            ps->line = ps->p.tof +1;
+        pdf->p.wid = dvalue;
+        break;
+
+    case PDF_PAGE_LENGTH:
+        if (dvalue < 2.0) {
+            ABORT (E(INVAL));
         }
+        pdf->p.len = dvalue;
+        break;
 
-        lbuf[nc++] = c;
+    case PDF_COLS:
+        pdf->p.cols = ivalue;
+        break;
 
-        if (nc >= sizeof (lbuf) -1) {
-            FLUSH_LBUF;
-        }
+    default:
+        ABORT (E(BAD_SET));
     }
-    FLUSH_LBUF;
-#undef FLUSH_LBUF
 
-    return ps->errnum;
+#undef REJECT_NULL
+    return PDF_OK;
 }
 
-/* Return current location
- *
- * This is the physical location on the page, 1-based numbering.
- */
-
-int pdf_where (PDF_HANDLE pdf, size_t *page, size_t *line) {
-    size_t p, l;
-
-    valarg (ps);
+static int checkfont (const char *newfont) {
+    const char *const *vf = validFonts;
 
-    p = ps->page +1;
-    l = ps->line;
-    if (l == 0) {
-        l = ps->p.tof +1;
-    }
-    if (l > ps->lpp) {
-        l -= (ps->lpp -1);
-        p++;
+    if (!newfont) {
+        return E(INVAL);
     }
-    p += ps->prevpc;
 
-    if (page) {
-        *page = p;
-    }
-    if (line) {
-        *line = l;
+    while (*vf) {
+        if (!strcmp (*vf++, newfont)) {
+            return PDF_OK;
+        }
     }
-    return PDF_OK;
+    return E(UNKNOWN_FONT);
 }
 
-/* Determine if file is empty
+/* At first output, initialize for output
  */
 
-int pdf_is_empty (PDF_HANDLE pdf) {
-    valarg (ps);
+static void pdfinit (PDF *pdf) {    
+    int r;
+    int reopen;
 
-    if (ps->prevpc || ps->page || ps->line) {
-        return 0;
+    SHA1Reset (&pdf->sha1);
+
+    if (otell (pdf)) {
+        ABORT (E(BUGCHECK));
     }
-    return 1;
-}
 
-/* Get list of known font names */
+    reopen = (pdf->flags & PDF_REOPENED) != 0;
+    pdf->flags &= ~PDF_REOPENED;
 
-const char *const* pdf_get_fontlist ( size_t *length ) {
-    if (length) {
-        *length = DIM (validFonts) -1;
+    if (pdf->flags & PDF_STREAM) {
+        /* Nothing can be read back, so a stream is always new */
+    } else if (pdf->p.frequire == PDF_FILE_APPEND || reopen) {
+        r = checkupdate (pdf);
+        if (r == PDF_OK) {
+            return;
+        }
+        if (r > 1) {
+            ABORT (r);
+        }
+        /* r < 0 => empty file, write as new */
+    } else {
+        if (fseek (pdf->pdf, 0, SEEK_END)) {
+            ABORT (errno);
+        }
+        if (ftell (pdf->pdf)) {
+            if (pdf->p.frequire == PDF_FILE_NEW) {
+                ABORT (E(NOT_EMPTY));
+            }
+            /* Existing, overwrite (PDF_FILE_REPLACE) */
+            fseek (pdf->pdf, 0, SEEK_SET);
+            r = PDF_OK;
+#ifdef _WIN32
+            if (_chsize (_fileno (pdf->pdf), 0) == -1) {
+                r = E(IO_ERROR);
+            }
+#else
+            if (ftruncate (fileno (pdf->pdf), 0) == -1) {
+                r = E(IO_ERROR);
+            }
+#endif
+            if (r != PDF_OK) {
+                ABORT (r);
+            }
+        }
+        /* File empty, or emptied.  */
     }
-    return validFonts;
+
+    /* New file */
+
+    pdf->pbase = 1;
+
+    return;
 }
-/* Get list of known form names */
 
-const char *const* pdf_get_formlist ( size_t *length ) {
-    size_t i;
+/* Handle the gymnastics for adding pages to an existing file.
+ * Does not handle the general case PDF, but will update those
+ * written by this library.  Produces unbalanced page trees to
+ * minimize work in update.
+ *
+ * returns PDF_OK if updating, < 0 if OK to write (empty file)
+ * ABORTs on most errors.
+ */
 
-    if (formlist) {
-        return formlist;
-    }
-    formlist = (const char **)malloc ((DIM(colors) + 1) * sizeof (const char *));
-    if (!formlist) {
-        if (length) {
-            *length = 0;
-        }
-        return NULL;
-    }
-    for (i = 0; i < DIM(colors); i++) {
-        formlist[i] = colors[i].name;
+static int checkupdate (PDF *pdf) {
+    t_fpos end;
+    int r;
+
+    /* Make sure file is seekable, if zero length, treat as new. */
+
+    if (fseek (pdf->pdf, 0, SEEK_END)) {
+        return errno;
     }
-    formlist[i] = NULL;
-    if (length) {
-        *length = i;
+    end = ftell (pdf->pdf);
+    if (!end) {
+        return -1;
     }
 
-    return formlist;
-}
+    /* The metadata is parsed in place, from a view of the whole file */
 
-/* Checkpoint a pdf file
- * This writes the metadata for the file and flushes
- * I/O buffers.  The first write thereafter will corrupt it again.
- * the file remains open and the PDF_HANDLE remains valid.
- * The file is positioned to overwrite the new metadata with page data.  This allows
- * processes (such as simulated LPTs) that leave files open for long periods
- * between bursts of writing to have some chance of surviving a crash.
- */
+    if ((r = vopen (pdf, end)) != PDF_OK) {
+        return r;
+    }
+    r = rdupdate (pdf);
+    vclose (pdf);
 
-int pdf_checkpoint (PDF_HANDLE pdf) {
-    int r = PDF_OK;
-    unsigned int obj;
-    SHA1Context sha1;
+    return r;
+}
 
-    valarg (ps);
+/* Read the metadata of a file to be updated, from its view.
+ * Returns as checkupdate.
+ */
 
-    if (ps->flags & PDF_WRITTEN) {
-        unsigned int line = ps->line;
+static int rdupdate (PDF *pdf) {
+    const char *v, *e, *s;
+    char *p, *trail, *q;
+    size_t tsize;
+    unsigned int obj;
+    t_fpos xpos, prev;
 
-        ps->line = 0;
+    v = pdf->view;
+    e = v + pdf->vsize;
 
-        obj = ps->obj;
-        ps->checkpp = ftell (ps->pdf);
-        memcpy (&sha1, &ps->sha1, sizeof (sha1));
+    /* Validate PDF header */
 
-        r = pdfclose (ps, 1);
+    if (pdf->vsize < 7 || strncmp (v, "%PDF-1.", 7)) {
+        return E(NOT_PDF);
+    }
+    s = v + 7;
 
-        memcpy (&ps->sha1, &sha1, sizeof (sha1));
-        fseek (ps->pdf, ps->checkpp, SEEK_SET);
-        ps->obj = obj;
-        ps->line = line;
+    while (s < e && isdigit (*s)) {
+        s++;
+    }
+    if (s >= e || *s != '\n') {
+        return E(NO_APPEND);
+    }
 
-        ps->flags &= ~PDF_WRITTEN;
-        ps->flags |= PDF_RESUMED;
- 
-        if (r != PDF_OK) {
-            ps->errnum = r;
-        }
+    /* Probable PDF.  Find the XREF
+     *
+     * The last three lines of the file must be
+     * startxref
+     *  byte offset of xref table
+     * %%EOF
+     */
+    if (e - v < 7 || memcmp (e - 7, "\n%%EOF\n", 7)) {
+        return E(NO_APPEND);
+    }
+    for (s = e - 7; s > v && isdigit (s[-1]); s--)
+        ;
+    if (s == e - 7 || (e - 7) - s > 19 || s - v < 11 ||
+        memcmp (s - 11, "\nstartxref\n", 11)) {
+        return E(NO_APPEND);
     }
-    return r;
-}
 
-/* re-open an active file
- * Checkpoints the current state.
- * Resets to "just opened" + resumed + all sets.
- * Allows changing forms mid-stream.
- */
+    pdf->xpos = 0;
+    while (s < e - 7) {
+        pdf->xpos *= 10;
+        pdf->xpos += *s++ - '0';
+    }
+    if (pdf->xpos <= 9 || pdf->xpos >= (t_fpos) pdf->vsize) {
+        return E(NO_APPEND);
+    }
 
-int pdf_reopen (PDF_HANDLE pdf) {
-    int r;
+    /* Found the xref pointer and verified EOF
+     * For the moment, the only version of the xref that will
+     * be processed is the one written by this library.  The full
+     * variety of deleted pages, etc is more than what's needed.
+     *
+     * A checkpoint may have added an update: a section for the objects
+     * it wrote, linked to the one before by /Prev.  Sections are read
+     * newest first.  The newest trailer describes the file.
+     */
+    trail = NULL;
+    xpos = pdf->xpos;
+    do {
+        if (!(p = rdxref (pdf, xpos, &prev))) {
+            free (trail);
+            return E(NO_APPEND);
+        }
+        if (trail) {
+            free (p);
+        } else {
+            trail = p;
+        }
+        if (prev >= xpos) {     /* An update follows what it updates */
+            free (trail);
+            return E(NO_APPEND);
+        }
+        xpos = prev;
+    } while (xpos);
+    tsize = strlen (trail) +1;
 
-    valarg (ps);
+    /* Must be at least freelist, info, cat, page dir, and all located */
 
-    ps->errnum = 0;
+    if (pdf->obj < 4) {
+        free (trail);
+        return E(NO_APPEND);
+    }
+    for (obj = 0; obj < pdf->obj; obj++) {
+        if (!pdf->xref[obj]) {
+            free (trail);
+            return E(NO_APPEND);
+        }
+    }
 
-    r = setjmp (ps->env);
-    if (r) {
-        return r;
+    /* Extract the data needed to navigate and to restore at close */
+    q = "/ID [";
+    if (!(p = strstr (trail, q))) {
+        free (trail);
+        return E(NO_APPEND);
     }
+    p += strlen (q);
 
-    return pdfreopen (ps);
-}
+    while (*p == ' ')
+            p++;
+    if ( *p++ != '<') {
+        free (trail);
+        return E(NO_APPEND);
+    }
+    if (strlen (p) < (SHA1HashSize*2) + 1 || p[SHA1HashSize*2] != '>') {
+        free (trail);
+        return E(NO_APPEND);
+    }
+    memcpy (pdf->oid, p, SHA1HashSize*2);
+    SHA1Input (&pdf->sha1, (uint8_t *)p, SHA1HashSize*2);
 
-/* Obtain a snapshot of an active file.
- *
- * Checkpoints the active file and copies it in a consistent state to
- * the specified file.
- *
- */
+    pdf->iobj  = getref (pdf, trail, "/Info");
 
-int pdf_snapshot (PDF_HANDLE pdf, const char *filename) {
-    FILE *fh;
-    t_fpos fpos;
-    unsigned char *buffer;
-    size_t n;
-    int r;
+    /* Old catalog will be new start of page streams */
 
-    valarg (ps);
+    pdf->pbase = getref (pdf, trail, "/Root");
 
-    r = pdf_checkpoint (pdf);
-    if (r != PDF_OK) {
-        return r;
+    if (pdf->pbase >= pdf->iobj) {
+        free (trail);
+        return E(NO_APPEND);
     }
 
-    if ((buffer = (unsigned char *) malloc (COPY_BUFSIZE)) == NULL) {
-        return errno;
+    /* Follow link to the document information object */
+
+    (void) readobj (pdf, pdf->iobj, &trail, &tsize);
+    if (!strstr (trail, "/Producer (LPTPDF Version " VERSION_REQUIRED)) {
+        free (trail);
+        return E(NOT_PRODUCED);
     }
 
-    if ((fh = fopen (filename, "wb")) == NULL ) {
-        free (buffer);
-        return errno;
+    p = getstr (pdf, trail, "/CreationDate");
+    if (!p || strlen (p) >= sizeof (pdf->ctime) || strlen(p) < strlen ("(D:YYYY)") ||
+        strncmp (p, "(D:", 3) || p[strlen (p) -1] != ')') {
+        free (p);
+        free (trail);
+        return E(NO_APPEND);
     }
+    strcpy (pdf->ctime, p+3);
+    pdf->ctime[strlen (pdf->ctime) -1] ='\0';
+    free (p);
 
-    fpos = ftell (ps->pdf);
+    /* Follow link to root (catalog), soon to be over-written */
 
-    if ((r = setjmp (ps->env)) != 0) {
-        free (buffer);
-        fseek (ps->pdf, fpos, SEEK_SET);
-        fclose (fh);
-        return r;
+    (void) readobj (pdf, pdf->pbase, &trail, &tsize);
+    if (!strstr (trail, "/Type /Catalog")) {
+        free (trail);
+        return E(NO_APPEND);
     }
 
-    fseek (ps->pdf, 0, SEEK_SET);
+    /* Page tree is anchor node for all previous sessions */
+    
+    pdf->aobj = getref (pdf, trail, "/Pages");
+    if (pdf->aobj != pdf->pbase -1) {
+        free (trail);
+        return E(NO_APPEND);
+    }
 
-    while ((n = fread (buffer, 1, COPY_BUFSIZE, ps->pdf)) > 0) {
-        size_t w;
+    /* Get current page count, confirming this is the tree root (no /Parent) */
 
-        if ((w = fwrite (buffer, n, 1, fh)) != 1) {
-            ABORTps (errno);
-        }
-     }
+    pdf->anchorp = readobj (pdf, pdf->aobj, &trail, &tsize);
+    if (!strstr (trail, "/Type /Pages") || strstr (trail, "/Parent")) {
+        free (trail);
+        return E(NO_APPEND);
+    }
+    pdf->prevpc = getint (pdf, trail, "/Count", (const char **)&q);
+
+    /* Save trailer for wrhdr, both first write and checkpoints */
+
+    pdf->trail = trail;
 
-     fseek (ps->pdf, fpos, SEEK_SET);
+    /* Ready for update, in update mode */
 
-     if (ferror (ps->pdf)) {
-         ABORTps (E(IO_ERROR));
-     }
+    pdf->flags |= PDF_UPDATING;
 
-     if (fclose (fh) == EOF) {
-        ABORTps (errno);
-     }
+    /* New objects are allocated starting with pdf->pagebase - the old catalog */
 
-     free (buffer);
+    pdf->obj = pdf->pbase -1;
 
-     return PDF_OK;
+    return PDF_OK;
 }
 
-/* close a pdf file
- *
- * Writes updated metadata
+/* Read an xref section written by this library, and its trailer.
+ * An object that is already located was moved by a later section, and
+ * keeps that location.  Returns the trailer, with *prev set from its
+ * /Prev (0 if none), or NULL if the section isn't understood.
  */
 
-int pdf_close (PDF_HANDLE pdf) {
-    valarg (ps);
+static char *rdxref (PDF *pdf, t_fpos pos, t_fpos *prev) {
+    const char *p, *e, *l, *t;
+    char *trail;
+    unsigned int obj, objs, objn, gen, n;
+    t_fpos objp;
+    int i;
 
-    return pdfclose (ps, 0);
+    p = pdf->view + pos;
+    e = pdf->view + pdf->vsize;
+    if (e - p < 5 || memcmp (p, "xref\n", 5)) {
+        return NULL;
+    }
+    p += 5;
+
+    /* Subsections, up to the trailer
+     *
+     * dec dec \n := first object in section, # objects in section
+     */
+    while (1) {
+        if (!(l = vline (pdf, p))) {
+            return NULL;
+        }
+        if (l - p == 8 && !memcmp (p, "trailer\n", 8)) {
+            p = l;
+            break;
+        }
+        objs = 0;
+        t = p;
+        while (isdigit (*p)) {
+            objs = (objs * 10) + *p++ - '0';
+        }
+        if (p == t || *p != ' ') {
+            return NULL;
+        }
+        p++;
+
+        objn = 0;
+        while (isdigit (*p)) {
+            objn = (objn * 10) + *p++ - '0';
+        }
+        if (*p++ != '\n') {
+            return NULL;
+        }
+
+        /* Read the entries into the context.
+         * Each is 20 bytes: offset, generation, type and a 2-byte EOL.
+         */
+        if ((size_t)(e - p) / 20 < objn) {
+            return NULL;
+        }
+        if (objs + objn > pdf->xsize) {         /* Sized once, the xref is filled in place */
+            t_fpos *xt = (t_fpos *) realloc (pdf->xref, (objs + objn) * sizeof (t_fpos));
+
+            if (!xt) {
+                return NULL;
+            }
+            pdf->xref = xt;
+            pdf->xsize = objs + objn;
+        }
+        for (n = 0; n < objn; n++, p += 20) {
+            objp = 0;
+            for (i = 0; i < 10; i++) {
+                if (!isdigit (p[i])) {
+                    return NULL;
+                }
+                objp = (objp * 10) + p[i] - '0';
+            }
+            gen = 0;
+            for (i = 11; i < 16; i++) {
+                if (!isdigit (p[i])) {
+                    return NULL;
+                }
+                gen = (gen * 10) + p[i] - '0';
+            }
+            if (p[10] != ' ' || p[16] != ' ' || p[19] != '\n') {
+                return NULL;
+            }
+            obj = objs + n;
+            if (p[17] == 'f' && gen == 65535 && objp == 0 && obj == 0) {
+                continue;
+            }
+            if (gen != 0 || objp == 0 || p[17] != 'n' || obj == 0) {
+                return NULL;
+            }
+
+            while (pdf->obj < obj) {
+                pdf->xref[pdf->obj++] = 0;
+            }
+            if (!pdf->xref[obj -1]) {
+                pdf->xref[obj -1] = objp;
+            }
+        }
+    }
+
+    /* The trailer runs to startxref */
+
+    for (t = p; ; p = l) {
+        if (!(l = vline (pdf, p))) {
+            return NULL;
+        }
+        if (l - p == 10 && !memcmp (p, "startxref\n", 10)) {
+            break;
+        }
+    }
+    if (!(trail = (char *) malloc ((p - t) +1))) {
+        return NULL;
+    }
+    memcpy (trail, t, p - t);
+    trail[p - t] = '\0';
+
+    *prev = 0;
+    if ((l = strstr (trail, "/Prev "))) {
+        *prev = (t_fpos) strtoul (l + 6, NULL, 10);
+    }
+    return trail;
 }
 
-/* Test if a file seems to be a PDF file.
- * Simple header check.
- *
- * PDF_OK if it passes.
+/* Make the existing file addressable as pdf->view.
+ * It is mapped if possible, otherwise read into memory.
  */
 
-int pdf_file (const char *name) {
-    FILE *fh;
-    char buf[100];
-    char *p;
+static int vopen (PDF *pdf, t_fpos size) {
+#ifdef USE_MMAP
+    void *m;
 
-    if (!(fh = fopen (name, "rb"))) {
-        return errno;
+    m = mmap (NULL, (size_t) size, PROT_READ, MAP_SHARED, fileno (pdf->pdf), 0);
+    if (m != MAP_FAILED) {
+        pdf->view = (char *) m;
+        pdf->vsize = (size_t) size;
+        pdf->vmapped = 1;
+        return PDF_OK;
     }
-    if (!fgets (buf, sizeof (buf), fh)) {
-        fclose (fh);
+#endif
+    if (!(pdf->view = (char *) malloc ((size_t) size))) {
         return errno;
     }
-    fclose (fh);
-    if (strncmp (buf, "%PDF-1.", 7)) {
-        return E(NOT_PDF);
+    pdf->vsize = (size_t) size;
+    pdf->vmapped = 0;
+    if (fseek (pdf->pdf, 0, SEEK_SET) || fread (pdf->view, pdf->vsize, 1, pdf->pdf) != 1) {
+        vclose (pdf);
+        return E(IO_ERROR);
     }
-    p = buf + 7;
+    return PDF_OK;
+}
 
-    while (*p && isdigit (*p)) {
-        p++;
+/* Release the view */
+
+static void vclose (PDF *pdf) {
+    if (!pdf->view) {
+        return;
     }
-    if (*p == '\n') {
-        return PDF_OK;
+    if (pdf->vmapped) {
+#ifdef USE_MMAP
+        munmap (pdf->view, pdf->vsize);
+#endif
+    } else {
+        free (pdf->view);
     }
-    return E(NOT_PDF);
+    pdf->view = NULL;
+    pdf->vsize = 0;
+    pdf->vmapped = 0;
+    return;
 }
 
-/* Print string with last error.
+/* Find the end of the line starting at p in the view.
+ * Returns the start of the next line, or NULL if p is on the last,
+ * unterminated, line.
  */
 
-void pdf_perror (PDF_HANDLE pdf, const char *s) {
+static const char *vline (PDF *pdf, const char *p) {
+    const char *e = pdf->view + pdf->vsize;
 
-    if (s && *s) {
-        fprintf (stderr, "%s: ", s);
+    if (p >= e || !(p = (const char *) memchr (p, '\n', e - p))) {
+        return NULL;
     }
+    return p +1;
+}
 
-    fprintf (stderr, "%s\n", pdf_strerror (pdf_error(pdf)));
+/* Position to rewrite data written earlier.
+ * A snapshot that has it is no longer the same from there on.
+ */
 
+static void seekback (PDF *pdf, t_fpos pos) {
+    oseek (pdf, pos);
+    if (pos < pdf->snaplen) {
+        pdf->snaplen = pos;
+    }
     return;
 }
 
-/* Get string for error number
+/* Take a snapshot.
+ * For an update, the data that the last snapshot has in common with
+ * the file is kept.
  */
 
-const char *pdf_strerror (int errnum) {
+static int snapshot (PDF *pdf, const char *filename, int update) {
+    FILE *fh = NULL;
+    t_fpos end, from = 0;
+    struct stat sb;
+    int r;
 
-    if (!errnum) {
-        return "Success";
+    if (pdf->flags & PDF_STREAM) {
+        return pdf->errnum = E(NOT_SEEKABLE);
     }
 
-    if (errnum >= E(BASE)) {
-        errnum -= E(BASE);
-        if (((size_t)errnum) >= DIM(errortext)) {
-            errnum = 0;
+    r = pdf_checkpoint (pdf);
+    if (r != PDF_OK) {
+        return r;
+    }
+
+    /* After a checkpoint, or if nothing has been written, the file
+     * ends with its metadata.
+     */
+    if (fseek (pdf->pdf, 0, SEEK_END)) {
+        return errno;
+    }
+    end = ftell (pdf->pdf);
+
+    if (update && pdf->snapname && !strcmp (filename, pdf->snapname) &&
+        !stat (filename, &sb) && (t_fpos) sb.st_size == pdf->snapsize &&
+        sb.st_mtime == pdf->snapmtime) {
+        if ((fh = fopen (filename, "r+b")) != NULL) {
+            from = (pdf->snaplen < end)? pdf->snaplen: end;
         }
-        return errortext[errnum];
-    } else {
-        return strerror (errnum);
     }
+    if (!fh && (fh = fopen (filename, "wb")) == NULL) {
+        return errno;
+    }
+
+    r = fcopy (pdf->pdf, fh, from, end - from);
+
+    if (fclose (fh) == EOF && r == PDF_OK) {
+        r = errno;
+    }
+
+    /* Remember it for the next update */
+
+    free (pdf->snapname);
+    pdf->snapname = NULL;
+    if (r == PDF_OK && !stat (filename, &sb) &&
+        (pdf->snapname = (char *) malloc (strlen (filename) +1)) != NULL) {
+        strcpy (pdf->snapname, filename);
+        pdf->snapsize = end;
+        pdf->snapmtime = sb.st_mtime;
+        pdf->snaplen = end;
+    }
+    return r;
 }
 
-/* Get last error
+/* Copy len bytes at pos of one file to the same place in another, which
+ * is then truncated after them.
+ * The kernel copies where it can: with a reflink of the whole file, which
+ * shares the data, or with copy_file_range or sendfile, which copy it
+ * without passing it through user space.  Otherwise, a buffer is used.
  */
 
-int pdf_error (PDF_HANDLE pdf) {
-    int err;
+static int fcopy (FILE *in, FILE *out, t_fpos pos, t_fpos len) {
+    t_fpos end = pos + len;
+    char *buf;
+    size_t n;
+    int r = PDF_OK;
 
-    if (ps) {
-        err = ps->errnum;
-    } else {
-        err = errno;
+    if (fflush (in) == EOF || fflush (out) == EOF) {
+        return errno;
     }
 
-    if (((size_t)err) >= E(BASE)) {
-        if (((size_t)(err - E(BASE))) >= DIM(errortext)) {
-            err = E(BAD_ERRNO);
-        }
-    }
+#ifdef USE_KCOPY
+    {
+        int ifd = fileno (in), ofd = fileno (out);
+        off_t ip;
+        ssize_t k;
 
-    return err;
-}
+#ifdef FICLONE
+        {
+            struct stat sb;
 
-/* Clear last error */
+            if (!fstat (ifd, &sb) && (t_fpos) sb.st_size == end &&
+                !ioctl (ofd, FICLONE, ifd)) {
+                return PDF_OK;
+            }
+        }
+#endif
+#ifdef SYS_copy_file_range
+        {
+            off_t op;
 
-void pdf_clearerr (PDF_HANDLE pdf) {
+            ip = op = pos;
+            while (pos < end &&
+                   (k = syscall (SYS_copy_file_range, ifd, &ip, ofd, &op, (size_t) (end - pos), 0)) > 0) {
+                pos += k;
+            }
+        }
+#endif
+        if (pos < end && lseek (ofd, pos, SEEK_SET) == pos) {
+            ip = pos;
+            while (pos < end && (k = sendfile (ofd, ifd, &ip, (size_t) (end - pos))) > 0) {
+                pos += k;
+            }
+        }
+    }
+#endif
 
-    if (!pdf) {
-        errno = E(BAD_HANDLE);
-        return;
+    if (pos < end) {
+        if ((buf = (char *) malloc (FCOPY_BUFSIZE)) == NULL) {
+            return errno;
+        }
+        fseek (in, pos, SEEK_SET);
+        fseek (out, pos, SEEK_SET);
+        while (pos < end) {
+            n = (end - pos < FCOPY_BUFSIZE)? (size_t) (end - pos): FCOPY_BUFSIZE;
+            if (fread (buf, n, 1, in) != 1) {
+                r = E(IO_ERROR);
+                break;
+            }
+            if (fwrite (buf, n, 1, out) != 1) {
+                r = errno;
+                break;
+            }
+            pos += n;
+        }
+        free (buf);
+        if (fflush (out) == EOF && r == PDF_OK) {
+            r = errno;
+        }
     }
-    ps->errnum = errno = 0;
 
-    return;
+#ifdef _WIN32
+    if (_chsize (_fileno (out), end) == -1 && r == PDF_OK) {
+        r = E(IO_ERROR);
+    }
+#else
+    if (ftruncate (fileno (out), end) == -1 && r == PDF_OK) {
+        r = E(IO_ERROR);
+    }
+#endif
+    return r;
 }
 
+/* Output
+ *
+ * Everything written to the PDF file goes through one large buffer,
+ * which keeps the file position itself, so neither stdio nor its
+ * locking is used for each object.  The buffer is written with writev,
+ * together with a block that doesn't fit in it, so the file gets few,
+ * large writes.  Where writev isn't available, it is written with stdio.
+ */
 
-/* *** End of public API *** */
-
-static int pdfreopen (PDF *pdf) {
-    int r;
-
-    /* Commit everything to the current file */
+/* Set up output to pdf->pdf, positioned at its start */
 
-    r = pdfclose (pdf, 1);
+static int oopen (PDF *pdf) {
+    void *buf;
 
-    if (r != PDF_OK) {
-        return r;
+    if (fflush (pdf->pdf) == EOF) {
+        return errno;
+    }
+#ifdef USE_FDOUT
+    if (posix_memalign (&buf, OBUF_ALIGN, OBUF_SIZE)) {
+        return ENOMEM;
     }
+    pdf->ofd = fileno (pdf->pdf);
 
-    /* Reset all state to "just opened"
-     * Exceptions:
-     *  flags - retain preferences
-     *          Suppress initial FF removal
-     *          Remember reopen to force append at first output
-     *  buffers - don't deallocate, but set current used to 0
-     * character set selections.
+    /* The file is still read with stdio, which must not buffer what
+     * is then overwritten.
      */
+    if (pdf->pdf != stdout) {
+        setvbuf (pdf->pdf, NULL, _IONBF, 0);
+    }
+#else
+    if ((buf = malloc (OBUF_SIZE)) == NULL) {
+        return errno;
+    }
+    pdf->ofd = -1;
+#endif
+    pdf->obuf = (char *) buf;
+    pdf->oused = 0;
+    pdf->opos = 0;
+    pdf->oalloc = 0;
+    pdf->oerr = 0;
+    return PDF_OK;
+}
 
-    fseek (pdf->pdf, 0, SEEK_SET);
+/* Write data at the current position */
 
-    pdf->flags = pdf->flags & (PDF_TMPFILE | PDF_UNCOMPRESSED);
-    pdf->flags |= PDF_RESUMED | PDF_REOPENED;
+static void owrite (PDF *pdf, const char *data, size_t len) {
+    if (len <= OBUF_SIZE - pdf->oused) {
+        memcpy (pdf->obuf + pdf->oused, data, len);
+        pdf->oused += len;
+        return;
+    }
+    oput (pdf, data, len);
+    return;
+}
 
-    pdf->escstate = ESC_IDLE;
-    /* Leave CHARSET *: gset, gl, gr, ssg */
+/* Format data at the current position */
 
-    pdf->formlen =
-        pdf->formobj =
-        pdf->prevpc =
-        pdf->anchorp =
-        pdf->anchorpp =
-        pdf->checkpp =
-        pdf->aobj =
-        pdf->obj =
-        pdf->xpos =
-        pdf->lpp =
-        pdf->page =
-        pdf->line =
-        pdf->pbase =
-        pdf->iobj =
-        pdf->parseused =
-        pdf->pbused = 
-        pdf->lzwused = 0;
-    free (pdf->trail);
-    pdf->trail = NULL;
+static void oprintf (PDF *pdf, const char *fmt, ...) {
+    va_list ap;
+    size_t room;
+    int n;
 
-    return PDF_OK;
+    for (;;) {
+        room = OBUF_SIZE - pdf->oused;
+        va_start (ap, fmt);
+        n = vsnprintf (pdf->obuf + pdf->oused, room, fmt, ap);
+        va_end (ap);
+        if (n >= 0 && (size_t) n < room) {
+            pdf->oused += n;
+            return;
+        }
+        if (!pdf->oused) {
+            ABORT (E(BUGCHECK));
+        }
+        oput (pdf, NULL, 0);
+    }
 }
 
-/* The work of pdf_set
+/* Move the current position.
+ * A stream can only be positioned where it is.
  */
 
-#define REJECT_NULL { if (svalue == NULL) {         \
-                        pdf->errnum = E(INVAL);     \
-                        return pdf->errnum; } }
+static void oseek (PDF *pdf, t_fpos pos) {
+    if (pos == otell (pdf)) {
+        return;
+    }
+    oput (pdf, NULL, 0);
+    if ((pdf->flags & PDF_STREAM) && !pdf->oerr) {
+        pdf->oerr = ESPIPE;
+    }
+    pdf->opos = pos;
+    return;
+}
 
-static int pdfset (PDF *pdf, int arg, va_list ap) {
-    unsigned int ivalue;
-    double dvalue;
-    const char *svalue = NULL;
-    char **font = NULL;
-    char *oldf;
-    PDF oldvals;
-    char tbuf[PDF_C_LINELEN -2]; /* Title is in () */
+/* Write everything buffered.
+ * Returns the first write error, if any.
+ */
+
+static int oflush (PDF *pdf) {
+    oput (pdf, NULL, 0);
+#ifndef USE_FDOUT
+    if (fflush (pdf->pdf) == EOF && !pdf->oerr) {
+        pdf->oerr = errno;
+    }
+#endif
+    return pdf->oerr;
+}
+
+/* Write the buffer, followed by len bytes of data, and empty it.
+ * Ahead of a regular file's end, space is preallocated in extents of
+ * PDF_PREALLOCATE megabytes, so that a file that is appended to for a
+ * long time isn't fragmented.  The space is reserved without changing
+ * the file's size.
+ * After an error, nothing more is written.
+ */
+
+static void oput (PDF *pdf, const char *data, size_t len) {
+    t_fpos end = pdf->opos + pdf->oused + len;
     int r = PDF_OK;
-    size_t i;
-    FILE *fh;
 
-    if (pdf->flags & PDF_ACTIVE) {
-        return E(ACTIVE);
+    if (pdf->oused + len == 0 || pdf->oerr) {
+        pdf->opos = end;
+        pdf->oused = 0;
+        return;
     }
+#ifdef USE_FDOUT
+    {
+        struct iovec iov[2], *v = iov;
+        int nv = 0;
+        ssize_t k;
 
-    switch (arg) {
-    case PDF_FILE_REQUIRE:
-        svalue = va_arg (ap, const char *);
-        REJECT_NULL
-        if (!xstrcasecmp (svalue, "NEW")) {
-            pdf->p.frequire = PDF_FILE_NEW;
-        } else if (!xstrcasecmp (svalue, "APPEND")) {
-            pdf->p.frequire = PDF_FILE_APPEND;
-        } else if (!xstrcasecmp (svalue, "REPLACE")) {
-            pdf->p.frequire = PDF_FILE_REPLACE;
-        } else {
-            return E(BAD_SET);
-        }
-        return PDF_OK;
+#ifdef USE_FALLOCATE
+        if (pdf->p.prealloc && end > pdf->oalloc && !(pdf->flags & PDF_STREAM)) {
+            t_fpos ext = (t_fpos) pdf->p.prealloc * 1024 * 1024;
+            t_fpos to = (end / ext + 1) * ext;
 
-    case PDF_FORM_TYPE:
-        svalue = va_arg (ap, const char *);
-        REJECT_NULL
-        for (i = 0; i < DIM (colors); i++) {
-            if (!xstrcasecmp (svalue, colors[i].name)) {
-                pdf->p.formtype = i;
-                return PDF_OK;
+            (void) fallocate (pdf->ofd, FALLOC_FL_KEEP_SIZE, pdf->oalloc, to - pdf->oalloc);
+            pdf->oalloc = to;
+        }
+#endif
+        if (pdf->oused) {
+            iov[nv].iov_base = pdf->obuf;
+            iov[nv++].iov_len = pdf->oused;
+        }
+        if (len) {
+            iov[nv].iov_base = (void *) data;
+            iov[nv++].iov_len = len;
+        }
+        if (!(pdf->flags & PDF_STREAM) && lseek (pdf->ofd, pdf->opos, SEEK_SET) == -1) {
+            r = errno;
+            nv = 0;
+        }
+        while (nv) {
+            if ((k = writev (pdf->ofd, v, nv)) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                r = errno;
+                break;
+            }
+            while (nv && (size_t) k >= v->iov_len) {
+                k -= v->iov_len;
+                v++;
+                nv--;
+            }
+            if (nv) {
+                v->iov_base = (char *) v->iov_base + k;
+                v->iov_len -= k;
             }
         }
-        return E(UNKNOWN_FORM);
+    }
+#else
+    if (fseek (pdf->pdf, pdf->opos, SEEK_SET) ||
+        (pdf->oused && fwrite (pdf->obuf, pdf->oused, 1, pdf->pdf) != 1) ||
+        (len && fwrite (data, len, 1, pdf->pdf) != 1)) {
+        r = errno;
+    }
+#endif
+    if (r != PDF_OK) {
+        pdf->oerr = r;
+    }
+    pdf->opos = end;
+    pdf->oused = 0;
+    return;
+}
 
-    case PDF_TEXT_FONT:
-        svalue = va_arg (ap, const char *);
-        font = &pdf->p.font;
-        r = checkfont (svalue);
-        break;
+/* Write everything buffered, and sync the file to storage.
+ * A temporary file isn't the output, and a stream can't be synced.
+ *
+ * Handles that sync at the same time are committed as a group.  The
+ * first to arrive syncs the files of all that are waiting; those that
+ * arrive meanwhile wait for the next group.  On Linux, the writes of
+ * all the group's files are started before any is waited for, so they
+ * share the device's and the journal's flushes.
+ * Returns the first write or sync error, if any.
+ */
 
-    case PDF_LNO_FONT:
-        svalue = va_arg (ap, const char *);
-        font = &pdf->p.font;
-        r = checkfont (svalue);
-        break;
+#ifdef USE_THREADS
+struct syncreq {
+    int fd;
+    int err;
+    int done;
+    struct syncreq *next;
+};
 
-    case PDF_LABEL_FONT:
-        svalue = va_arg (ap, const char *);
-        font = &pdf->p.font;
-        r = checkfont (svalue);
-        break;
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    struct syncreq *queue;  /* Waiting for the next group */
+    int busy;               /* A group is being synced */
+} syncq = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0 };
+#endif
+
+static int osync (PDF *pdf) {
+    int r = PDF_OK;
 
-    case PDF_FORM_IMAGE:
-        svalue = va_arg (ap, const char *);
-        if (svalue == NULL) {
-            free (pdf->p.formfile);
-            pdf->p.formfile = NULL;
-            return PDF_OK;
-        }
-        if (!(fh = fopen (svalue, "rb"))){
-            return errno;
-        }
-        fclose (fh);
-        font = &pdf->p.formfile;
-        break;
+    if (oflush (pdf) != PDF_OK || (pdf->flags & (PDF_TMPFILE | PDF_STREAM))) {
+        return pdf->oerr;
+    }
+#ifdef USE_THREADS
+    {
+        struct syncreq req, *group, *q, *next;
 
-    case PDF_TITLE:
-        svalue = va_arg (ap, const char *);
-        REJECT_NULL
-        font = &pdf->p.title;
-        oldf = tbuf;
+        req.fd = fileno (pdf->pdf);
+        req.err = 0;
+        req.done = 0;
 
-        for (r = 0; svalue[r] && r < ((int)sizeof (tbuf)) -2; r++) {
-            if (svalue[r] == '\\' || svalue[r] == '(' || svalue[r] == ')') {
-                *oldf++ = '\\';
+        pthread_mutex_lock (&syncq.lock);
+        req.next = syncq.queue;
+        syncq.queue = &req;
+        while (!req.done) {
+            if (syncq.busy) {
+                pthread_cond_wait (&syncq.done, &syncq.lock);
+                continue;
             }
-            *oldf++ = svalue[r];
+            group = syncq.queue;
+            syncq.queue = NULL;
+            syncq.busy = 1;
+            pthread_mutex_unlock (&syncq.lock);
+
+#ifdef SYNC_FILE_RANGE_WRITE
+            if (group->next) {
+                for (q = group; q; q = q->next) {
+                    (void) sync_file_range (q->fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+                }
+            }
+#endif
+            for (q = group; q; q = q->next) {
+                if (fdsync (q->fd) == -1) {
+                    q->err = errno;
+                }
+            }
+
+            pthread_mutex_lock (&syncq.lock);
+            for (q = group; q; q = next) {
+                next = q->next;
+                q->done = 1;
+            }
+            syncq.busy = 0;
+            pthread_cond_broadcast (&syncq.done);
         }
-        *oldf = '\0';
+        pthread_mutex_unlock (&syncq.lock);
+        r = req.err;
+    }
+#else
+    if (fdsync (fileno (pdf->pdf)) == -1) {
+        r = errno;
+    }
+#endif
+    if (r != PDF_OK && !pdf->oerr) {
+        pdf->oerr = r;
+    }
+    return pdf->oerr;
+}
 
-        svalue = tbuf;
-        r = PDF_OK;
-        break;
 
-    default:
-        break;
-    }
+/* Write the file header on first output of data.
+ * If update allowed, activates update processing instead.
+ * Validates sensible parameters.
+ */
 
-    if (font) {
-        if (r != PDF_OK) {
-            pdf->errnum = r;
-            return r;
-        }
+static void wrhdr (PDF *pdf) {
+    char *trail, *q;
 
-        oldf = *font;
-        *font = (char *) realloc (*font, strlen (svalue) + 1);
-        if (!*font) {
-            *font = oldf;
-            return errno;
+    if (!(pdf->flags & PDF_UPDATING)) {
+        /* New file.  First time, write file ID.
+         * After that, resuming from checkpoint.  File is already positioned.
+         */
+        if (!pdf->checkpp) {
+            owrite (pdf, QS(PDF_C_HEADER));
         }
-        strcpy (*font, svalue);
-        return PDF_OK;
+        pdf->flags |= PDF_WRITTEN;
+        return;
     }
 
-    dvalue = va_arg (ap, double);
-    ivalue = (unsigned int) dvalue;
+    /* Position to over-write the old anchor, catalog, info object with
+     * a new /Pages node that holds all existing pages.  The parent will be
+     * determined at the end of this session, so enough space is left to be able
+     * to patch it during pdf_close.
+     */
 
-    if (dvalue < 0) {
-        return E(NEGVAL);
+    trail = pdf->trail;
+
+    if (pdf->prevpc != getint (pdf, trail, "/Count", (const char **)&q)) {
+        ABORT (E(INCON_GEO));
     }
 
-    memcpy (&oldvals, pdf, sizeof (PDF));
+    pdf->flags |= PDF_WRITTEN;
 
-    r = setjmp (pdf->env);
-    if (r) {
-        memcpy (pdf, &oldvals, sizeof (PDF));
-        return r;
+    /* After a checkpoint, the node is in place and its parent is patched */
+
+    if (!pdf->anchorpp) {
+        seekback (pdf, pdf->anchorp);
+        oprintf (pdf, "%u 0 obj\n%.*s /Parent ", pdf->aobj, (int)(q - trail), trail);
+
+        /* From here on, the file has been written and is corrupt.
+         * Hopefully, a temporary condition, but errors will be permanent.
+         */
+        pdf->anchorpp = otell (pdf);
+        oprintf (pdf, "%10.10s 0 R %s\nendobj\n\n", "", q);
     }
 
-    switch (arg) {
-    case PDF_NO_LZW: /* Debugging only */
-        if (dvalue) 
-            pdf->flags |= PDF_UNCOMPRESSED;
-        else 
-            pdf->flags &= ~PDF_UNCOMPRESSED;
-        return PDF_OK;
+    /* When resuming from checkpoint, restore position for next page */
 
-    case PDF_TOP_MARGIN:
-        pdf->p.top = dvalue;
-        break;
+    if (pdf->checkpp) {
+        oseek (pdf, pdf->checkpp);
+    }
 
-    case PDF_TOF_OFFSET:
-        pdf->p.tof = ivalue;
-        break;
+    if (pdf->oerr) {
+        ABORT (E(IO_ERROR));
+    }
 
-    case PDF_BOTTOM_MARGIN:
-        pdf->p.bot = dvalue;
-        break;
+    return;
+}
 
-    case PDF_SIDE_MARGIN:
-        if (dvalue < 0.350) {
-            ABORT (E(INVAL));
-        }
-        pdf->p.margin = dvalue;
-        break;
+/* Write out data stream for current page.
+ *
+ * This is actually buffered in memory with formatting to enable compression.
+ *
+ * Updates page and line numbers.
+ */
 
-    case PDF_LNO_WIDTH:
-        if (dvalue && dvalue < 0.1) {
-            ABORT (E(INVAL));
-        }
-        pdf->p.lno = dvalue;
-        break;
+static void wrpage (PDF *pdf) {
+    unsigned int obj, l;
+    PHKEY k;
+    int codec;
+#ifdef USE_THREADS
+    int queued = 0;
+#endif
 
-    case PDF_BAR_HEIGHT:
-        if (dvalue < 0.0) {
-            ABORT (E(INVAL));
-        }
-        pdf->p.barh = dvalue;
-        break;
+    /* Render the page up to lpp.
+     */
 
-    case PDF_CPI:
-        if (dvalue < 1.0 || dvalue > 20.0) {
-            ABORT (E(INVAL));
-        }
-        pdf->p.cpi = dvalue;
-        return PDF_OK;
+    if (!pdf->pt.form) {
+        ptstart (pdf);
+    }
+    if (pdf->line > pdf->lpp) {
+        pdf->line = pdf->lpp;
+    }
 
-    case PDF_LPI:
-        if (dvalue != 6.0 && dvalue != 8.0) {
-            ABORT (E(INVAL));
-        }
-        pdf->p.lpi = ivalue;
-        return PDF_OK;
+#ifdef USE_THREADS
+    /* With threads, the page's lines are handed to the pipeline,
+     * where a worker renders and compresses it, and it is written in order.
+     */
 
-    case PDF_LPP:
-         pdf->p.lpp = ivalue;
-        return PDF_OK;
+    if (pdf->p.threads && pipe_start (pdf)) {
+        pipe_page (pdf);
+        queued = 1;
+    } else
+#endif
+    {
+        pdf->pbused = 0;
+        rdpage (pdf, PAGEBUF, &pdf->grid,
+                (pdf->line < pdf->nlines)? pdf->line: pdf->nlines);
+    }
 
-    case PDF_PAGE_WIDTH:
-        if (dvalue < 3.0) {
-            ABORT (E(INVAL));
-        }
-        pdf->p.wid = dvalue;
-        break;
+    /* Done with rendering this physical page */
 
-    case PDF_PAGE_LENGTH:
-        if (dvalue < 2.0) {
-            ABORT (E(INVAL));
-        }
-        pdf->p.len = dvalue;
-        break;
+    pdf->page++;
+    pdf->line = 0;
 
-    case PDF_COLS:
-        pdf->p.cols = ivalue;
-        break;
+    /* Lines may have been written for the next page due to a TOF_OFFSET.
+     * Rotate the grid so that they are at the top of the new page, followed
+     * by the (now empty) lines of this one.
+     * If they have been written, set the line accordingly.
+     */
+    if (pdf->grid.rows) {
+        GRID *g = &pdf->grid;
 
-    default:
-        ABORT (E(BAD_SET));
+        g->base = (g->base + pdf->lpp) % g->rows;
+        for (l = 0; l < pdf->p.tof && l < g->rows; l++) {
+            if (g->len[GRID_ROW (g, l)]) {
+                pdf->line = pdf->p.tof +1;
+                break;
+            }
+        }
     }
 
-#undef REJECT_NULL
-    return PDF_OK;
-}
+#ifdef USE_THREADS
+    if (queued) {
+        return;
+    }
+#endif
 
-static int checkfont (const char *newfont) {
-    const char *const *vf = validFonts;
+    /* A page identical to one already in the file uses its content */
 
-    if (!newfont) {
-        return E(INVAL);
+    phkey (pdf->pagebuf, pdf->pbused, &k);
+    if ((obj = phlookup (&pdf->phtab, &k, pdf->pagebuf, pdf->pbused)) == 0) {
+        obj = addobj (pdf);
+        codec = cpcontent (pdf, pdf->pagebuf, pdf->pbused);
+        wrcontent (pdf, obj, "", pdf->pagebuf, pdf->pbused, codec, pdf->lzwbuf, pdf->lzwused);
+        phadd (&pdf->phtab, &k, obj);
     }
-
-    while (*vf) {
-        if (!strcmp (*vf++, newfont)) {
-            return PDF_OK;
-        }
+    wrleaf (pdf, obj);
+    if (pdf->p.durability == PDF_SYNC_PAGE) {
+        osync (pdf);
     }
-    return E(UNKNOWN_FONT);
+    trimpage (pdf, &pdf->pagebuf, &pdf->pbsize, pdf->pbused, &pdf->lzwbuf, &pdf->lzwsize);
+    return;
 }
 
-/* At first output, initialize for output
+/* Render the parts of a page that are the same for the session:
+ * the start of its content stream, which draws the form and sets up
+ * the text state, and its MediaBox.
  */
 
-static void pdfinit (PDF *pdf) {    
-    int r;
-    int reopen;
+static void prerender (PDF *pdf) {
+    double lm = xp( pdf->p.margin ) +
+        xp( ((pdf->p.wid - (pdf->p.margin *2)) - (pdf->p.cols/pdf->p.cpi))/2 );
+    char *p = pdf->prolog;
+
+    p = fmts (p, QS(" /bg Do q 0 Tr " RGB_BLACK " rg BT /F1 "));
+    p = fmtu (p, PT/pdf->p.lpi);
+    p = fmts (p, QS(" Tf 1 0 0 1 "));
+    p = fmtf (p, lm, 6);
+    *p++ = ' ';
+    p = fmtf (p, 0.0, 6);
+    p = fmts (p, QS(" Tm  "));
+    p = fmtu (p, (unsigned int)( PT/pdf->p.lpi ));
+    p = fmts (p, QS(" TL 0 Tc 100 Tz 0 "));
+    p = fmtu (p, (unsigned int)( (pdf->p.len * PT) +2));
+    p = fmts (p, QS(" Td"));
+    pdf->prologlen = (size_t) (p - pdf->prolog);
+
+    p = fmts (pdf->mbox, QS("0 0 "));
+    p = fmtf (p, pdf->p.wid * PT, 6);
+    *p++ = ' ';
+    p = fmtf (p, pdf->p.len * PT, 6);
+    *p = '\0';
 
-    SHA1Reset (&pdf->sha1);
+    return;
+}
 
-    if (ftell (pdf->pdf)) {
-        ABORT (E(BUGCHECK));
-    }
+/* Render the text of a page into a content stream.
+ * The lines are consumed (their rows are cleared).
+ */
 
-    reopen = (pdf->flags & PDF_REOPENED) != 0;
-    pdf->flags &= ~PDF_REOPENED;
+static void rdpage (PDF *pdf, char **buf, size_t *bufsize, size_t *used,
+                    GRID *g, unsigned int nlines) {
+    unsigned int l, skip = 0;
 
-    if (pdf->p.frequire == PDF_FILE_APPEND || reopen) {
-        r = checkupdate (pdf);
-        if (r == PDF_OK) {
-            return;
-        }
-        if (r > 1) {
-            ABORT (r);
-        }
-        /* r < 0 => empty file, write as new */
-    } else {
-        if (fseek (pdf->pdf, 0, SEEK_END)) {
-            ABORT (errno);
-        }
-        if (ftell (pdf->pdf)) {
-            if (pdf->p.frequire == PDF_FILE_NEW) {
-                ABORT (E(NOT_EMPTY));
-            }
-            /* Existing, overwrite (PDF_FILE_REPLACE) */
-            fseek (pdf->pdf, 0, SEEK_SET);
-            r = PDF_OK;
-#ifdef _WIN32
-            if (_chsize (_fileno (pdf->pdf), 0) == -1) {
-                r = E(IO_ERROR);
-            }
-#else
-            if (ftruncate (fileno (pdf->pdf), 0) == -1) {
-                r = E(IO_ERROR);
+    /* Graphics are precomputed in the session's Form XObject,
+     * and the text state in the prologue.
+     */
+
+    wrstm (pdf, buf, bufsize, used, pdf->prolog, pdf->prologlen);
+
+    for (l = 0; l < nlines; l++) {
+        unsigned int r = GRID_ROW (g, l);
+        unsigned int len = g->len[r];
+
+        if (len) {
+            const uint8_t *text = g->cells + ((size_t) r * g->cols);
+
+            /* Should go thru a font. For now, map Unicode to PDF DocEncoding.
+             * The cells are Latin-1, which is 1:1.  A wide row is mapped in
+             * place, as it is consumed.
+             */
+
+            if (g->wide[r]) {
+                short *w = g->wide[r];
+                uint8_t *d = (uint8_t *) w;
+                unsigned int col;
+
+                for (col = 0; col < len; col++) {
+                    unsigned int u = (unsigned short) w[col];
+
+                    d[col] = PDFDOC (u);
+                }
+                text = d;
             }
-#endif
-            if (r != PDF_OK) {
-                ABORT (r);
+            if (pdf->p.compact) {
+                rdcompact (pdf, buf, bufsize, used, text, len, &skip);
+            } else {
+                rdline (pdf, buf, bufsize, used, text, len);
             }
+            gridclear (g, r);
+        } else if (pdf->p.compact) {
+            skip++;
+        } else {
+            wrstm (pdf, buf, bufsize, used, QS(" T*"));
         }
-        /* File empty, or emptied.  */
     }
-
-    /* New file */
-
-    pdf->pbase = 1;
+    wrstm (pdf, buf, bufsize, used, QS(" ET Q"));
 
     return;
 }
 
-/* Handle the gymnastics for adding pages to an existing file.
- * Does not handle the general case PDF, but will update those
- * written by this library.  Produces unbalanced page trees to
- * minimize work in update.
- *
- * returns PDF_OK if updating, < 0 if OK to write (empty file)
- * ABORTs on most errors.
+/* Render a line of PDFDocEncoded text as a string.
+ * Runs that need no escape are copied as a unit.  A CR that is followed
+ * by more text starts an overprint.
  */
 
-static int checkupdate (PDF *pdf) {
-    char buf[512];
-    char *p, *trail, *q;
-    size_t tsize, ll;
-    t_fpos amt = -1;
-    int lf = 0;
-    unsigned int obj, objs, objn, gen;
-    t_fpos objp;
-    t_fpos end;
-
-    /* Make sure file is seekable, if zero length, treat as new. */
+static void rdline (PDF *pdf, char **buf, size_t *bufsize, size_t *used,
+                    const uint8_t *text, unsigned int len) {
+    unsigned int col, last;
 
-    if (fseek (pdf->pdf, 0, SEEK_END)) {
-        return errno;
-    }
-    end = ftell (pdf->pdf);
-    if (!end) {
-        return -1;
-    }
+    for (last = len; last && (text[last-1] == '\015' || text[last-1] == ' '); last--)
+        ;
 
-    /* Validate PDF header */
+    wrstm (pdf, buf, bufsize, used, QS(" T* ("));
 
-    fseek (pdf->pdf, 0, SEEK_SET);
-    if (!fgets (buf, sizeof (buf), pdf->pdf)) {
-        return errno;
-    }
-    if (strncmp (buf, "%PDF-1.", 7)) {
-        return E(NOT_PDF);
-    }
-    p = buf + 7;
+    for (col = 0; col < len;) {
+        size_t n = scanplain (text + col, len - col);
+        uint8_t c;
 
-    while (*p && isdigit (*p)) {
-        p++;
-    }
-    if (*p != '\n') {
-        return E(NO_APPEND);
-    }
-    /* Probable PDF.  Find the XREF
-     * This is painful, but will find the right place.
-     *
-     * The last three lines of the file must be
-     * startxref
-     *  byte offset of xref table
-     * %%EOF
-     *
-     * 4 \ns ensure that the startxref is at the start of a line.
-     * We could read a hunk of the file from the end into a buffer,
-     * but there are lots of corner cases, and this only happens
-     * once per open and it should not have to read much of the
-     * file.  Finally, a use for 1 step forward, two steps back...
-     */
-    fseek (pdf->pdf, end, SEEK_SET);
-    p = buf + sizeof (buf) -1;
-    *p-- = '\0';
-
-    while (p > buf +1 && --end > 0 && lf < 4) {
-        int c;
-        fseek (pdf->pdf, amt, SEEK_CUR);
-        c = fgetc (pdf->pdf);
-        if (c == EOF) {
-            return E(NO_APPEND);
+        if (n) {
+            wrstm (pdf, buf, bufsize, used, (char *) text + col, n);
+            col += (unsigned int) n;
+            continue;
         }
-        *--p = c;
-        if ( c == '\n' ) {
-            lf++;
+        c = text[col++];
+        if (c == '\015') {
+            if (col < last) {
+                /* Data follows, setup overprint */
+                wrstm (pdf, buf, bufsize, used, QS(")Tj 0 0 Td ("));
+            }
+            continue;
         }
-        amt = -2;
-    }
-    if (strncmp (p, "\nstartxref\n", 11)) {
-        return E(NO_APPEND);
-    }
-    p += 11;
-
-    pdf->xpos = 0;
-    while (*p && *p != '\n') {
-        if (!isdigit (*p)) {
-            return E(NO_APPEND);
+        if (*used +2 > *bufsize) {
+            *buf = (char *) growbuf (pdf, *buf, bufsize, *used +2, 1);
         }
-        pdf->xpos *= 10;
-        pdf->xpos += *p++ - '0';
-    }
-    if (pdf->xpos <= 9 ||
-        pdf->xpos >= ftell (pdf->pdf) ||
-        strncmp (p, "\n%%EOF\n", 7)) {
-        return E(NO_APPEND);
+        (*buf)[(*used)++] = '\\';
+        (*buf)[(*used)++] = (char) c;
     }
+    wrstm (pdf, buf, bufsize, used, QS(")Tj"));
 
-    /* Found the xref pointer and verified EOF
-     * For the moment, the only version of the xref that will
-     * be processed is the one written by this library.  The full
-     * variety of deleted pages, etc is more than what's needed.
-     */
-    fseek (pdf->pdf, pdf->xpos, SEEK_SET);
-    fgets (buf, sizeof (buf), pdf->pdf);
-    if (strcmp (buf, "xref\n")) {
-        return E(NO_APPEND);
-    }
+    return;
+}
 
-    /* section header - there should only be one
-     *
-     * dec dec \n := first object in section, # objects in section
-     */
-    fgets (buf, sizeof (buf), pdf->pdf);
-    objs = 0;
-    p = buf;
-    while (*p && isdigit (*p)) {
-        objs = (objs * 10) + *p++ - '0';
-    }
-    if (p == buf || *p != ' ' || objs != 0) {
-        return E(NO_APPEND);
+/* Render a line in compact form.
+ * Trailing blanks are dropped, and blank lines are counted in skip and
+ * passed over with a single move.  In an uncompressed stream, each overprint
+ * segment is drawn with a long run of spaces as a TJ adjustment of the same
+ * width.  A compressor codes a run of spaces in a few bits, but not the
+ * adjustments, so they are not used when the stream is compressed.
+ */
+
+#define KERN_RUN (8)            /* Shortest run of spaces to adjust over */
+
+static void rdcompact (PDF *pdf, char **buf, size_t *bufsize, size_t *used,
+                       const uint8_t *text, unsigned int len, unsigned int *skip) {
+    unsigned int last, s, e, n, drawn = 0, space = 0;
+    const char *const *vf;
+
+    for (last = len; last && (text[last-1] == '\015' || text[last-1] == ' '); last--)
+        ;
+    if (!last) {
+        (*skip)++;
+        return;
     }
-    p++;
 
-    objn = 0;
-    while (*p && isdigit (*p)) {
-        objn = (objn * 10) + *p++ - '0';
+    /* Move down to this line */
+
+    n = *skip +1;
+    *skip = 0;
+    if (n >= 3) {
+        wrstmf (pdf, buf, bufsize, used, " 0 -%u Td", n * (unsigned int)( PT/pdf->p.lpi ));
+    } else {
+        while (n--) {
+            wrstm (pdf, buf, bufsize, used, QS(" T*"));
+        }
     }
-    if (p == buf || *p != '\n' || objn < 4) { /* Must be at least freelist, info, cat, page dir */
-        return E(NO_APPEND);
+
+    if ((pdf->flags & PDF_UNCOMPRESSED) || pdf->p.codec == PDF_CODEC_NONE) {
+        for (vf = validFonts; *vf; vf++) {
+            if (!strcmp (*vf, pdf->p.font)) {
+                space = fontSpace[vf - validFonts];
+                break;
+            }
+        }
     }
 
-    /* Read the xref into the context. */
+    /* Each segment ends at a CR, which is followed by data */
 
-    for (lf = 0; ((unsigned int)lf) < objn; lf++) {
-        int i;
+    for (s = 0; s < last; s = e +1) {
+        const uint8_t *cr = (const uint8_t *) memchr (text + s, '\015', last - s);
+        unsigned int t, p, run;
 
-        fgets (buf, sizeof (buf), pdf->pdf);
-        objp = 0;
-        for (p = buf, i = 0; i < 10; i++) {
-            if (!isdigit (*p)) {
-                return E(NO_APPEND);
-            }
-            objp = (objp * 10) + *p++ - '0';
+        e = cr? (unsigned int) (cr - text): last;
+        for (t = e; t > s && text[t-1] == ' '; t--)
+            ;
+        if (t == s) {
+            continue;
         }
-        if (*p++ != ' ') {
-            return E(NO_APPEND);
+        if (drawn++) {
+            wrstm (pdf, buf, bufsize, used, QS(" 0 0 Td"));
         }
 
-        gen = 0;
-        for (i = 0; i < 5; i++) {
-            if (!isdigit (*p)) {
-                return E(NO_APPEND);
-            }
-            gen = (gen * 10) + *p++ - '0';
+        for (p = s, run = 0; space && p < t && run < KERN_RUN; p++) {
+            run = (text[p] == ' ')? run +1: 0;
         }
-        if (*p++ != ' ') {
-            return E(NO_APPEND);
-        }
-        if (p[0] == 'f' && gen == 65535 && objp == 0 && lf == 0) {
+        if (run < KERN_RUN) {
+            wrstm (pdf, buf, bufsize, used, QS(" ("));
+            rdtext (pdf, buf, bufsize, used, text + s, t - s);
+            wrstm (pdf, buf, bufsize, used, QS(")Tj"));
             continue;
         }
-        if (gen != 0 || objp == 0 || p[0] != 'n') {
-            return E(NO_APPEND);
-        }
 
-        obj = addobj (pdf);
-        if (obj != objs + lf) {
-            return E(NO_APPEND);
+        wrstm (pdf, buf, bufsize, used, QS(" ["));
+        for (p = s; p < t;) {
+            unsigned int q;
+
+            for (q = p; q < t && text[q] == ' '; q++)
+                ;
+            if (q - p >= KERN_RUN) {
+                wrstmf (pdf, buf, bufsize, used, "-%u", (q - p) * space);
+                p = q;
+                continue;
+            }
+
+            /* Text up to the next long run */
+
+            for (q = p, run = 0; q < t; q++) {
+                run = (text[q] == ' ')? run +1: 0;
+                if (run == KERN_RUN) {
+                    q -= KERN_RUN -1;
+                    break;
+                }
+            }
+            wrstm (pdf, buf, bufsize, used, QS("("));
+            rdtext (pdf, buf, bufsize, used, text + p, q - p);
+            wrstm (pdf, buf, bufsize, used, QS(")"));
+            p = q;
         }
-        pdf->xref[obj-1]= objp;
+        wrstm (pdf, buf, bufsize, used, QS("]TJ"));
     }
-    /* Advance to the trailer */
-    do {
-        if (!fgets (buf, sizeof (buf), pdf->pdf) ) {
-            return E(NO_APPEND);
-        }
-    } while (strcmp (buf, "trailer\n"));
 
-    /* read the trailer into a buffer */
+    return;
+}
 
-    trail = NULL;
-    tsize = 0;
-    do {
-        if (!fgets (buf, sizeof (buf), pdf->pdf) ) {
-            free (trail);
-            return E(NO_APPEND);
-        }
-        if (!strcmp (buf, "startxref\n")) {
-            break;
+/* Copy text into a string, escaping as needed.  The text holds no CR.
+ */
+
+static void rdtext (PDF *pdf, char **buf, size_t *bufsize, size_t *used,
+                    const uint8_t *text, size_t len) {
+    size_t col, n;
+
+    for (col = 0; col < len;) {
+        if ((n = scanplain (text + col, len - col)) != 0) {
+            wrstm (pdf, buf, bufsize, used, (char *) text + col, n);
+            col += n;
+            continue;
         }
-        ll = strlen (buf);
-        p = (char *) realloc (trail, tsize + ll +1);
-        if (!p) {
-            free (trail);
-            return errno;
+        if (*used +2 > *bufsize) {
+            *buf = (char *) growbuf (pdf, *buf, bufsize, *used +2, 1);
         }
-        trail = p;
-        strcpy (p + tsize, buf);
-        tsize += ll;
-    } while ( 1 );
-
-    if (!trail) {
-        return E(NO_APPEND);
+        (*buf)[(*used)++] = '\\';
+        (*buf)[(*used)++] = (char) text[col++];
     }
+    return;
+}
 
-    /* Extract the data needed to navigate and to restore at close */
-    q = "/ID [";
-    if (!(p = strstr (trail, q))) {
-        free (trail);
-        return E(NO_APPEND);
+/* Length of the run at the start of text that needs no escape in a string,
+ * and holds no CR.
+ */
+
+static size_t scanplain (const uint8_t *text, size_t length) {
+    size_t n = 0;
+
+#if defined (__AVX2__)
+    const __m256i bs = _mm256_set1_epi8 ('\\'), lp = _mm256_set1_epi8 ('('),
+        rp = _mm256_set1_epi8 (')'), cr = _mm256_set1_epi8 ('\015');
+
+    for (; n + 32 <= length; n += 32) {
+        __m256i v = _mm256_loadu_si256 ((const __m256i *) (text + n));
+        unsigned int m = (unsigned int)
+            _mm256_movemask_epi8 (_mm256_or_si256 (
+                                      _mm256_or_si256 (_mm256_cmpeq_epi8 (v, bs), _mm256_cmpeq_epi8 (v, lp)),
+                                      _mm256_or_si256 (_mm256_cmpeq_epi8 (v, rp), _mm256_cmpeq_epi8 (v, cr))));
+        if (m) {
+            return n + __builtin_ctz (m);
+        }
+    }
+#elif defined (USE_SSE2)
+    const __m128i bs = _mm_set1_epi8 ('\\'), lp = _mm_set1_epi8 ('('),
+        rp = _mm_set1_epi8 (')'), cr = _mm_set1_epi8 ('\015');
+
+    for (; n + 16 <= length; n += 16) {
+        __m128i v = _mm_loadu_si128 ((const __m128i *) (text + n));
+        unsigned int m = (unsigned int)
+            _mm_movemask_epi8 (_mm_or_si128 (_mm_or_si128 (_mm_cmpeq_epi8 (v, bs), _mm_cmpeq_epi8 (v, lp)),
+                                             _mm_or_si128 (_mm_cmpeq_epi8 (v, rp), _mm_cmpeq_epi8 (v, cr))));
+        if (m) {
+#ifdef __GNUC__
+            return n + __builtin_ctz (m);
+#else
+            break;
+#endif
+        }
     }
-    p += strlen (q);
+#else
+    /* Eight at a time: a byte XOR a special character is zero if it matches */
 
-    while (*p == ' ')
-            p++;
-    if ( *p++ != '<') {
-        free (trail);
-        return E(NO_APPEND);
+#define HASZERO(x) (((x) - 0x0101010101010101ull) & ~(x) & 0x8080808080808080ull)
+    for (; n + 8 <= length; n += 8) {
+        uint64_t w;
+
+        memcpy (&w, text + n, 8);
+        if (HASZERO (w ^ 0x5C5C5C5C5C5C5C5Cull) | HASZERO (w ^ 0x2828282828282828ull) |
+            HASZERO (w ^ 0x2929292929292929ull) | HASZERO (w ^ 0x0D0D0D0D0D0D0D0Dull)) {
+            break;
+        }
     }
-    if (strlen (p) < (SHA1HashSize*2) + 1 || p[SHA1HashSize*2] != '>') {
-        free (trail);
-        return E(NO_APPEND);
+#undef HASZERO
+#endif
+    while (n < length && text[n] != '\\' && text[n] != '(' && text[n] != ')' && text[n] != '\015') {
+        n++;
     }
-    memcpy (pdf->oid, p, SHA1HashSize*2);
-    SHA1Input (&pdf->sha1, (uint8_t *)p, SHA1HashSize*2);
+    return n;
+}
 
-    pdf->iobj  = getref (pdf, trail, "/Info");
+/* Compress a page's content stream into the LZW buffer.
+ *  Returns the codec used, PDF_CODEC_NONE if the page is to be
+ *  written as is.
+ */
 
-    /* Old catalog will be new start of page streams */
+static int cpcontent (PDF *pdf, char *pagebuf, size_t pbused) {
+    return encstm (pdf, pagebuf, pbused);
+}
 
-    pdf->pbase = getref (pdf, trail, "/Root");
+/* Write a page's content stream object.
+ *  dict has any other dictionary entries, with a trailing space.
+ *  cbuf holds the data compressed with codec.
+ */
 
-    if (pdf->pbase >= pdf->iobj) {
-        free (trail);
-        return E(NO_APPEND);
-    }
+static void wrcontent (PDF *pdf, unsigned int obj, const char *dict, char *pagebuf, size_t pbused,
+                       int codec, char *cbuf, size_t cused) {
+    switch (codec) {
+    case PDF_CODEC_LZW:
+        oprintf (pdf, "%u 0 obj\n"
+                 "  << %s/Length %d /DL %d /Filter /LZWDecode"
+                 " /DecodeParms << /EarlyChange 0 >> >>\n"
+                 "stream\n", obj, dict, (int)cused, (int)pbused);
+        owrite (pdf, cbuf, cused);
+        break;
 
-    /* Follow link to the document information object */
+    case PDF_CODEC_FLATE:
+        oprintf (pdf, "%u 0 obj\n"
+                 "  << %s/Length %d /DL %d /Filter /FlateDecode >>\n"
+                 "stream\n", obj, dict, (int)cused, (int)pbused);
+        owrite (pdf, cbuf, cused);
+        break;
 
-    (void) readobj (pdf, pdf->iobj, &trail, &tsize);
-    if (!strstr (trail, "/Producer (LPTPDF Version " VERSION_REQUIRED)) {
-        free (trail);
-        return E(NOT_PRODUCED);
+    default:
+        oprintf (pdf, "%u 0 obj\n"
+                 "<< %s/Length %d >>\n"
+                 "stream\n", obj, dict, (int)pbused);
+        owrite (pdf, pagebuf, pbused);
+        break;
     }
+    owrite (pdf, QS("\nendstream\n"
+                    "endobj\n"
+                    "\n"));
 
-    p = getstr (pdf, trail, "/CreationDate");
-    if (!p || strlen (p) >= sizeof (pdf->ctime) || strlen(p) < strlen ("(D:YYYY)") ||
-        strncmp (p, "(D:", 3) || p[strlen (p) -1] != ')') {
-        free (p);
-        free (trail);
-        return E(NO_APPEND);
+    if (pdf->oerr) {
+        pdf->errnum = E(IO_ERROR);
     }
-    strcpy (pdf->ctime, p+3);
-    pdf->ctime[strlen (pdf->ctime) -1] ='\0';
-    free (p);
+    return;
+}
 
-    /* Follow link to root (catalog), soon to be over-written */
+/* Compute a page's cheap key */
 
-    (void) readobj (pdf, pdf->pbase, &trail, &tsize);
-    if (!strstr (trail, "/Type /Catalog")) {
-        free (trail);
-        return E(NO_APPEND);
-    }
+#define PHKEY_MUL (0x9E3779B97F4A7C15ull)
 
-    /* Page tree is anchor node for all previous sessions */
-    
-    pdf->aobj = getref (pdf, trail, "/Pages");
-    if (pdf->aobj != pdf->pbase -1) {
-        free (trail);
-        return E(NO_APPEND);
+static void phkey (const char *pagebuf, size_t pbused, PHKEY *k) {
+    uint64_t h = pbused, w;
+    size_t i;
+
+    for (i = 0; i + 8 <= pbused; i += 8) {
+        memcpy (&w, pagebuf + i, 8);
+        h = (((h << 5) | (h >> 59)) ^ w) * PHKEY_MUL;
     }
+    w = 0;
+    memcpy (&w, pagebuf + i, pbused - i);
+    h = (((h << 5) | (h >> 59)) ^ w) * PHKEY_MUL;
+    h ^= h >> 29;
+    k->key = (h ^ (h >> 32)) * PHKEY_MUL;
+    k->hashed = 0;
+    return;
+}
 
-    /* Get current page count, confirming this is the tree root (no /Parent) */
+/* Compute a page's SHA1 */
 
-    pdf->anchorp = readobj (pdf, pdf->aobj, &trail, &tsize);
-    if (!strstr (trail, "/Type /Pages") || strstr (trail, "/Parent")) {
-        free (trail);
-        return E(NO_APPEND);
-    }
-    pdf->prevpc = getint (pdf, trail, "/Count", (const char **)&q);
+static void phhash (const char *pagebuf, size_t pbused, PHKEY *k) {
+    SHA1Context sha1;
 
-    /* Save trailer for wrhdr, both first write and checkpoints */
+    SHA1Reset (&sha1);
+    SHA1Input (&sha1, (const uint8_t *) pagebuf, (unsigned int) pbused);
+    SHA1Result (&sha1, k->hash);
+    k->hashed = 1;
+    return;
+}
 
-    pdf->trail = trail;
+#define PHTAB_MINSIZE (64)
+#define PHTAB_FIRST(t, k) ((size_t) ((k)->key >> 32) & ((t)->size -1))
+#define PHTAB_NEXT(t, i) (((i) + 1) & ((t)->size -1))
 
-    /* Ready for update, in update mode */
+/* Determine if any page with a key has been written */
 
-    pdf->flags |= PDF_UPDATING;
+static int phseen (const PHTAB *t, const PHKEY *k) {
+    size_t i;
 
-    /* New objects are allocated starting with pdf->pagebase - the old catalog */
+    if (!t->size) {
+        return 0;
+    }
+    for (i = PHTAB_FIRST (t, k); t->ent[i].obj; i = PHTAB_NEXT (t, i)) {
+        if (t->ent[i].k.key == k->key) {
+            return 1;
+        }
+    }
+    return 0;
+}
 
-    pdf->obj = pdf->pbase -1;
+/* Find the content object written with a hashed page's data.
+ * Returns 0 if there is none.
+ */
 
-    return PDF_OK;
+static unsigned int phfind (const PHTAB *t, const PHKEY *k) {
+    size_t i;
+
+    if (!t->size) {
+        return 0;
+    }
+    for (i = PHTAB_FIRST (t, k); t->ent[i].obj; i = PHTAB_NEXT (t, i)) {
+        const PHASH *e = t->ent + i;
+
+        if (e->k.key == k->key && e->k.hashed &&
+            !memcmp (e->k.hash, k->hash, SHA1HashSize)) {
+            return e->obj;
+        }
+    }
+    return 0;
 }
 
-/* Write the file header on first output of data.
- * If update allowed, activates update processing instead.
- * Validates sensible parameters.
+/* Find the content object written with a page's data, hashing it if needed.
+ * Returns 0 if there is none.
  */
 
-static void wrhdr (PDF *pdf) {
-    char *trail, *q;
+static unsigned int phlookup (const PHTAB *t, PHKEY *k, const char *pagebuf, size_t pbused) {
+    if (!k->hashed) {
+        if (!phseen (t, k)) {
+            return 0;
+        }
+        phhash (pagebuf, pbused, k);
+    }
+    return phfind (t, k);
+}
+
+/* Record the content object written with a page's data.
+ * A hashed page replaces an entry with its key that was not hashed.
+ * The table is kept at most half full.  If it can't grow, the page is
+ * not recorded, and only costs its later duplicates being written again.
+ */
+
+static void phadd (PHTAB *t, const PHKEY *k, unsigned int obj) {
+    PHASH *e;
+    size_t i;
+
+    if ((t->used + 1) * 2 > t->size) {
+        PHTAB n;
 
-    if (!(pdf->flags & PDF_UPDATING)) {
-        /* New file.  First time, write file ID.
-         * After that, resuming from checkpoint.  File is already positioned.
-         */
-        if (!pdf->checkpp) {
-            if (fputs (PDF_C_HEADER, pdf->pdf) == EOF) {
-                ABORT (E(IO_ERROR));
+        n.size = t->size? t->size * 2: PHTAB_MINSIZE;
+        n.used = t->used;
+        if ((n.ent = (PHASH *) calloc (n.size, sizeof (PHASH))) != NULL) {
+            for (i = 0; i < t->size; i++) {
+                size_t j;
+
+                if (!t->ent[i].obj) {
+                    continue;
+                }
+                for (j = PHTAB_FIRST (&n, &t->ent[i].k); n.ent[j].obj; j = PHTAB_NEXT (&n, j))
+                    ;
+                n.ent[j] = t->ent[i];
             }
+            free (t->ent);
+            *t = n;
+        } else if (t->used + 1 >= t->size) {
+            return;
+        }
+    }
+    for (i = PHTAB_FIRST (t, k); t->ent[i].obj; i = PHTAB_NEXT (t, i)) {
+        e = t->ent + i;
+        if (e->k.key == k->key && !e->k.hashed && k->hashed) {
+            e->k = *k;
+            e->obj = obj;
+            return;
         }
-        pdf->flags |= PDF_WRITTEN;
-        return;
     }
+    e = t->ent + i;
+    e->k = *k;
+    e->obj = obj;
+    t->used++;
+    return;
+}
 
-    /* Position to over-write the old anchor, catalog, info object with
-     * a new /Pages node that holds all existing pages.  The parent will be
-     * determined at the end of this session, so enough space is left to be able
-     * to patch it during pdf_close.
-     */
+/* Start the session's page tree.
+ * The form, page list and font dictionary are numbered here, so that
+ * each leaf can be written with its page.  The form and fonts are the
+ * same for the whole session, so they are written now; the page list
+ * is written at close.  Leaves only differ in their object numbers,
+ * contents and parent, so the rest is rendered once.
+ */
 
-    trail = pdf->trail;
+static void ptstart (PDF *pdf) {
+    PTREE *pt = &pdf->pt;
+    char *q;
 
-    if (pdf->prevpc != getint (pdf, trail, "/Count", (const char **)&q)) {
-        ABORT (E(INCON_GEO));
+    if (!pdf->prologlen) {
+        prerender (pdf);
     }
+    pt->form = addobj (pdf);
+    pt->plist = addobj (pdf);
+    pt->fonts = addobj (pdf);
+    memset (pt->lvl, 0, sizeof (pt->lvl));
 
-    pdf->flags |= PDF_WRITTEN;
+    wrform (pdf, pt->form, pt->fonts);
 
-    fseek (pdf->pdf, pdf->anchorp, SEEK_SET);
-    fprintf (pdf->pdf, "%u 0 obj\n%.*s /Parent ", pdf->aobj, (int)(q - trail), trail);
+    setobj (pdf, pt->fonts);
+    oprintf (pdf, "%u 0 obj\n"
+             " << /F1 << /Type /Font /Subtype /Type1 /BaseFont /%s >>"
+             " /F2 << /Type /Font /Subtype /Type1 /BaseFont /%s >>"
+             " /F3 << /Type /Font /Subtype /Type1 /BaseFont /%s >> >>\n"
+             "endobj\n\n", pt->fonts, pdf->p.font, pdf->p.nfont, pdf->p.nbold);
+
+    q = fmts (pt->leaf, QS(" 0 obj\n << /Type /Page /Resources << /Font "));
+    q = fmtu (q, pt->fonts);
+    q = fmts (q, QS(" 0 R /ProcSet [/PDF /Text /ImageC /ImageI /ImageB] /XObject << /bg "));
+    q = fmtu (q, pt->form);
+    q = fmts (q, QS(" 0 R >>"));
+    if (pdf->formobj) { /* Form image is blended */
+        q = fmts (q, QS(" >>\n /Group << /S /Transparency /CS /DeviceRGB >>"));
+    } else {
+        q = fmts (q, QS(" >>"));
+    }
+    q = fmts (q, QS(" /MediaBox ["));
+    q = fmts (q, pdf->mbox, strlen (pdf->mbox));
+    q = fmts (q, QS("] /Contents "));
+    pt->leaflen = (size_t) (q - pt->leaf);
+    return;
+}
 
-    /* From here on, the file has been written and is corrupt.
-     * Hopefully, a temporary condition, but errors will be permanent.
-     */
-    pdf->anchorpp = ftell (pdf->pdf);
-    fprintf (pdf->pdf, "%10.10s 0 R %s\nendobj\n\n", "", q);
+/* Write the leaf of a page that draws content */
 
-    /* When resuming from checkpoint, restore position for next page */
+static void wrleaf (PDF *pdf, unsigned int content) {
+    PTREE *pt = &pdf->pt;
+    char lbuf[PDF_C_LINELEN * 2], *q;
+    unsigned int leaf;
 
-    if (pdf->checkpp) {
-        fseek (pdf->pdf, pdf->checkpp, SEEK_SET);
+    if (!pt->lvl[0].obj) {
+        pt->lvl[0].obj = addobj (pdf);
     }
 
-    if (ferror (pdf->pdf)) {
-        ABORT (E(IO_ERROR));
-    }
+    leaf = addobj (pdf);
+    q = fmtu (lbuf, leaf);
+    q = fmts (q, pt->leaf, pt->leaflen);
+    q = fmtu (q, content);
+    q = fmts (q, QS(" 0 R /Parent "));
+    q = fmtu (q, pt->lvl[0].obj);
+    q = fmts (q, QS(" 0 R >>\nendobj\n\n"));
+    owrite (pdf, lbuf, q - lbuf);
 
+    ptadd (pdf, 0, leaf, 1);
     return;
 }
 
-/* Write out data stream for current page.
- *
- * This is actually buffered in memory with formatting to enable compression.
- *
- * Updates page and line numbers.
+/* Add a kid to the node being filled at a level.
+ * A full node is written and becomes a kid of the level above.
+ * The top level is never filled.
  */
 
-static void wrpage (PDF *pdf) {
-    double lm = xp( pdf->p.margin ) +
-        xp( ((pdf->p.wid - (pdf->p.margin *2)) - (pdf->p.cols/pdf->p.cpi))/2 );
+static void ptadd (PDF *pdf, unsigned int l, unsigned int obj, unsigned int count) {
+    PTNODE *n = &pdf->pt.lvl[l];
+    PTNODE *up = n + 1;
 
-    unsigned int obj, l;
+    n->kids[n->nkids++] = obj;
+    n->count += count;
+    if (n->nkids < PAGE_NODE) {
+        return;
+    }
+    if (!up->obj) {
+        up->obj = addobj (pdf);
+    }
+    wrlist (pdf, n->obj, n->kids, n->nkids, n->count, up->obj);
+    obj = n->obj;
+    count = n->count;
+    n->obj =
+        n->nkids =
+        n->count = 0;
+    ptadd (pdf, l + 1, obj, count);
+    return;
+}
 
-    pdf->pbused = 0;
+/* Write the nodes being filled, bottom up, and the session's page list.
+ * A node has the one below as an extra kid, for which there is room
+ * because it isn't full.  The page list's parent is the anchor, which
+ * is the next object numbered.
+ */
 
-    /* Render the page up to lpp.
-     */
+static void ptflush (PDF *pdf) {
+    PTREE *pt = &pdf->pt;
+    unsigned int l, top, below = 0, count = 0;
 
-    if (pdf->line > pdf->lpp) {
-        pdf->line = pdf->lpp;
-    }
-    obj = addobj (pdf);
+    for (top = PAGE_LEVELS; top > 0 && !pt->lvl[top -1].obj; top--)
+        ;
+    for (l = 0; l < top; l++) {
+        PTNODE *n = &pt->lvl[l];
+        unsigned int k = n->nkids;
 
-    /* Graphics are precomputed, so simply add the content */
+        if (!n->obj && !below) {
+            continue;
+        }
+        if (!n->obj) {
+            n->obj = addobj (pdf);
+        }
+        if (l + 1 < top && !pt->lvl[l +1].obj) {
+            pt->lvl[l +1].obj = addobj (pdf);
+        }
+        if (below) {
+            n->kids[k++] = below;
+        }
+        count += n->count;
+        wrlist (pdf, n->obj, n->kids, k, count,
+                (l + 1 < top)? pt->lvl[l +1].obj: pt->plist);
+        below = n->obj;
+    }
+    wrlist (pdf, pt->plist, &below, (below? 1: 0), pdf->page, pdf->obj +1);
+    return;
+}
 
-    wrstm (pdf, PAGEBUF, pdf->formbuf, pdf->formlen);
+/* Write a /Pages node that was numbered earlier */
 
-    /* Text */
+static void wrlist (PDF *pdf, unsigned int obj, const unsigned int *kids, unsigned int n,
+                    unsigned int count, unsigned int parent) {
+    char lbuf[PDF_C_LINELEN * 8], *q;
+    unsigned int i;
 
-    wrstmf (pdf, PAGEBUF,
-        " q 0 Tr %s rg BT /F1 %u Tf 1 0 0 1 %f %f Tm  %u TL %u Tc %u Tz %u %u Td",
-             RGB_BLACK,
-             PT/pdf->p.lpi,
-             lm, 0.0,
-             (unsigned int)( PT/pdf->p.lpi ),
-             0,
-             100,
-             0, (unsigned int)( (pdf->p.len * PT) +2) );
+    setobj (pdf, obj);
+    oprintf (pdf, "%u 0 obj\n"
+             " << /Type /Pages /Kids [", obj);
 
-    for (l = 0; l < pdf->line && l < pdf->nlines; l++) {
-        short *c = pdf->lines[l];
-        if (c) {
-            int online = 0;
-            unsigned int col, pcol;
-            short ch;
+    q = lbuf;
+    for (i = 0; i < n; i++) {
+        if (i && ((i % (PDF_C_LINELEN / 15)) == 0)) {
+            *q++ = '\n';
+            owrite (pdf, lbuf, q - lbuf);
+            q = lbuf;
+        }
+        *q++ = ' ';
+        q = fmtu (q, kids[i]);
+        q = fmts (q, QS(" 0 R"));
+    }
+    owrite (pdf, lbuf, q - lbuf);
+    oprintf (pdf, "]\n /Count %u /Parent %u 0 R >>\nendobj\n\n",
+             count, parent);
+    return;
+}
 
-            for (col = 0, pcol = 0; col < pdf->linelen[l]; col++, c++) {
+/* Write the form as a Form XObject, which each page draws with /bg Do.
+ * The form is the same on every page, so it is stored once and viewers
+ * can cache it.  fonts is the session's font dictionary.
+ */
 
-                if (!online) {
-                    wrstm (pdf, PAGEBUF, QS(" T* ("));
-                    online = 1;
-                }
-                ch = *c;
-                /* Should go thru a font. For now, map Unicode to PDF DocEncoding */
-
-                if (!((ch >= 0x20 && ch <= 0x7E) || (ch >= 0xA1 && ch <= 0xFF))) {
-                    size_t i;
-                    for (i = 0; i < DIM (utran); i++) {
-                        if (((unsigned short) ch) == utran[i].ucode) {
-                            ch = (short) utran[i].pdfcode;
-                            break;
-                        }
-                    }
-                }
-                ch &= 0xFF;
+static void wrform (PDF *pdf, unsigned int obj, unsigned int fonts) {
+    char dict[PDF_C_LINELEN * 3];
+    int codec;
 
-                if (ch == '\\' || ch == '(' || *c == ')') {
-                    wrstm (pdf, PAGEBUF, QS("\\"));
-                } else {
-                    if (ch == '\015') {
-                        unsigned int p;
-                        for (p = col+1; p < pdf->linelen[l]; p++) {
-                            short ch = pdf->lines[l][p];
-                            if (ch == '\015' || ch == ' ') {
-                                continue;
-                            }
-                            /* Data follows, setup overprint */
-                            pcol = 0;
-                            wrstmf (pdf, PAGEBUF, QS(")Tj 0 0 Td ("));
-                            break;
-                        }
-                        continue;
-                    }
-                }
-                pcol++;
-                /* Optimize the most common case:  adding one character */
-                if (pdf->pbused +1 > pdf->pbsize ) {
-                    wrstmf (pdf, PAGEBUF, "%c", (char) ch);
-                } else {
-                    pdf->pagebuf[pdf->pbused++] = (char) ch;
-                }
-            }
-            if (online) {
-                wrstm (pdf, PAGEBUF, QS(")Tj"));
-            } else {
-                wrstm (pdf, PAGEBUF, QS(" T*"));
-            }
-            pdf->linelen[l] = 0;
-        } else {
-            wrstm (pdf, PAGEBUF, QS(" T*"));
-        }
+    if (pdf->formobj) { /* Form image resources */
+        sprintf (dict, "/Type /XObject /Subtype /Form /BBox [%s]\n"
+                 "  /Resources << /Font %u 0 R /ProcSet [/PDF /Text /ImageC /ImageI /ImageB]"
+                 " /XObject << /form %u 0 R >> /ExtGState << /igs %u 0 R >> >>\n  ",
+                 pdf->mbox, fonts, pdf->formobj, pdf->formobj +1);
+    } else {
+        sprintf (dict, "/Type /XObject /Subtype /Form /BBox [%s]\n"
+                 "  /Resources << /Font %u 0 R /ProcSet [/PDF /Text] >>\n  ",
+                 pdf->mbox, fonts);
     }
-    wrstm (pdf, PAGEBUF, QS(" ET Q"));
+    codec = encstm (pdf, pdf->formbuf, pdf->formlen);
+    wrcontent (pdf, obj, dict, pdf->formbuf, pdf->formlen, codec, pdf->lzwbuf, pdf->lzwused);
+    return;
+}
 
-    /* Done with rendering this physical page */
+/* Form cache
+ *
+ * A form without an image depends only on the geometry, so the graphics
+ * that setform renders are kept for the life of the process.  Any handle
+ * with the same form, such as the file for the next job, copies them.
+ * Entries are never changed or freed, so they are copied unlocked.  When
+ * the cache is full, other forms are simply rendered each time.
+ */
 
-    pdf->page++;
-    pdf->line = 0;
+#define FORM_CACHE (16)     /* Forms kept */
 
-    /* Lines may have been written for the next page due to a TOF_OFFSET.
-     * Swap them with the the (now empty) lines at the top of the new page.
-     * If they have been written, set the line accordingly.
-     */
-    if (pdf->p.tof < pdf->nlines) {
-        for (l = 0; l < pdf->p.tof; l++) {
-            unsigned int el = pdf->lpp + l;
+static struct {
+    FORMKEY key;
+    char *buf;
+    size_t len;
+} formcache[FORM_CACHE];
+static unsigned int formcached;
 
-            if (el >= pdf->nlines) {
-                break;
-            }
-            if (pdf->lines[el]) {
-                short *t;
-                unsigned int ln;
+#ifdef USE_THREADS
+static pthread_mutex_t formlock = PTHREAD_MUTEX_INITIALIZER;
+#define FORM_LOCK   pthread_mutex_lock (&formlock)
+#define FORM_UNLOCK pthread_mutex_unlock (&formlock)
+#else
+#define FORM_LOCK
+#define FORM_UNLOCK
+#endif
+
+static void formkey (PDF *pdf, FORMKEY *key) {
+    memset (key, 0, sizeof (FORMKEY));  /* Padding is compared */
+    key->formtype = pdf->p.formtype;
+    key->top = pdf->p.top;
+    key->bot = pdf->p.bot;
+    key->margin = pdf->p.margin;
+    key->lno = pdf->p.lno;
+    key->wid = pdf->p.wid;
+    key->len = pdf->p.len;
+    key->barh = pdf->p.barh;
+    return;
+}
 
-                t              = pdf->lines[l];
-                pdf->lines[l]  = pdf->lines[el];
-                pdf->lines[el] = t;
+/* Copy a cached form to the handle's form buffer.
+ * Returns 0 if it isn't cached.
+ */
 
-                ln =               pdf->linelen[l];
-                pdf->linelen[l] =  pdf->linelen[el];
-                pdf->linelen[el] = ln;
+static int formget (PDF *pdf, const FORMKEY *key) {
+    unsigned int i, n;
 
-                ln =                pdf->linesize[l];
-                pdf->linesize[l] =  pdf->linesize[el];
-                pdf->linesize[el] = ln;
+    FORM_LOCK;
+    n = formcached;
+    FORM_UNLOCK;
 
-                if (pdf->linelen[l]) {
-                    pdf->line = pdf->p.tof +1;
-                }
-            }
+    for (i = 0; i < n; i++) {
+        if (!memcmp (&formcache[i].key, key, sizeof (FORMKEY))) {
+            wrstm (pdf, FORMBUF, formcache[i].buf, formcache[i].len);
+            return 1;
         }
     }
+    return 0;
+}
 
-    /* The rendering data is ready for the file.
-     *  Unless forbidden, see if it's compressible.
-     *  Write the PDF stream accordingly.
-     */
-    if ((pdf->flags & PDF_UNCOMPRESSED) || encstm (pdf, pdf->pagebuf, pdf->pbused)) {
-        fprintf (pdf->pdf, "%u 0 obj\n"
-                 "<< /Length %d >>\n"
-                 "stream\n", obj, (int)pdf->pbused);
-        fwrite (pdf->pagebuf, pdf->pbused, 1, pdf->pdf);
-    } else {
-        fprintf (pdf->pdf, "%u 0 obj\n"
-                 "  << /Length %d /DL %d /Filter /LZWDecode"
-                 " /DecodeParms << /EarlyChange 0 >> >>\n"
-                 "stream\n", obj, (int)pdf->lzwused, (int)pdf->pbused);
-        fwrite (pdf->lzwbuf, pdf->lzwused, 1, pdf->pdf);
-    }
-    fputs ("\nendstream\n"
-                "endobj\n"
-           "\n", pdf->pdf);
+/* Add a form to the cache */
 
-    if (ferror (pdf->pdf)) {
-        pdf->errnum = E(IO_ERROR);
+static void formput (const FORMKEY *key, const char *buf, size_t len) {
+    unsigned int i;
+    char *p;
+
+    FORM_LOCK;
+    for (i = 0; i < formcached; i++) {
+        if (!memcmp (&formcache[i].key, key, sizeof (FORMKEY))) {
+            break;
+        }
+    }
+    if (i == formcached && i < FORM_CACHE && (p = (char *) malloc (len)) != NULL) {
+        memcpy (p, buf, len);
+        formcache[i].key = *key;
+        formcache[i].buf = p;
+        formcache[i].len = len;
+        formcached++;
     }
+    FORM_UNLOCK;
     return;
 }
 
@@ -2873,6 +5421,16 @@ static void setform (PDF *pdf) {
     double p;
     unsigned int l;
     const COLORS *color = &colors[pdf->p.formtype];
+    FORMKEY key;
+
+    /* An image adds objects to the file, so only forms without one are cached */
+
+    if (!pdf->p.formfile) {
+        formkey (pdf, &key);
+        if (formget (pdf, &key)) {
+            return;
+        }
+    }
 
     /* Setup items common to all pages */
 
@@ -2950,6 +5508,9 @@ static void setform (PDF *pdf) {
         wrstm (pdf, FORMBUF, QS(" ET Q"));
     }
 
+    if (!pdf->p.formfile) {
+        formput (&key, pdf->formbuf, pdf->formlen);
+    }
     return;
 }
 
@@ -3017,6 +5578,95 @@ static void barform (PDF *pdf) {
     return;
 }
 
+/* Encoded form images
+ *
+ * A form image is decoded and compressed the same way every time it is
+ * used, so the XObject written for it is kept for the life of the process,
+ * keyed by the file's path, size, inode and modification time and by the
+ * settings that affect the encoding.  The time includes nanoseconds where
+ * stat has them, so an image that is replaced in the same second with one
+ * of the same size is not mistaken for the old one.  The next file or
+ * handle that uses the same image writes the saved object.  Images can be
+ * large, so only a few are kept; a new one replaces the oldest.  Entries
+ * can be replaced, so they are written under the lock.
+ */
+
+#define IMG_CACHE (4)       /* Images kept */
+
+static struct {
+    IMGKEY key;
+    double width, height;
+    char *obj;              /* Object body, from the dictionary to endobj */
+    size_t len;
+} imgcache[IMG_CACHE];
+static unsigned int imgnext;
+
+#ifdef USE_THREADS
+static pthread_mutex_t imglock = PTHREAD_MUTEX_INITIALIZER;
+#define IMG_LOCK   pthread_mutex_lock (&imglock)
+#define IMG_UNLOCK pthread_mutex_unlock (&imglock)
+#else
+#define IMG_LOCK
+#define IMG_UNLOCK
+#endif
+
+static int imgmatch (const IMGKEY *a, const IMGKEY *b) {
+    return a->path && !strcmp (a->path, b->path) &&
+        a->size == b->size && a->mtime == b->mtime &&
+        a->mtimensec == b->mtimensec && a->ino == b->ino &&
+        a->codec == b->codec && a->level == b->level &&
+        a->uncompressed == b->uncompressed;
+}
+
+/* Write a cached image as the form XObject.
+ * Returns 0 if it isn't cached.
+ */
+
+static int imgget (PDF *pdf, const IMGKEY *key, double *width, double *height) {
+    unsigned int i;
+
+    IMG_LOCK;
+    for (i = 0; i < IMG_CACHE; i++) {
+        if (imgmatch (&imgcache[i].key, key)) {
+            pdf->formobj = addobj (pdf);
+            oprintf (pdf, "%u 0 obj\n", pdf->formobj);
+            owrite (pdf, imgcache[i].obj, imgcache[i].len);
+            *width = imgcache[i].width;
+            *height = imgcache[i].height;
+            IMG_UNLOCK;
+            return 1;
+        }
+    }
+    IMG_UNLOCK;
+    return 0;
+}
+
+/* Add an image to the cache, which takes the object body */
+
+static void imgput (const IMGKEY *key, double width, double height, char *obj, size_t len) {
+    unsigned int i;
+    char *path;
+
+    if (!(path = (char *) malloc (strlen (key->path) +1))) {
+        free (obj);
+        return;
+    }
+    strcpy (path, key->path);
+
+    IMG_LOCK;
+    i = imgnext++ % IMG_CACHE;
+    free ((char *) imgcache[i].key.path);
+    free (imgcache[i].obj);
+    imgcache[i].key = *key;
+    imgcache[i].key.path = path;
+    imgcache[i].width = width;
+    imgcache[i].height = height;
+    imgcache[i].obj = obj;
+    imgcache[i].len = len;
+    IMG_UNLOCK;
+    return;
+}
+
 /* Generate body for an image-based form
  * This will also write an XObject with the image data and any rendering
  * objects.
@@ -3024,9 +5674,17 @@ static void barform (PDF *pdf) {
 
 static void imageform (PDF *pdf) {
     unsigned int obj;
-    double pw, sh, scale, vpos;
+    double pw, sh, scale, vpos, width, height;
     IMG img;
-    int r;
+    IMGKEY key;
+    char *body = NULL;
+    size_t bsize = 0, blen = 0;
+    int r, codec, known;
+#ifdef _WIN32
+    struct _stati64 statbuf;
+#else
+    struct stat statbuf;
+#endif
 
     memset (&img, 0, sizeof (IMG));
 
@@ -3034,80 +5692,123 @@ static void imageform (PDF *pdf) {
         ABORT (errno);
     }
 
-    img.buf = (unsigned char *) malloc (COPY_BUFSIZE);
-    if (!img.buf) {
-        fclose (img.fh);
-        ABORT (errno);
+    memset (&key, 0, sizeof (IMGKEY));
+    key.path = pdf->p.formfile;
+#ifdef _WIN32
+    known = !_fstati64 (_fileno (img.fh), &statbuf);
+#else
+    known = !fstat (fileno (img.fh), &statbuf);
+#endif
+    if (known) {
+        key.size = (int64_t) statbuf.st_size;
+        key.mtime = (int64_t) statbuf.st_mtime;
+        key.mtimensec = ST_MTIME_NSEC (statbuf);
+#ifndef _WIN32
+        key.ino = (uint64_t) statbuf.st_ino;
+#endif
     }
-    img.bufsize = COPY_BUFSIZE;
-
-    /* Identify and decode image file */
+    key.codec = pdf->p.codec;
+    key.level = pdf->p.level;
+    key.uncompressed = !!(pdf->flags & PDF_UNCOMPRESSED);
 
-    r = jpeg_image (pdf, &img);
-    if (r != PDF_OK) {
-        r = png_image (pdf, &img);
-    }
-    if (r != PDF_OK) {
+    if (known && imgget (pdf, &key, &width, &height)) {
         fclose (img.fh);
-        free (img.buf);
-        free (img.imgbuf);
-        ABORT (r);
-    }
+    } else {
+        img.buf = (unsigned char *) malloc (COPY_BUFSIZE);
+        if (!img.buf) {
+            fclose (img.fh);
+            ABORT (errno);
+        }
+        img.bufsize = COPY_BUFSIZE;
 
-    if (ferror (img.fh)) {
-        fclose (img.fh);
-        free (img.buf);
-        free (img.imgbuf);
-        ABORT (E(OTHER_IO_ERROR));
-    }
-    if (fclose (img.fh) == EOF) {
-        free (img.buf);
-        free (img.imgbuf);
-        ABORT (E(OTHER_IO_ERROR));
-    }
+        /* Identify and decode image file */
 
-    /* Write an XObject dictionary and stream
-     * Note: This is NOT buffered; there is one per session.
-     */
+        r = jpeg_image (pdf, &img);
+        if (r != PDF_OK) {
+            r = png_image (pdf, &img);
+        }
+        if (r != PDF_OK) {
+            fclose (img.fh);
+            free (img.buf);
+            free (img.imgbuf);
+            ABORT (r);
+        }
 
-    pdf->formobj =
-        obj = addobj(pdf);
+        if (ferror (img.fh)) {
+            fclose (img.fh);
+            free (img.buf);
+            free (img.imgbuf);
+            ABORT (E(OTHER_IO_ERROR));
+        }
+        if (fclose (img.fh) == EOF) {
+            free (img.buf);
+            free (img.imgbuf);
+            ABORT (E(OTHER_IO_ERROR));
+        }
 
-    fprintf (pdf->pdf, "%u 0 obj\n<< /Type /XObject /Subtype /Image"
-             " /Width %u /Height %u ", obj, ((unsigned int)img.width),
-             ((unsigned int)img.height) );
-    fwrite (img.colordesc, img.cdlength, 1, pdf->pdf);
+        /* Build an XObject dictionary and stream, which is kept for
+         * the next file with this image.
+         */
 
-    /* JPEG & PNG form images often are compressible, presumably due to the
-     * large amount of constant background.  Watch PDF_C_LINELEN.
-     */
+        wrstmf (pdf, &body, &bsize, &blen, "<< /Type /XObject /Subtype /Image"
+                " /Width %u /Height %u ", ((unsigned int)img.width),
+                ((unsigned int)img.height) );
+        wrstm (pdf, &body, &bsize, &blen, img.colordesc, img.cdlength);
+
+        /* JPEG & PNG form images often are compressible, presumably due to the
+         * large amount of constant background.  Watch PDF_C_LINELEN.
+         */
+
+        codec = encstm (pdf, img.imgbuf, img.ibused);
+        if (codec == PDF_CODEC_NONE) {
+            wrstmf (pdf, &body, &bsize, &blen, " /Length %u /Filter %s",
+                    (unsigned int)img.ibused, img.filter);
+            if (img.filterpars) {
+                wrstmf (pdf, &body, &bsize, &blen, " /DecodeParms %s", img.filterpars);
+            }
+            wrstm (pdf, &body, &bsize, &blen, QS(" >>\nstream\n"));
+            wrstm (pdf, &body, &bsize, &blen, img.imgbuf, img.ibused);
+        } else if (codec == PDF_CODEC_FLATE) {
+            wrstmf (pdf, &body, &bsize, &blen, " /Length %u /DL %u /Filter [ /FlateDecode %s ]",
+                    (unsigned int)pdf->lzwused, (unsigned int)img.ibused, img.filter);
+            if (img.filterpars) {
+                wrstmf (pdf, &body, &bsize, &blen, "\n /DecodeParms [ null %s ]",
+                        img.filterpars);
+            }
+            wrstm (pdf, &body, &bsize, &blen, QS(" >>\nstream\n"));
+            wrstm (pdf, &body, &bsize, &blen, pdf->lzwbuf, pdf->lzwused);
+        } else {
+            wrstmf (pdf, &body, &bsize, &blen, " /Length %u /DL %u /Filter [ /LZWDecode %s ]\n"
+                    " /DecodeParms [ << /EarlyChange 0 >> %s ]",
+                    (unsigned int)pdf->lzwused, (unsigned int)img.ibused, img.filter,
+                    (img.filterpars? img.filterpars: "null"));
+            wrstm (pdf, &body, &bsize, &blen, QS(" >>\nstream\n"));
+            wrstm (pdf, &body, &bsize, &blen, pdf->lzwbuf, pdf->lzwused);
+        }
+        free (img.colordesc);
+        free (img.filterpars);
+        free (img.imgbuf);
+        free (img.buf);
+        wrstm (pdf, &body, &bsize, &blen, QS("\nendstream\nendobj\n\n"));
 
-    if ((pdf->flags & PDF_UNCOMPRESSED) || encstm (pdf, img.imgbuf, img.ibused)) {
-        fprintf (pdf->pdf, " /Length %d /Filter %s", (int)img.ibused, img.filter);
-        if (img.filterpars) {
-            fprintf (pdf->pdf, " /DecodeParms %s", img.filterpars);
+        pdf->formobj = addobj (pdf);
+        oprintf (pdf, "%u 0 obj\n", pdf->formobj);
+        owrite (pdf, body, blen);
+
+        width = img.width;
+        height = img.height;
+        if (known) {
+            imgput (&key, width, height, body, blen);
+        } else {
+            free (body);
         }
-        fprintf (pdf->pdf, " >>\nstream\n");
-        fwrite (img.imgbuf, img.ibused, 1, pdf->pdf);
-    } else {
-        fprintf (pdf->pdf, " /Length %d /DL %d /Filter [ /LZWDecode %s ]\n"
-                 " /DecodeParms [ << /EarlyChange 0 >> %s ]",
-                 (int)pdf->lzwused, (int)img.ibused, img.filter,
-                 (img.filterpars? img.filterpars: "null"));
-        fprintf (pdf->pdf, " >>\nstream\n");
-        fwrite (pdf->lzwbuf, pdf->lzwused, 1, pdf->pdf);
-    }
-    free (img.colordesc);
-    free (img.filterpars);
-    free (img.imgbuf);
-    free (img.buf);
-    fprintf (pdf->pdf, "\nendstream\nendobj\n\n");
+    }
 
     /* Add a graphics state dictionary for rendering the image.
      * The page renderer knows that it is the image object +1.
      */
     obj = addobj (pdf);
-    fprintf (pdf->pdf, "%u 0 obj\n<< /Type /ExtGState"
+    oprintf (pdf, "%u 0 obj\n<< /Type /ExtGState"
              " /BM /Multiply >>\nendobj\n\n", obj);
 
     /* Scale to usable page width and center vertically.
@@ -3116,8 +5817,8 @@ static void imageform (PDF *pdf) {
      */
 
     pw = pdf->p.wid-(2*(pdf->p.margin +(1/PT)));
-    scale = pw / img.width;
-    sh = img.height * scale * PT;
+    scale = pw / width;
+    sh = height * scale * PT;
     vpos = ((pdf->p.len *PT) - sh)/2;
     wrstmf (pdf, FORMBUF, " q /igs gs %f 0 0 %f %f %f cm /form Do Q",
             xp(pw)-2, sh, xp(pdf->p.margin) +1, vpos);
@@ -3512,6 +6213,8 @@ static uint32_t crc32 (uint32_t initial, const uint8_t *string, uint32_t length)
  *
  * For checkpoint, everything is done, except that the file is left open
  * and the PDF is not freed.  The work of checkpoint is done in pdf_checkpoint.
+ * checkpoint is 2 from pdf_checkpoint, which may write an xref update; 1 from
+ * pdf_reopen, and 0 from pdf_close, always write the whole xref.
  *
  * Any PDF field updated here that controls writing metadata needs to be
  * saved/restored in pdf_checkpoint.  Try to avoid that; in a normal close,
@@ -3523,12 +6226,17 @@ static int pdfclose (PDF *pdf, int checkpoint) {
     long l;
     uint8_t hash[SHA1HashSize];
     char id[1 + 2*sizeof(hash)];
-    unsigned int p, cat, plist, anchor;
+    unsigned int cat;
     unsigned int aobj, iobj;
     struct tm *tm;
     time_t now;
-    char tbuf[32], ibuf[513];
-    t_fpos xref;
+    char tbuf[32], ibuf[513], prev[32];
+    size_t i, j, n;
+    int full;
+    t_fpos xref, end;
+#ifndef _WIN32
+    struct stat sb;
+#endif
 
     if (!pdf->pdf) { /* File never opened */
         if (!checkpoint) {
@@ -3557,28 +6265,25 @@ static int pdfclose (PDF *pdf, int checkpoint) {
         if (!pdf->formlen) {
             setform (pdf);
         }
+    } else if (checkpoint != 2 && pdf->xdelta && !(pdf->flags & PDF_WRITTEN)) {
+        /* Nothing was written since a checkpoint that left an xref update.
+         * The file is completed again with the whole xref.
+         */
+        wrhdr (pdf);
     }
 
     if (!(pdf->flags & PDF_WRITTEN)) {
-        r = PDF_OK;
         if (!checkpoint) {
-            if (pdf->pdf != stdout) {
-                fclose (pdf->pdf);
-            }
-            if (pdf->outf && pdf->outf != stdout) {
-                fclose (pdf->outf);
-            }
-#ifdef _WIN32
-            if (pdf->tmpname) {
-                if (remove (pdf->tmpname)) {
-                    r = errno;
-                }
-                free (pdf->tmpname);
+            /* A temporary file that a checkpoint completed is still copied,
+             * and a file that it completed is synced if it wasn't then.
+             */
+
+            if (pdf->checkpp && pdf->p.durability == PDF_SYNC_JOB && osync (pdf) != PDF_OK) {
+                return closefiles (pdf, E(IO_ERROR), 0);
             }
-#endif
-            pdf_free (pdf);
+            return closefiles (pdf, PDF_OK, pdf->checkpp != 0);
         }
-        return r;
+        return PDF_OK;
     }
 
     /* Force out last page if anything was written on it */
@@ -3587,86 +6292,56 @@ static int pdfclose (PDF *pdf, int checkpoint) {
         wrpage (pdf);
     }
 
-    /* Page list for this session */
+#ifdef USE_THREADS
+    /* Wait for all pages to be written */
 
-    plist = addobj (pdf);
-    anchor = plist + 1 + 1 + pdf->page;
-    fprintf (pdf->pdf, "%u 0 obj\n"
-             " << /Type /Pages /Kids [", plist);
-    
-    for(p = 0; p < pdf->page; p++) {
-        if (p && ((p % (PDF_C_LINELEN / 15)) == 0)) {
-            fputc ('\n', pdf->pdf);
-        }
-        fprintf (pdf->pdf," %u 0 R",
-                 (plist + 1 + 1 + p));
+    if ((r = pipe_stop (pdf)) != PDF_OK) {
+        ABORT (r);
     }
-    fprintf (pdf->pdf, "]\n /Count %u /Parent %010u 0 R >>\nendobj\n\n",
-                        pdf->page, anchor);
-
-    /* Font dictionary object */
-
-    (void) addobj (pdf);
-    fprintf (pdf->pdf, "%u 0 obj\n"
-             " << /F1 << /Type /Font /Subtype /Type1 /BaseFont /%s >>"
-             " /F2 << /Type /Font /Subtype /Type1 /BaseFont /%s >>"
-             " /F3 << /Type /Font /Subtype /Type1 /BaseFont /%s >> >>\n"
-             "endobj\n\n", plist+1, pdf->p.font, pdf->p.nfont, pdf->p.nbold);
-
-    /* Each page leaf object */
-
-    for( p = 0; p < pdf->page; p++) {
-        unsigned int obj = addobj (pdf);
+#endif
 
-        /* These are close to PDF_C_LINELEN */
+    /* The session's last node and its page list.
+     * The leaves have been written with their pages.
+     */
 
-        fprintf (pdf->pdf, "%u 0 obj\n"
-                 " << /Type /Page /Parent %u 0 R /Resources << /Font %u 0 R"
-                 " /ProcSet [/PDF /Text /ImageC /ImageI /ImageB]",
-                 obj, plist, plist +1);
-        if (pdf->formobj) { /* Form image resources */
-            fprintf (pdf->pdf, " /XObject << /form %u 0 R >>", pdf->formobj);
-            fprintf (pdf->pdf, " /ExtGState << /igs %u 0 R >>", pdf->formobj +1);
-            fprintf (pdf->pdf, " >>\n /Group << /S /Transparency /CS /DeviceRGB >>");
-        } else {
-            fprintf (pdf->pdf, " >>");
-        }
-        fprintf (pdf->pdf, " /MediaBox [0 0 %f %f] /Contents %u 0 R >>\n"
-                 "endobj\n\n", pdf->p.wid * PT, pdf->p.len * PT,
-                 pdf->pbase + p );
+    if (!pdf->pt.form) {
+        ptstart (pdf);
     }
+    ptflush (pdf);
 
      /* anchor pagelist for this session */
 
     aobj = addobj (pdf);
     cat = aobj +1;
-    fprintf (pdf->pdf, "%u 0 obj\n"
+    oprintf (pdf, "%u 0 obj\n"
                 " << /Type /Pages /Kids [", aobj);
     if (pdf->aobj) {     /* If previous session, link to it */
-        fprintf (pdf->pdf,
+        oprintf (pdf,
                 "%u 0 R ", pdf->aobj);
     }
-    fprintf (pdf->pdf,
+    oprintf (pdf,
                  "%u 0 R] /Count %u >>\n"
-                "endobj\n\n", plist, pdf->page + pdf->prevpc);
+                "endobj\n\n", pdf->pt.plist, pdf->page + pdf->prevpc);
 
     /* Write catalog */
 
     cat = addobj (pdf);
-    fprintf (pdf->pdf, "%u 0 obj\n"
+    oprintf (pdf, "%u 0 obj\n"
              "  << /Type /Catalog /Pages %u 0 R"
              " /PageLayout /SinglePage\n"
              " /ViewerPreferences << ", cat, aobj);
-    fputs ((pdf->p.wid > pdf->p.len)?
-            " /Duplex /DuplexFlipLongEdge":
-            " /Duplex /DuplexFlipShortEdge", pdf->pdf);
+    if (pdf->p.wid > pdf->p.len) {
+        owrite (pdf, QS(" /Duplex /DuplexFlipLongEdge"));
+    } else {
+        owrite (pdf, QS(" /Duplex /DuplexFlipShortEdge"));
+    }
     if (strcmp (pdf->p.title, defaults.p.title)) {
-        fputs (
-            " /DisplayDocTitle true", pdf->pdf);
+        owrite (pdf, QS(
+            " /DisplayDocTitle true"));
     }
-    fputs (
+    owrite (pdf, QS(
         " /PickTrayByPDFSize true >> >>\n"
-        "endobj\n\n", pdf->pdf);
+        "endobj\n\n"));
 
     /* Document information object */
 
@@ -3684,21 +6359,40 @@ static int pdfclose (PDF *pdf, int checkpoint) {
              ((pdf->flags & PDF_UPDATING)? pdf->ctime: tbuf), tbuf);
 
     SHA1Input (&pdf->sha1, (uint8_t *)ibuf, strlen (ibuf));
-    fputs (ibuf, pdf->pdf);
+    owrite (pdf, ibuf, strlen (ibuf));
 
-    /* Write the xref */
-
-    xref = ftell (pdf->pdf);
-
-    /* Trailing space is part of required 2-byte EOL marker in xref entries */
-    fprintf (pdf->pdf,"xref\n"
-             "0 %u\n"
-             "%010u %05u f \n",                /* << TSP */
-             1+pdf->obj, 0, 65535);
+    /* Write the xref.
+     * A checkpoint writes an update that locates only the objects written
+     * or moved since the last one, and chains to it with /Prev.  Once the
+     * updates would be as large as the whole xref, or at the final close,
+     * the whole xref is written.
+     */
 
-    for( p = 0; ((unsigned int)p) < pdf->obj; p++ ) {
-        fprintf (pdf->pdf,"%010lu %05u n \n", /* << TSP */
-            pdf->xref[p], 0);
+    xref = otell (pdf);
+    n = pdf->xmused + (pdf->obj - pdf->xmark);
+    full = (checkpoint != 2 || !pdf->xprev || pdf->xdelta + n >= pdf->obj);
+
+    if (full) {
+        /* Trailing space is part of required 2-byte EOL marker in xref entries */
+        oprintf (pdf,"xref\n"
+                 "0 %u\n"
+                 "%010u %05u f \n",                /* << TSP */
+                 1+pdf->obj, 0, 65535);
+        wrxref (pdf, 1, pdf->obj);
+        pdf->xdelta = 0;
+    } else {
+        pdf->xdelta += n;
+        owrite (pdf, QS("xref\n"));
+        qsort (pdf->xmoved, pdf->xmused, sizeof (unsigned int), objcmp);
+        for (i = 0; i < pdf->xmused; i = j) {
+            for (j = i + 1; j < pdf->xmused && pdf->xmoved[j] <= pdf->xmoved[j-1] + 1; j++)
+                ;
+            n = pdf->xmoved[j-1] - pdf->xmoved[i] + 1;
+            oprintf (pdf, "%u %u\n", pdf->xmoved[i], (unsigned int) n);
+            wrxref (pdf, pdf->xmoved[i], (unsigned int) n);
+        }
+        oprintf (pdf, "%u %u\n", pdf->xmark + 1, pdf->obj - pdf->xmark);
+        wrxref (pdf, pdf->xmark + 1, pdf->obj - pdf->xmark);
     }
 
     /* Write trailer */
@@ -3708,40 +6402,73 @@ static int pdfclose (PDF *pdf, int checkpoint) {
         sprintf (id+(l*2), "%02X", ((int)hash[l] & 0xFF));
     }
 
-    fprintf (pdf->pdf,"trailer\n"
-             " << /Root %u 0 R /Size %u /Info %u 0 R /ID [<%s> <%s>] >>\n"
+    prev[0] = '\0';
+    if (!full) {
+        sprintf (prev, " /Prev %lu", (unsigned long) pdf->xprev);
+    }
+    oprintf (pdf,"trailer\n"
+             " << /Root %u 0 R /Size %u /Info %u 0 R /ID [<%s> <%s>]%s >>\n"
              "startxref\n"
              "%lu\n"
              "%%%%EOF\n",
              cat, pdf->obj +1, iobj,
-             ((pdf->oid[0])? pdf->oid: id), id, xref);
+             ((pdf->oid[0])? pdf->oid: id), id, prev, xref);
+
+    /* A checkpoint resumes writing pages after the trailer, so the update
+     * stays intact.  The anchor, catalog and info objects keep their numbers.
+     */
+
+    if (checkpoint) {
+        pdf->checkpp = otell (pdf);
+        pdf->xprev = xref;
+        pdf->xmark = aobj - 1;
+        pdf->xmused = 0;
+    }
 
     /* There may be an obscure corner case where a file is opened for
      * append with a much shorter title and a trivial page, so the new
      * EOF is before the old.  Although it seems unlikely, truncate the
      * file at the correct place to be safe.
+     * At a checkpoint, only a longer file is truncated, as that would also
+     * release the space preallocated ahead of the data.
      */
 
+    end = otell (pdf);
+    if (oflush (pdf) != PDF_OK) {
+        r = E(IO_ERROR);
+    }
 #ifdef _WIN32
-    if (_chsize (_fileno (pdf->pdf), ftell (pdf->pdf)) == -1) {
+    if (_chsize (_fileno (pdf->pdf), end) == -1) {
         r = E(IO_ERROR);
     }
 #else
-    if (ftruncate (fileno (pdf->pdf), ftell (pdf->pdf)) == -1) {
+    if (!(pdf->flags & PDF_STREAM) &&
+        (!checkpoint || fstat (fileno (pdf->pdf), &sb) || (t_fpos) sb.st_size > end) &&
+        ftruncate (fileno (pdf->pdf), end) == -1) {
         r = E(IO_ERROR);
     }
 #endif
+    if (end < pdf->snaplen) {
+        pdf->snaplen = end;
+    }
 
     /* If previous session, update its parent pointer with new anchor */
 
     if (pdf->anchorpp) {
-        fseek (pdf->pdf, pdf->anchorpp, SEEK_SET);
-        fprintf (pdf->pdf, "%010u", aobj);
+        seekback (pdf, pdf->anchorpp);
+        oprintf (pdf, "%010u", aobj);
+    }
+
+    if (oflush (pdf) != PDF_OK) {
+        r = E(IO_ERROR);
     }
 
-    fflush (pdf->pdf);
+    /* A checkpoint is synced for PDF_SYNC_CHECKPOINT, and a completed
+     * file for any durability.
+     */
 
-    if (ferror (pdf->pdf)) {
+    if (pdf->p.durability >= ((checkpoint == 2)? PDF_SYNC_CHECKPOINT: PDF_SYNC_JOB) &&
+        osync (pdf) != PDF_OK) {
         r = E(IO_ERROR);
     }
 
@@ -3749,14 +6476,20 @@ static int pdfclose (PDF *pdf, int checkpoint) {
         return r;
     }
 
-    /* Actually close the file.
-     * If a temporary file has been used, copy it over
-     * the real output file.  (This may be surprising, but the
-     * real output file is a pipe, socket or other special file.
-     * If it was possible to read and write the real file, a temporary
-     * file would not be used.)
-     */
-    if (pdf->outf && r == PDF_OK) {
+    return closefiles (pdf, r, 1);
+}
+
+/* Actually close the file.
+ * If a temporary file has been used, and copy is set, copy it over
+ * the real output file.  (This may be surprising, but the
+ * real output file is a pipe, socket or other special file.
+ * If it was possible to read and write the real file, a temporary
+ * file would not be used.)
+ * Frees the context, and returns r or the first error.
+ */
+
+static int closefiles (PDF *pdf, int r, int copy) {
+    if (pdf->outf && copy && r == PDF_OK) {
         unsigned char *buf = malloc (COPY_BUFSIZE);
         size_t n;
 
@@ -3784,9 +6517,11 @@ static int pdfclose (PDF *pdf, int checkpoint) {
             if (ferror (pdf->pdf) || ferror (pdf->outf)) {
                 r = errno;
             }
-            if (pdf->outf != stdout && fclose (pdf->outf) == EOF) {
-                r = errno;
-            }
+        }
+    }
+    if (pdf->outf && pdf->outf != stdout && fclose (pdf->outf) == EOF) {
+        if (r == PDF_OK) {
+            r = errno;
         }
     }
     if (pdf->pdf != stdout && fclose (pdf->pdf) == EOF) {
@@ -3811,26 +6546,27 @@ static int pdfclose (PDF *pdf, int checkpoint) {
  */
 
 static void pdf_free (PDF *pdf) {
-    if (pdf->lines) {
-        unsigned int l;
-        for (l = 0; l < pdf->nlines; l++) {
-            free (pdf->lines[l]);
-        }
-        free (pdf->lines);
-    }
-    free (pdf->linelen);
-    free (pdf->linesize);
+#ifdef USE_THREADS
+    pipe_free (pdf);
+#endif
+    gridfree (&pdf->grid);
     free (pdf->p.font);
     free (pdf->p.nfont);
     free (pdf->p.nbold);
     free (pdf->p.title);
     free (pdf->p.formfile);
-    free (pdf->formbuf);
+    pool_put (pdf->formbuf, pdf->formsize);
     free (pdf->trail);
+    free (pdf->snapname);
+    vclose (pdf);
+    free (pdf->obuf);
     free (pdf->xref);
-    free (pdf->parsebuf);
-    free (pdf->pagebuf);
-    free (pdf->lzwbuf);
+    pool_put (pdf->xmoved, pdf->xmsize * sizeof (unsigned int));
+    free (pdf->phtab.ent);
+    pool_put (pdf->parsebuf, pdf->parsesize * sizeof (short));
+    pool_put (pdf->pagebuf, pdf->pbsize);
+    pool_put (pdf->lzwbuf, pdf->lzwsize);
+    pool_put (pdf->cbuf, pdf->csize);
 
     pdf->key[0] = '\0';
 
@@ -3853,11 +6589,54 @@ static unsigned int addobj (PDF *pdf) {
         pdf->xref = xt;
         pdf->xsize = pdf->obj + 1 + 100;
     }
-    pdf->xref[pdf->obj++] = ftell (pdf->pdf);
+    pdf->xref[pdf->obj++] = otell (pdf);
 
     return pdf->obj;
 }
 
+/* Locate an object numbered earlier at the current position.
+ * If the last checkpoint's xref located it, the next update must too.
+ */
+
+static void setobj (PDF *pdf, unsigned int obj) {
+    pdf->xref[obj -1] = otell (pdf);
+    if (obj <= pdf->xmark) {
+        if (pdf->xmused >= pdf->xmsize) {
+            pdf->xmoved = (unsigned int *) growbuf (pdf, pdf->xmoved, &pdf->xmsize,
+                                                    pdf->xmused + 1, sizeof (unsigned int));
+        }
+        pdf->xmoved[pdf->xmused++] = obj;
+    }
+    return;
+}
+
+/* Write the xref entries of count objects starting at first */
+
+static void wrxref (PDF *pdf, unsigned int first, unsigned int count) {
+    char lbuf[PDF_C_LINELEN * 8], *q;
+    t_fpos *xp, *end;
+
+    q = lbuf;
+    for (xp = pdf->xref + first -1, end = xp + count; xp < end; xp++) {
+        if (q > lbuf + sizeof (lbuf) - 32) {
+            owrite (pdf, lbuf, q - lbuf);
+            q = lbuf;
+        }
+        q = fmtz (q, (uint64_t) *xp, 10);
+        q = fmts (q, QS(" 00000 n \n"));   /* << TSP */
+    }
+    owrite (pdf, lbuf, q - lbuf);
+    return;
+}
+
+/* qsort comparison of object numbers */
+
+static int objcmp (const void *a, const void *b) {
+    unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+
+    return (x > y) - (x < y);
+}
+
 /* Extract a reference to an object from a buffer
  * Errors free the buffer and ABORT.
  */
@@ -3952,6 +6731,141 @@ static char *getstr (PDF *pdf, char *buf, const char *name) {
     return r;
 }
 
+/* Escape and control sequence parser tables
+ *
+ * Each input byte has a class, and the parser's action and next state
+ * are found by its state and the class.  Graphics are translated to
+ * Unicode thru the handle's xlat table, which is rebuilt when the
+ * character sets designated or invoked change.
+ */
+
+#define PK_CTL    (0)   /* Controls not listed */
+#define PK_LF     (1)
+#define PK_CR     (2)
+#define PK_FF     (3)
+#define PK_CAN    (4)   /* CAN, SUB */
+#define PK_ESC    (5)
+#define PK_CSI    (6)
+#define PK_ST     (7)
+#define PK_STR    (8)   /* OSC, PM, APC */
+#define PK_SI     (9)
+#define PK_SO     (10)
+#define PK_SS2    (11)
+#define PK_SS3    (12)
+#define PK_INT    (13)  /* Graphics by column: 2/0 - 2/15 */
+#define PK_DIG    (14)  /* 3/0 - 3/9 */
+#define PK_COLON  (15)  /* 3/10 */
+#define PK_SEMI   (16)  /* 3/11 */
+#define PK_PRIV   (17)  /* 3/12 - 3/15 */
+#define PK_FIN    (18)  /* 4/0 - 7/14 */
+#define PK_DEL    (19)  /* 7/15 */
+#define PK_NCLASS (20)
+
+#define PK_X4(k)  k, k, k, k
+#define PK_X16(k) PK_X4(k), PK_X4(k), PK_X4(k), PK_X4(k)
+#define PK_GRAPHICS                                                     \
+    PK_X16(PK_INT),                                                     \
+    PK_X4(PK_DIG), PK_X4(PK_DIG), PK_DIG, PK_DIG, PK_COLON, PK_SEMI,    \
+    PK_X4(PK_PRIV),                                                     \
+    PK_X16(PK_FIN), PK_X16(PK_FIN), PK_X16(PK_FIN),                     \
+    PK_X4(PK_FIN), PK_X4(PK_FIN), PK_X4(PK_FIN), PK_FIN, PK_FIN, PK_FIN, PK_DEL
+
+static const uint8_t pclass[256] = {
+    PK_X4(PK_CTL), PK_X4(PK_CTL), PK_CTL, PK_CTL,                       /* 0/0 */
+    PK_LF, PK_CTL, PK_FF, PK_CR, PK_SO, PK_SI,
+    PK_X4(PK_CTL), PK_X4(PK_CTL), PK_CAN, PK_CTL, PK_CAN, PK_ESC,       /* 1/0 */
+    PK_X4(PK_CTL),
+    PK_GRAPHICS,
+    PK_X4(PK_CTL), PK_X4(PK_CTL), PK_X4(PK_CTL), PK_CTL, PK_CTL,        /* 8/0 */
+    PK_SS2, PK_SS3,
+    PK_X4(PK_CTL), PK_X4(PK_CTL), PK_CTL, PK_CTL, PK_CTL,               /* 9/0 */
+    PK_CSI, PK_ST, PK_STR, PK_STR, PK_STR,
+    PK_GRAPHICS,
+};
+
+#define PA_DISCARD (0)  /* Ignore */
+#define PA_GRAPHIC (1)  /* Store, translated */
+#define PA_STORE   (2)  /* Store control */
+#define PA_CR      (3)
+#define PA_FF      (4)
+#define PA_ESC     (5)  /* Start escape sequence */
+#define PA_CSI     (6)  /* Start control sequence */
+#define PA_SI      (7)
+#define PA_SO      (8)
+#define PA_SS2     (9)
+#define PA_SS3     (10)
+#define PA_ESCINT  (11) /* Escape sequence intermediate */
+#define PA_ESCFIN  (12) /* Execute escape sequence */
+#define PA_CSIPRV  (13) /* Private parameter string */
+#define PA_CSIDIG  (14) /* Parameter digit */
+#define PA_CSISEP  (15) /* Parameter separator */
+#define PA_CSIINT  (16) /* Control sequence intermediate */
+#define PA_CSIFIN  (17) /* Execute control sequence */
+#define PA_CSIEND  (18) /* End of parameters */
+
+#define PX(a, s) (((a) << 3) | (s))
+#define PX_STATE  (7)
+#define PX_ACTION(t) ((t) >> 3)
+
+/* Controls that act in any state */
+
+#define PX_CONTROLS(s)                                                  \
+    PX(PA_STORE, s), PX(PA_CR, s), PX(PA_FF, s), PX(PA_DISCARD, ESC_IDLE), \
+    PX(PA_ESC, ESC_ESCSEQ), PX(PA_CSI, ESC_CSI), PX(PA_DISCARD, ESC_IDLE), \
+    PX(PA_DISCARD, ESC_BADSTR),                                         \
+    PX(PA_SI, s), PX(PA_SO, s), PX(PA_SS2, s), PX(PA_SS3, s)
+
+static const uint8_t ptrans[ESC_BADSTR+1][PK_NCLASS] = {
+    { /* ESC_IDLE */
+        PX(PA_DISCARD, ESC_IDLE),   PX_CONTROLS(ESC_IDLE),
+        PX(PA_GRAPHIC, ESC_IDLE),   PX(PA_GRAPHIC, ESC_IDLE),   PX(PA_GRAPHIC, ESC_IDLE),
+        PX(PA_GRAPHIC, ESC_IDLE),   PX(PA_GRAPHIC, ESC_IDLE),   PX(PA_GRAPHIC, ESC_IDLE),
+        PX(PA_GRAPHIC, ESC_IDLE),
+    },
+    { /* ESC_ESCSEQ */
+        PX(PA_DISCARD, ESC_ESCSEQ), PX_CONTROLS(ESC_ESCSEQ),
+        PX(PA_ESCINT, ESC_ESCSEQ),  PX(PA_ESCFIN, ESC_IDLE),    PX(PA_ESCFIN, ESC_IDLE),
+        PX(PA_ESCFIN, ESC_IDLE),    PX(PA_ESCFIN, ESC_IDLE),    PX(PA_ESCFIN, ESC_IDLE),
+        PX(PA_DISCARD, ESC_ESCSEQ),
+    },
+    { /* ESC_CSI */
+        PX(PA_CSIEND, ESC_CSIINT),  PX_CONTROLS(ESC_CSI),
+        PX(PA_CSIINT, ESC_CSIINT),  PX(PA_CSIDIG, ESC_CSIP),    PX(PA_DISCARD, ESC_BADCSI),
+        PX(PA_CSISEP, ESC_CSIP),    PX(PA_CSIPRV, ESC_CSIP),    PX(PA_CSIFIN, ESC_IDLE),
+        PX(PA_CSIEND, ESC_CSIINT),
+    },
+    { /* ESC_CSIP */
+        PX(PA_CSIEND, ESC_CSIINT),  PX_CONTROLS(ESC_CSIP),
+        PX(PA_CSIINT, ESC_CSIINT),  PX(PA_CSIDIG, ESC_CSIP),    PX(PA_DISCARD, ESC_BADCSI),
+        PX(PA_CSISEP, ESC_CSIP),    PX(PA_DISCARD, ESC_BADCSI), PX(PA_CSIFIN, ESC_IDLE),
+        PX(PA_CSIEND, ESC_CSIINT),
+    },
+    { /* ESC_CSIINT */
+        PX(PA_DISCARD, ESC_CSIINT), PX_CONTROLS(ESC_CSIINT),
+        PX(PA_CSIINT, ESC_CSIINT),  PX(PA_DISCARD, ESC_BADCSI), PX(PA_DISCARD, ESC_BADCSI),
+        PX(PA_DISCARD, ESC_BADCSI), PX(PA_DISCARD, ESC_BADCSI), PX(PA_CSIFIN, ESC_IDLE),
+        PX(PA_DISCARD, ESC_CSIINT),
+    },
+    { /* ESC_BADCSI */
+        PX(PA_DISCARD, ESC_BADCSI), PX_CONTROLS(ESC_BADCSI),
+        PX(PA_DISCARD, ESC_BADCSI), PX(PA_DISCARD, ESC_BADCSI), PX(PA_DISCARD, ESC_BADCSI),
+        PX(PA_DISCARD, ESC_BADCSI), PX(PA_DISCARD, ESC_BADCSI), PX(PA_DISCARD, ESC_IDLE),
+        PX(PA_DISCARD, ESC_BADCSI),
+    },
+    { /* ESC_BADESC */
+        PX(PA_DISCARD, ESC_BADESC), PX_CONTROLS(ESC_BADESC),
+        PX(PA_DISCARD, ESC_BADESC), PX(PA_DISCARD, ESC_IDLE),   PX(PA_DISCARD, ESC_IDLE),
+        PX(PA_DISCARD, ESC_IDLE),   PX(PA_DISCARD, ESC_IDLE),   PX(PA_DISCARD, ESC_IDLE),
+        PX(PA_DISCARD, ESC_BADESC),
+    },
+    { /* ESC_BADSTR */
+        PX(PA_DISCARD, ESC_BADSTR), PX_CONTROLS(ESC_BADSTR),
+        PX(PA_DISCARD, ESC_BADSTR), PX(PA_DISCARD, ESC_BADSTR), PX(PA_DISCARD, ESC_BADSTR),
+        PX(PA_DISCARD, ESC_BADSTR), PX(PA_DISCARD, ESC_BADSTR), PX(PA_DISCARD, ESC_BADSTR),
+        PX(PA_DISCARD, ESC_BADSTR),
+    },
+};
+
 /* Parse input string for controls.
  * Return true if any initial data was discarded
  */
@@ -3975,264 +6889,304 @@ static int parsestr (PDF *pdf, const char *string, size_t length, int initial) {
     SHA1Input (&ps->sha1, (uint8_t *) string, length );
 
     while (length) {
-        short ch = 0xFF & *string++;
-        char ch7 = ch & 0x7F;
-        size_t chi = ch7 & 0xFF;                /* GCC: doesn't like char as array index */
-        length--;
-
-#define STORE goto store
-#define DISCARD continue
+        unsigned int ch, ch7, k, t, prev;
+        short u;
+        size_t n;
 
-        /* Controls */
+        /* Printable ASCII with no sequence in progress needs only
+         * translation, so a run of it is stored as a unit.
+         */
 
-        if (pdf->ssg) { /* Cancel unless graphic, SI or SO */
-            if (!((ch >= 0x20 && ch <= 0x7F) || (ch >= 0xA0 && ch <= 0xFF))) {
-                if (ch != 0x0E && ch != 0x0F) {
-                    pdf->ssg = NULL;
-                }
-            }
+        if (pdf->escstate == ESC_IDLE && !pdf->ssg &&
+            (n = scanprint (string, length)) != 0) {
+            storeprint (pdf, string, n);
+            string += n;
+            length -= n;
+            initial = 0;
+            continue;
         }
 
-        /* Code extension */
+        ch = 0xFF & *string++;
+        length--;
+
+        /* Code extension: ESC Fe is a C1 control */
 
-        if (pdf->escstate == ESC_ESCSEQ &&
+        if (pdf->escstate == ESC_ESCSEQ && pdf->escin == 0 &&
             ch >= 0x40 && ch <= 0x5F) {
             ch += 0x40;
             pdf->escstate = ESC_IDLE;
         }
+        ch7 = ch & 0x7F;
+        k = pclass[ch];
+
+        if (pdf->ssg && k < PK_INT) { /* Cancel unless graphic, SI or SO */
+            if (k != PK_SI && k != PK_SO) {
+                pdf->ssg = NULL;
+            }
+        }
+
+        prev = pdf->escstate;
+        t = ptrans[prev][k];
+        pdf->escstate = t & PX_STATE;
+
+        switch (PX_ACTION (t)) {
+        case PA_DISCARD:
+            continue;
 
-        /* Controls */
+        case PA_GRAPHIC:                        /* SS applies to left or right input */
+            if (pdf->ssg) {
+                u = pdf->ssg->chrset[ch7 - 0x20];
+                pdf->ssg = NULL;
+            } else {
+                u = pdf->xlat[ch];
+            }
+            break;
 
-        switch (ch) {
-        case 0x0A: /* LF */
-            STORE;
-        case 0x0D: /* CR */
+        case PA_STORE:
+            u = (short) ch;
+            break;
+        case PA_CR:
             if (initial && !ffseen) {
-                DISCARD;
+                continue;
             }
-            STORE;
-        case 0x0C: /* FF */
+            u = (short) ch;
+            break;
+        case PA_FF:
             if (initial && !ffseen++) {
-                DISCARD;
+                continue;
             }
-            STORE;
-        case 0x18: /* CAN */
-        case 0x1A: /* SUB */
-            pdf->escstate = ESC_IDLE;
-            DISCARD;
-        case 0x1B: /* ESC */
-            pdf->escstate = ESC_ESCSEQ;
+            u = (short) ch;
+            break;
+
+        case PA_ESC:
             pdf->escin = 0;
             pdf->escpn = 0;
-            DISCARD;
-        case 0x9B: /* CSI */
-            pdf->escstate = ESC_CSI;
+            continue;
+        case PA_CSI:
             pdf->escin = 0;
             pdf->escpn = 0;
+            pdf->escprv = 0;
             memset (pdf->escpars, 0xFF, sizeof (pdf->escpars));
-            DISCARD;
-        case 0x9C: /* ST */
-            pdf->escstate = ESC_IDLE;
-            DISCARD;
-        case 0x9d: /* OSC */
-        case 0x9e: /* PM */
-        case 0x9f: /* APC */
-            pdf->escstate = ESC_BADSTR;
-            DISCARD;
-        case 0x0F: /* SI */
-            pdf->gl = pdf->gset[0];
-            DISCARD;
-        case 0x0E: /* SO */
-            pdf->gl = pdf->gset[1];
-            DISCARD;
-        case 0x8E: /* SS2 */
+            continue;
+
+        case PA_SI:
+            invokeChs (pdf, 0, 0);
+            continue;
+        case PA_SO:
+            invokeChs (pdf, 0, 1);
+            continue;
+        case PA_SS2:
             pdf->ssg = pdf->gset[2];
-            DISCARD;
-        case 0x8F: /* SS3 */
+            continue;
+        case PA_SS3:
             pdf->ssg = pdf->gset[3];
-            DISCARD;
-        default:
-            break;
-        }
-        
-        /* Sequences */
-#undef STORE
-#define STORE break
-       
-        switch (pdf->escstate) {
-        case ESC_IDLE: /* Discard remaining C0 and C1 */
-            if (ch < 0x20 || (ch >= 0x80 && ch <= 0x9F)) {
-                DISCARD;
-            }
-            STORE;
-        case ESC_ESCSEQ:
-            if (ch7 >= 0x20 && ch7 <= 0x2F) { /* Int */
-                if (pdf->escin < DIM (pdf->escpars)) {
-                    pdf->escpars[pdf->escin++] = ch7;
-                } else {
-                    pdf->escstate = ESC_BADESC;
-                }
-                DISCARD;
-            }
-            if (ch7 >= 0x30 && ch7 <= 0x7E) {
-                /* Do ESCSEQ */
-                if (pdf->escin == 0) {
-                    switch (ch) {
-                    case '~': /* LS1R */
-                        pdf->gr = pdf->gset[1];
-                        break;
-                    case 'n': /* LS2 */
-                        pdf->gl = pdf->gset[2];
-                        break;
-                    case '}': /* LS2R */
-                        pdf->gr = pdf->gset[2];
-                        break;
-                    case 'o': /* LS3 */
-                        pdf->gl = pdf->gset[3];
-                        break;
-                    case '|': /* LS3R */
-                        pdf->gr = pdf->gset[3];
-                        break;
-                    }
-                } else if (pdf->escin >= 1) {
-                    switch (pdf->escints[0]) {
-                        /* SCS - designate( gset, size, #intermediates, list, final )
-                         * Note that a 96 char set can not be installed in G0.
-                         */
-                    case '(':
-                        designateChs (pdf, 0, 94, pdf->escin-1, pdf->escints+1, ch7);
-                        break;
-                    case ')':
-                        designateChs (pdf, 1, 94, pdf->escin-1, pdf->escints+1, ch7);
-                        break;
-                    case '*':
-                        designateChs (pdf, 2, 94, pdf->escin-1, pdf->escints+1, ch7);
-                        break;
-                    case '+':
-                        designateChs (pdf, 3, 94, pdf->escin-1, pdf->escints+1, ch7);
-                        break;
-                    case '-':
-                        designateChs (pdf, 1, 96, pdf->escin-1, pdf->escints+1, ch7);
-                        break;
-                    case '.':
-                        designateChs (pdf, 2, 96, pdf->escin-1, pdf->escints+1, ch7);
-                        break;
-                    case '/':
-                        designateChs (pdf, 3, 96, pdf->escin-1, pdf->escints+1, ch7);
-                        break;
-                    }
-                }
-                pdf->escstate = ESC_IDLE;
-                DISCARD;
-            }
-            DISCARD; /* Unrecognized control in seq */
-        case ESC_CSI:
-            if (ch7 >= 0x3C && ch7 <= 0x3F) {
-                pdf->escprv = (char) ch;
-                pdf->escstate = ESC_CSIP;
-                DISCARD;
-            }
-            pdf->escstate = ESC_CSIP;
-        case ESC_CSIP:
-            if (ch7 >= 0x30 && ch7 <= 0x3F) {
-                if (ch7 == ';') { /* 3B */
-                    if (pdf->escpn +1 < DIM (pdf->escpars)) {
-                        pdf->escpn++;
-                    } else {
-                        pdf->escstate = ESC_BADCSI;
-                    }
-                    DISCARD;
-                }
-                if (ch7 <= 0x39 ) {
-                    if (pdf->escpars[pdf->escpn] == ESC_PDEFAULT) {
-                        pdf->escpars[pdf->escpn] = ch7 - 0x30;
-                    } else if (pdf->escpars[pdf->escpn] & ESC_POVERFLOW) {
-                        pdf->escstate = ESC_BADCSI;
-                    } else {
-                        pdf->escpars[pdf->escpn] =
-                            (pdf->escpars[pdf->escpn] * 10) + (ch7 - 0x30);
-                    }
-                    DISCARD;
+            continue;
+
+        case PA_ESCINT:
+            if (pdf->escin < DIM (pdf->escints)) {
+                pdf->escints[pdf->escin++] = (char) ch7;
+            } else {
+                pdf->escstate = ESC_BADESC;
+            }
+            continue;
+        case PA_ESCFIN:
+            if (pdf->escin == 0) {
+                switch (ch7) {
+                case '~': /* LS1R */
+                    invokeChs (pdf, 1, 1);
+                    break;
+                case 'n': /* LS2 */
+                    invokeChs (pdf, 0, 2);
+                    break;
+                case '}': /* LS2R */
+                    invokeChs (pdf, 1, 2);
+                    break;
+                case 'o': /* LS3 */
+                    invokeChs (pdf, 0, 3);
+                    break;
+                case '|': /* LS3R */
+                    invokeChs (pdf, 1, 3);
+                    break;
                 }
+                continue;
+            }
+            switch (pdf->escints[0]) {
+                /* SCS - designate( gset, size, #intermediates, list, final )
+                 * Note that a 96 char set can not be installed in G0.
+                 */
+            case '(':
+                designateChs (pdf, 0, 94, pdf->escin-1, pdf->escints+1, ch7);
+                break;
+            case ')':
+                designateChs (pdf, 1, 94, pdf->escin-1, pdf->escints+1, ch7);
+                break;
+            case '*':
+                designateChs (pdf, 2, 94, pdf->escin-1, pdf->escints+1, ch7);
+                break;
+            case '+':
+                designateChs (pdf, 3, 94, pdf->escin-1, pdf->escints+1, ch7);
+                break;
+            case '-':
+                designateChs (pdf, 1, 96, pdf->escin-1, pdf->escints+1, ch7);
+                break;
+            case '.':
+                designateChs (pdf, 2, 96, pdf->escin-1, pdf->escints+1, ch7);
+                break;
+            case '/':
+                designateChs (pdf, 3, 96, pdf->escin-1, pdf->escints+1, ch7);
+                break;
+            }
+            continue;
+
+        case PA_CSIPRV:
+            pdf->escprv = (char) ch;
+            continue;
+        case PA_CSIDIG:
+            if (pdf->escpars[pdf->escpn] == ESC_PDEFAULT) {
+                pdf->escpars[pdf->escpn] = ch7 - 0x30;
+            } else if (pdf->escpars[pdf->escpn] & ESC_POVERFLOW) {
+                pdf->escstate = ESC_BADCSI;
+            } else {
+                pdf->escpars[pdf->escpn] =
+                    (pdf->escpars[pdf->escpn] * 10) + (ch7 - 0x30);
+            }
+            continue;
+        case PA_CSISEP:
+            if (pdf->escpn +1 < DIM (pdf->escpars)) {
+                pdf->escpn++;
+            } else {
                 pdf->escstate = ESC_BADCSI;
-                DISCARD;
             }
-            if (pdf->escpars[pdf->escpn] != ESC_PDEFAULT) {
+            continue;
+        case PA_CSIEND:
+        case PA_CSIINT:
+        case PA_CSIFIN:
+            if (prev != ESC_CSIINT && pdf->escpars[pdf->escpn] != ESC_PDEFAULT) {
                 pdf->escpn++;
             }
-            pdf->escstate = ESC_CSIINT;
-        case ESC_CSIINT:
-            if (ch7 >= 0x20 && ch7 <= 0x2F) {
+            if (PX_ACTION (t) == PA_CSIINT) {
                 if (pdf->escin < DIM (pdf->escints)) {
-                    pdf->escints[pdf->escin++] = ch7;
+                    pdf->escints[pdf->escin++] = (char) ch7;
                 } else {
                     pdf->escstate = ESC_BADCSI;
                 }
-                DISCARD;
             }
-            if (ch7 >= 0x40 && ch7 <= 0x7E) {
-                /* Execute CSI */
-#if 0
-                if (ch7 == 'z' && !pdf->escints && !pdf->escprv) {
-                    unsigned int p0 = pdf->escpars[0];
+            /* Execute CSI: no control sequences are implemented */
+            continue;
+
+        default:
+            continue;
+        }
 
-                    if (p0 == ESC_PDEFAULT) {
-                        p0 = 1;
-                    }
-                    if (p0 == 1) {
-                        p0 = 6;
-                    } else if (p0 == 2) {
-                        p0 = 8;
-                    } else {
-                        DISCARD;
-                    }
-                    /* Change lpi */
-                    DISCARD;
-                }
-#endif
-                DISCARD;
-            }
-            STORE;
-        case ESC_BADCSI:
-            if (ch7 >= 0x40 && ch7 <= 0x7E) {
-                pdf->escstate = ESC_IDLE;
-                DISCARD;
-            }
-            DISCARD;
-        case ESC_BADESC:
-            if (ch7 >= 0x30 && ch7 <= 0x7E) {
-                pdf->escstate = ESC_IDLE;
-                DISCARD;
-            }
-            DISCARD;
-        case ESC_BADSTR:
-            DISCARD;
-        default: /* Invalid state */
-            DISCARD;
-        }
-
-        /* Ordinary character, more or less */
-#undef STORE
-#undef DISCARD
-
-        chi -= 0x20;
-        if (pdf->ssg) {                         /* SS applies to left or right input */
-            ch = pdf->ssg->chrset[chi];
-            pdf->ssg = NULL;
-        } else if (ch >= 0x20 && ch <= 0x7F) {  /* Left? */
-            ch = pdf->gl->chrset[chi];
-        } else if (ch >= 0xA0 && ch <= 0xFF) {  /* Redundant test, must be a (right) graphic */
-            ch = pdf->gr->chrset[chi];
-        }
-
-     store:
         initial = 0;
-        wrstw (pdf, PARSEBUF, &ch, 1);
+        wrstw (pdf, PARSEBUF, &u, 1);
     }
     return ffseen;
 }
 
-/* SCS - Designate a character set */
+/* Length of the run of printable ASCII (0x20 - 0x7E) at the start of a string
+ */
+
+static size_t scanprint (const char *string, size_t length) {
+    const unsigned char *s = (const unsigned char *) string;
+    size_t n = 0;
+
+#if defined (__AVX2__)
+    const __m256i lo = _mm256_set1_epi8 (0x1F), hi = _mm256_set1_epi8 (0x7F);
+
+    /* Signed compares: 8-bit characters are negative */
+
+    for (; n + 32 <= length; n += 32) {
+        __m256i v = _mm256_loadu_si256 ((const __m256i *) (s + n));
+        unsigned int m = (unsigned int)
+            _mm256_movemask_epi8 (_mm256_and_si256 (_mm256_cmpgt_epi8 (v, lo),
+                                                    _mm256_cmpgt_epi8 (hi, v)));
+        if (m != 0xFFFFFFFFu) {
+            return n + __builtin_ctz (~m);
+        }
+    }
+#elif defined (USE_SSE2)
+    const __m128i lo = _mm_set1_epi8 (0x1F), hi = _mm_set1_epi8 (0x7F);
+
+    for (; n + 16 <= length; n += 16) {
+        __m128i v = _mm_loadu_si128 ((const __m128i *) (s + n));
+        unsigned int m = (unsigned int)
+            _mm_movemask_epi8 (_mm_and_si128 (_mm_cmpgt_epi8 (v, lo),
+                                              _mm_cmplt_epi8 (v, hi)));
+        if (m != 0xFFFF) {
+#ifdef __GNUC__
+            return n + __builtin_ctz (~m);
+#else
+            break;
+#endif
+        }
+    }
+#else
+    /* Eight at a time: the high bit of a byte is set by a borrow
+     * if it is below 0x20, or by a carry if it is above 0x7E.
+     */
+    for (; n + 8 <= length; n += 8) {
+        uint64_t w;
+
+        memcpy (&w, s + n, 8);
+        if (((w - 0x2020202020202020ull) | (w + 0x0101010101010101ull) | w) &
+            0x8080808080808080ull) {
+            break;
+        }
+    }
+#endif
+    while (n < length && s[n] >= 0x20 && s[n] <= 0x7E) {
+        n++;
+    }
+    return n;
+}
+
+/* Store a run of printable ASCII in the parse buffer, translated thru GL.
+ * ASCII in GL is just widened.
+ */
+
+static void storeprint (PDF *pdf, const char *string, size_t length) {
+    const unsigned char *s = (const unsigned char *) string;
+    short *d;
+    size_t n = 0;
+
+    if (pdf->parseused + length +1 > pdf->parsesize) {
+        pdf->parsebuf = (short *) growbuf (pdf, pdf->parsebuf, &pdf->parsesize,
+                                           pdf->parseused + length +1, sizeof (short));
+    }
+    d = pdf->parsebuf + pdf->parseused;
+    pdf->parseused += length;
+
+    if (pdf->gl != CHS_ASCII) {
+        for (; n < length; n++) {
+            d[n] = pdf->xlat[s[n]];
+        }
+        return;
+    }
+#if defined (__AVX2__)
+    for (; n + 16 <= length; n += 16) {
+        __m128i v = _mm_loadu_si128 ((const __m128i *) (s + n));
+
+        _mm256_storeu_si256 ((__m256i *) (d + n), _mm256_cvtepu8_epi16 (v));
+    }
+#elif defined (USE_SSE2)
+    for (; n + 16 <= length; n += 16) {
+        __m128i v = _mm_loadu_si128 ((const __m128i *) (s + n));
+        __m128i z = _mm_setzero_si128 ();
+
+        _mm_storeu_si128 ((__m128i *) (d + n), _mm_unpacklo_epi8 (v, z));
+        _mm_storeu_si128 ((__m128i *) (d + n + 8), _mm_unpackhi_epi8 (v, z));
+    }
+#endif
+    for (; n < length; n++) {
+        d[n] = s[n];
+    }
+    return;
+}
+
+/* SCS - Designate a character set
+ * A set that is invoked in GL or GR takes effect immediately.
+ */
 
 static void designateChs (PDF *pdf, const int set, const uint16_t size,
                           const uint16_t nint, const char *ints, const char final ) {
@@ -4248,18 +7202,58 @@ static void designateChs (PDF *pdf, const int set, const uint16_t size,
                     break;
                 }
             }
-            if (j >= nint) {
+            if (j < nint) {
                 continue;
             }
         }
         pdf->gset[set] = charsets + i;
+        if (pdf->glset == (unsigned int) set) {
+            pdf->gl = pdf->gset[set];
+        }
+        if (pdf->grset == (unsigned int) set) {
+            pdf->gr = pdf->gset[set];
+        }
+        setxlat (pdf);
         return;
     }
     return;
 }
 
+/* Locking shift - invoke a character set into GL or GR */
+
+static void invokeChs (PDF *pdf, const int right, const unsigned int set) {
+    if (right) {
+        pdf->grset = set;
+        pdf->gr = pdf->gset[set];
+    } else {
+        pdf->glset = set;
+        pdf->gl = pdf->gset[set];
+    }
+    setxlat (pdf);
+    return;
+}
+
+/* Build the table that translates graphic bytes thru GL and GR to Unicode.
+ * Controls translate to themselves, but are never looked up.
+ */
+
+static void setxlat (PDF *pdf) {
+    unsigned int c;
+
+    for (c = 0; c < 0x20; c++) {
+        pdf->xlat[c] = (short) c;
+        pdf->xlat[c + 0x80] = (short) (c + 0x80);
+    }
+    for (c = 0; c < 96; c++) {
+        pdf->xlat[c + 0x20] = pdf->gl->chrset[c];
+        pdf->xlat[c + 0xA0] = pdf->gr->chrset[c];
+    }
+    return;
+}
+
 /* Formatted output to an expandable buffer stream.
  * Enables compression.
+ * Plain %u and %f use the number writers below.
  */
 
 static void wrstmf (PDF *pdf, char **buf, size_t *len, size_t *used, const char *fmt, ...) {
@@ -4298,11 +7292,19 @@ static void wrstmf (PDF *pdf, char **buf, size_t *len, size_t *used, const char
             case 'u':
             case 'x':
                 i = va_arg (ap, unsigned int);
-                p += sprintf (tbuf, fbuf, i);
+                if (c == 'u' && f == fbuf + 3) {
+                    p = fmtu (p, i);
+                } else {
+                    p += sprintf (tbuf, fbuf, i);
+                }
                 continue;
             case'f':
                 d = va_arg (ap, double);
-                p += sprintf (tbuf, fbuf, d);
+                if (f == fbuf + 3) {
+                    p = fmtf (p, d, 6);
+                } else {
+                    p += sprintf (tbuf, fbuf, d);
+                }
                 continue;
             case 's':
                 wrstm (pdf, buf, len, used, va_arg (ap, char *), PDF_USE_STRLEN);
@@ -4321,6 +7323,86 @@ static void wrstmf (PDF *pdf, char **buf, size_t *len, size_t *used, const char
     return;
 }
 
+/* Number writers for streams and metadata.
+ * These replace sprintf where numbers are written often.  No format is
+ * parsed, and the locale is not consulted: PDF requires a '.'.
+ * Each writes at p, which must have room, and returns the end.
+ */
+
+static char *fmts (char *p, const char *string, size_t length) {
+    memcpy (p, string, length);
+    return p + length;
+}
+
+static char *fmtu (char *p, uint64_t v) {
+    char t[20], *q = t + sizeof (t);
+
+    do {
+        *--q = (char) ('0' + (v % 10));
+        v /= 10;
+    } while (v);
+    return fmts (p, q, (size_t) (t + sizeof (t) - q));
+}
+
+/* Unsigned, zero-filled to width */
+
+static char *fmtz (char *p, uint64_t v, unsigned int width) {
+    char t[20];
+    size_t n = (size_t) (fmtu (t, v) - t);
+
+    if (n < width) {
+        memset (p, '0', width - n);
+        p += width - n;
+    }
+    return fmts (p, t, n);
+}
+
+/* Fixed point with prec decimals, rounded as %.*f.
+ * The fraction is scaled in floating point, which only rounds the
+ * product.  When that makes it look like a tie, the product's exact
+ * error (Dekker) decides, and a true tie rounds to even.
+ * Numbers too large for this are left to sprintf.
+ */
+
+static char *fmtf (char *p, double d, unsigned int prec) {
+    static const double scale[] = { 1, 10, 100, 1000, 10000, 100000, 1000000 };
+    uint64_t ip, n;
+    double fr, x, f, hi, e;
+
+    if (!(d > -1e9 && d < 1e9) || prec >= DIM (scale)) {
+        return p + sprintf (p, "%.*f", (int) prec, d);
+    }
+    if (d < 0 || (d == 0 && 1 / d < 0)) {   /* Including -0 */
+        *p++ = '-';
+        d = -d;
+    }
+    ip = (uint64_t) d;
+    fr = d - (double) ip;
+    x = fr * scale[prec];
+    n = (uint64_t) x;
+    f = x - (double) n;
+    if (f == 0.5) {
+        hi = fr * 134217729.0;
+        hi -= hi - fr;
+        e = (hi * scale[prec] - x) + (fr - hi) * scale[prec];
+        if (e > 0 || (e == 0 && ((prec? n: ip) & 1))) {
+            n++;
+        }
+    } else if (f > 0.5) {
+        n++;
+    }
+    if (n >= (uint64_t) scale[prec]) {
+        n -= (uint64_t) scale[prec];
+        ip++;
+    }
+    p = fmtu (p, ip);
+    if (prec) {
+        *p++ = '.';
+        p = fmtz (p, n, prec);
+    }
+    return p;
+}
+
 /* Write a string to an expandable buffer.
  */
 
@@ -4329,37 +7411,158 @@ static void wrstm (PDF *pdf, char **buf, size_t *bufsize, size_t *used, char *st
         length = strlen (string);
     }
 
-    if (*used + length +1 > *bufsize) {
-        char *p = (char *) realloc (*buf, *used + length + 1 + 256);
-        if (!p) {
-            free (*buf);
-            ABORT (errno);
+    if (*used + length +1 > *bufsize) {
+        *buf = (char *) growbuf (pdf, *buf, bufsize, *used + length +1, sizeof (char));
+    }
+    memcpy (*buf + *used, string, length);
+    *used += length;
+
+    return;
+}
+
+/* Write a wide string to an expandable buffer.
+ */
+
+static void wrstw (PDF *pdf, short **buf, size_t *bufsize, size_t *used, short *string, size_t length) {
+    if (*used + length +1 > *bufsize) {
+        *buf = (short *) growbuf (pdf, *buf, bufsize, *used + length +1, sizeof (short));
+    }
+    memcpy (*buf + *used, string, length *2);
+    *used += length;
+
+    return;
+}
+
+/* Buffer management
+ *
+ * Expandable buffers double in size, so filling one is linear.  A new
+ * buffer is taken from a pool of buffers released by closed handles, so
+ * a converter that writes a file per job reuses its page, parse and line
+ * buffers rather than growing new ones.  Buffers that an outlier page
+ * grew are trimmed back, and are not pooled, so memory stays stable.
+ */
+
+#define BUF_MINSIZE (256)           /* Smallest allocation (elements) */
+#define BUF_TRIM    (4)             /* Trim if this many times the need */
+#define POOL_BUFS   (256)           /* Buffers kept in the pool */
+#define POOL_MAXBUF (1024 * 1024)   /* Largest buffer kept (bytes) */
+
+static struct {
+    void *buf;
+    size_t size;                    /* Bytes */
+} pool[POOL_BUFS];
+static unsigned int pooled;
+
+#ifdef USE_THREADS
+static pthread_mutex_t poollock = PTHREAD_MUTEX_INITIALIZER;
+#define POOL_LOCK   pthread_mutex_lock (&poollock)
+#define POOL_UNLOCK pthread_mutex_unlock (&poollock)
+#else
+#define POOL_LOCK
+#define POOL_UNLOCK
+#endif
+
+/* Grow a buffer to hold at least need elements of elsize bytes.
+ * size is in elements.  Returns the new buffer.
+ */
+
+static void *growbuf (PDF *pdf, void *buf, size_t *size, size_t need, size_t elsize) {
+    size_t n;
+    void *p;
+
+    if (!buf) {
+        size_t bytes;
+
+        if ((p = pool_get (need * elsize, &bytes)) != NULL) {
+            *size = bytes / elsize;
+            return p;
+        }
+        *size = 0;
+    }
+    n = *size * 2;
+    if (n < need) {
+        n = need;
+    }
+    if (n < BUF_MINSIZE) {
+        n = BUF_MINSIZE;
+    }
+    if (!(p = realloc (buf, n * elsize))) {
+        ABORT (errno);
+    }
+    *size = n;
+    return p;
+}
+
+/* After a page is written, trim its buffers if an outlier page grew
+ * them well beyond the recent high-water mark.  The mark decays, so a
+ * run of large pages raises it and a return to normal lowers it.
+ */
+
+static void trimpage (PDF *pdf, char **pagebuf, size_t *pbsize, size_t pbused,
+                      char **lzwbuf, size_t *lzwsize) {
+    size_t keep;
+    char *p;
+
+    pdf->pbmark -= pdf->pbmark / 16;
+    if (pbused > pdf->pbmark) {
+        pdf->pbmark = pbused;
+    }
+    keep = 2 * pdf->pbmark;
+    if (keep < BUF_MINSIZE) {
+        keep = BUF_MINSIZE;
+    }
+    if (*pbsize > BUF_TRIM * keep && (p = (char *) realloc (*pagebuf, keep)) != NULL) {
+        *pagebuf = p;
+        *pbsize = keep;
+    }
+    if (*lzwsize > BUF_TRIM * keep && (p = (char *) realloc (*lzwbuf, keep)) != NULL) {
+        *lzwbuf = p;
+        *lzwsize = keep;
+    }
+    return;
+}
+
+/* Take the smallest pooled buffer of at least min bytes.
+ * Returns NULL if there is none.
+ */
+
+static void *pool_get (size_t min, size_t *size) {
+    unsigned int i, best = POOL_BUFS;
+    void *buf = NULL;
+
+    POOL_LOCK;
+    for (i = 0; i < pooled; i++) {
+        if (pool[i].size >= min &&
+            (best == POOL_BUFS || pool[i].size < pool[best].size)) {
+            best = i;
         }
-        *buf = p;
-        *bufsize = *used + length +1 + 256;
     }
-    memcpy (*buf + *used, string, length);
-    *used += length;
+    if (best != POOL_BUFS) {
+        buf = pool[best].buf;
+        *size = pool[best].size;
+        pool[best] = pool[--pooled];
+    }
+    POOL_UNLOCK;
 
-    return;
+    return buf;
 }
 
-/* Write a wide string to an expandable buffer.
+/* Return a buffer of size bytes to the pool, or free it.
  */
 
-static void wrstw (PDF *pdf, short **buf, size_t *bufsize, size_t *used, short *string, size_t length) {
-    if (*used + length +1 > *bufsize) {
-        short *p = (short *) realloc (*buf, (*used + length + 1 + 256) * sizeof (short));
-        if (!p) {
-            free (*buf);
-            ABORT (errno);
-        }
-        *buf = p;
-        *bufsize = *used + length +1 + 256;
+static void pool_put (void *buf, size_t size) {
+    if (!buf) {
+        return;
     }
-    memcpy (*buf + *used, string, length *2);
-    *used += length;
+    POOL_LOCK;
+    if (size <= POOL_MAXBUF && pooled < POOL_BUFS) {
+        pool[pooled].buf = buf;
+        pool[pooled++].size = size;
+        buf = NULL;
+    }
+    POOL_UNLOCK;
 
+    free (buf);
     return;
 }
 
@@ -4372,27 +7575,25 @@ static void wrstw (PDF *pdf, short **buf, size_t *bufsize, size_t *used, short *
 
 static t_fpos readobj (PDF *pdf, unsigned int obj, char **buf, size_t *len) {
     unsigned int o;
-    char lbuf[512];
-    char *p = lbuf;
-    size_t used;
+    const char *p, *l, *data;
+    size_t n;
     t_fpos pos;
-    size_t lines = 0;
 
     if (!*buf) {
         *len = 0;
     }
-    if (obj > pdf->obj) {
+    if (!obj || obj > pdf->obj || (pos = pdf->xref[obj-1]) >= (t_fpos) pdf->vsize) {
         free (*buf);
         ABORT (E(NO_APPEND));
     }
-    fseek (pdf->pdf, (pos = pdf->xref[obj-1]), SEEK_SET);
-    if (!fgets (lbuf, sizeof (lbuf), pdf->pdf)) {
+    p = pdf->view + pos;
+    if (!(l = vline (pdf, p))) {
         free (*buf);
         ABORT (E(NO_APPEND));
     }
 
     o = 0;
-    while (*p && isdigit (*p)) {
+    while (isdigit (*p)) {
         o = (o * 10) + *p++ - '0';
     }
     if (o != obj || *p++ != ' ') {
@@ -4400,166 +7601,709 @@ static t_fpos readobj (PDF *pdf, unsigned int obj, char **buf, size_t *len) {
         ABORT (E(NO_APPEND));
     }
     o = 0;
-    while (*p && isdigit (*p)) {
+    while (isdigit (*p)) {
         o = (o * 10) + *p++ - '0';
     }
-    if (o != 0 || *p++ != ' ' || strcmp (p, "obj\n")) {
+    if (o != 0 || *p++ != ' ' || l - p != 4 || memcmp (p, "obj\n", 4)) {
         free (*buf);
         ABORT (E(NO_APPEND));
     }
-    used = 0;
-    do {
-        size_t ll;
 
-        if (!fgets (lbuf, sizeof (lbuf), pdf->pdf)) {
+    /* The data runs to the endobj line */
+
+    for (data = p = l; ; p = l) {
+        if (!(l = vline (pdf, p))) {
             free (*buf);
             ABORT (E(NO_APPEND));
         }
-        if (!strcmp (lbuf, "endobj\n")) {
+        if (l - p == 7 && !memcmp (p, "endobj\n", 7)) {
             break;
         }
-        ll = strlen (lbuf);
-        if (!*buf || *len < used + ll +1) {
-            p = (char *) realloc (*buf, used + ll +1);
-            if (!p) {
-                free (*buf);
-                ABORT (errno);
-            }
-            *buf = p;
-            *len = used + ll +1;
+    }
+    n = p - data;
+    if (!*buf || *len < n +1) {
+        char *nb;
+
+        if (!(nb = (char *) realloc (*buf, n +1))) {
+            free (*buf);
+            ABORT (errno);
         }
-        strcpy (*buf + used, lbuf);
-        used += ll;
-        lines++;
-    } while (1);
+        *buf = nb;
+        *len = n +1;
+    }
+    memcpy (*buf, data, n);
+    (*buf)[n] = '\0';
 
     return pos;
 }
 
+/* Size a page grid for rows lines of cols characters.
+ * Lines already in the grid are kept, at the same line number.
+ */
+
+static void gridsize (PDF *pdf, GRID *g, unsigned int rows, unsigned int cols) {
+    GRID n;
+    unsigned int l;
+
+    if (rows == g->rows && cols == g->cols) {
+        return;
+    }
+    memset (&n, 0, sizeof (n));
+    n.rows = rows;
+    n.cols = cols;
+    n.len = (unsigned int *) calloc (rows +1, sizeof (unsigned int));
+    n.wide = (short **) calloc (rows +1, sizeof (short *));
+    n.wsize = (size_t *) calloc (rows +1, sizeof (size_t));
+    if (!n.len || !n.wide || !n.wsize) {
+        gridfree (&n);
+        ABORT (errno);
+    }
+    n.cells = (uint8_t *) growbuf (pdf, NULL, &n.csize, (size_t) rows * cols, 1);
+
+    for (l = 0; l < rows && l < g->rows; l++) {
+        unsigned int r = GRID_ROW (g, l);
+        const uint8_t *b = g->cells + ((size_t) r * g->cols);
+
+        if (g->wide[r]) {
+            n.wide[l] = g->wide[r];
+            n.wsize[l] = g->wsize[r];
+            g->wide[r] = NULL;
+        } else if (g->len[r] > cols) {
+            unsigned int c;
+
+            n.wide[l] = (short *) growbuf (pdf, NULL, &n.wsize[l], g->len[r], sizeof (short));
+            for (c = 0; c < g->len[r]; c++) {
+                n.wide[l][c] = b[c];
+            }
+        } else {
+            memcpy (n.cells + ((size_t) l * cols), b, g->len[r]);
+        }
+        n.len[l] = g->len[r];
+    }
+    gridfree (g);
+    *g = n;
+
+    return;
+}
+
+/* Add text to line l (from 0) of a grid.
+ * The row is kept in the cells while it fits and is 8-bit; otherwise it
+ * is moved to a wide buffer of its own.
+ */
+
+static void gridadd (PDF *pdf, GRID *g, unsigned int l, const short *text, size_t textlen) {
+    unsigned int r = GRID_ROW (g, l);
+    size_t len = g->len[r] + textlen;
+    size_t i;
+
+    if (!g->wide[r]) {
+        uint8_t *b = g->cells + ((size_t) r * g->cols);
+
+        if (len <= g->cols) {
+            for (i = 0; i < textlen && !(text[i] & ~0xFF); i++) {
+                b[g->len[r] + i] = (uint8_t) text[i];
+            }
+            if (i == textlen) {
+                g->len[r] = (unsigned int) len;
+                return;
+            }
+        }
+        g->wide[r] = (short *) growbuf (pdf, NULL, &g->wsize[r],
+                                        (len < 2 * g->cols)? 2 * g->cols: len, sizeof (short));
+        for (i = 0; i < g->len[r]; i++) {
+            g->wide[r][i] = b[i];
+        }
+    } else if (len > g->wsize[r]) {
+        g->wide[r] = (short *) growbuf (pdf, g->wide[r], &g->wsize[r], len, sizeof (short));
+    }
+    memcpy (g->wide[r] + g->len[r], text, textlen * sizeof (short));
+    g->len[r] = (unsigned int) len;
+
+    return;
+}
+
+/* Empty physical row r of a grid.
+ * A wide row's buffer is released.
+ */
+
+static void gridclear (GRID *g, unsigned int r) {
+    g->len[r] = 0;
+    if (g->wide[r]) {
+        pool_put (g->wide[r], g->wsize[r] * sizeof (short));
+        g->wide[r] = NULL;
+        g->wsize[r] = 0;
+    }
+    return;
+}
+
+/* Release a grid's memory
+ */
+
+static void gridfree (GRID *g) {
+    unsigned int r;
+
+    if (g->wide) {
+        for (r = 0; r < g->rows; r++) {
+            pool_put (g->wide[r], g->wsize[r] * sizeof (short));
+        }
+    }
+    pool_put (g->cells, g->csize);
+    free (g->len);
+    free (g->wide);
+    free (g->wsize);
+    memset (g, 0, sizeof (*g));
+
+    return;
+}
+
 /* Add text to a line
- * Allocates/resizes line buffer.
+ * The grid is sized for a page, including the TOF offset.
  * Note that lines > lpp are legal (caused by TOF offset)
  */
 
 static void add2line (PDF *pdf, const short *text, size_t textlen) {
     unsigned int line = pdf->line;
-    size_t linelen;
 
-    if (line <= 0) {
+    gridsize (pdf, &pdf->grid, pdf->lpp + pdf->p.tof, pdf->p.cols);
+
+    if (line <= 0 || line > pdf->grid.rows) {
         ABORT (E(BUGCHECK));
     }
-
     if (line > pdf->nlines) {
-        short **p = (short **) realloc (pdf->lines, (line +1) * sizeof (short *));
-        unsigned int *s;
-        unsigned int i;
+        pdf->nlines = line;
+    }
+    gridadd (pdf, &pdf->grid, line -1, text, textlen);
 
-        if (!p) {
-            ABORT( errno );
+    return;
+}
+
+/* Draw a circle of radius r
+ */
+
+static void circle (PDF *pdf, double x, double y, double r) {
+    double k = CircleK * r;
+    const double pts[] = {
+        x-r, y,
+        x-r, y+k, x-k, y+r, x, y+r,  /* TL quadrant */
+        x+k, y+r, x+r, y+k, x+r, y,  /* TR */
+        x+r, y-k, x+k, y-r, x, y-r,  /* BR */
+        x-k, y-r, x-r, y-k, x-r, y}; /* BL */
+    char buf[1024], *p = buf;
+    unsigned int i;
+
+    for (i = 0; i < DIM (pts); i++) {
+        *p++ = ' ';
+        p = fmtf (p, pts[i], 6);
+        if (i == 1) {
+            p = fmts (p, QS(" m"));
+        } else if (i % 6 == 1) {
+            p = fmts (p, QS(" c"));
+        }
+    }
+    wrstm (pdf, FORMBUF, buf, (size_t) (p - buf));
+    return;
+
+}
+
+/* strcasecmp
+ *
+ * Not available everywhere, easier to replace...
+ */
+
+static int xstrcasecmp (const char *s1, const char *s2) {
+
+    while (*s1 && *s2) {
+        if (*s1 != *s2 && tolower (*s1) != tolower (*s2)) {
+            break;
+        }
+        s1++;
+        s2++;
+    }
+    if (!*s1 && !*s2) {
+        return 0;
+    }
+    return tolower (*s1) - tolower (*s2);
+}
+
+/* Encode a stream into the LZW buffer with the selected codec.
+ * LZW is the default; it is cheap and tests show it compressing LPT
+ * output 5:1.  Deflate does better, at more cost.  AUTO encodes both
+ * and keeps the smaller, which is decided per stream.
+ *
+ * If the compression fails (unlikely, but possible, with worst-case
+ * expansion of 1.125 - 1.5), returns PDF_CODEC_NONE to cause the text
+ * to be written instead.  Otherwise returns the codec used.
+ */
+
+static int encstm (PDF *pdf, char *stream, size_t len) {
+    t_lzw lzw;
+    int codec = pdf->p.codec;
+
+    if ((pdf->flags & PDF_UNCOMPRESSED) || codec == PDF_CODEC_NONE) {
+        return PDF_CODEC_NONE;
+    }
+
+    pdf->lzwused = 0;
+    if (codec == PDF_CODEC_FLATE) {
+        deflate (pdf, stream, len, LZWBUF);
+    } else {
+        lzw_init (&lzw, LZW_BUFFER, LZWBUF);
+        lzw_encode (&lzw, stream, len);
+    }
+    if (codec == PDF_CODEC_AUTO) {
+        pdf->cused = 0;
+        deflate (pdf, stream, len, CBUF);
+        if (pdf->cused < pdf->lzwused) {
+            char *t = pdf->lzwbuf;
+            size_t n = pdf->lzwsize;
+
+            pdf->lzwbuf  = pdf->cbuf;
+            pdf->lzwsize = pdf->csize;
+            pdf->lzwused = pdf->cused;
+            pdf->cbuf  = t;
+            pdf->csize = n;
+            codec = PDF_CODEC_FLATE;
+        } else {
+            codec = PDF_CODEC_LZW;
+        }
+    }
+
+#ifdef ERRDEBUG
+    return PDF_CODEC_NONE;
+#endif
+    if (pdf->lzwused >= len) {
+        return PDF_CODEC_NONE;
+    }
+    return codec;
+}
+
+/* ******************* Page pipeline ******************* */
+
+#ifdef USE_THREADS
+/* When PDF_THREADS is set, completed pages are passed to worker threads.
+ * pdf_print's caller parses the following pages while PDF_THREADS workers
+ * each render and compress a page.  A writer thread assigns object numbers
+ * and writes the pages to the file in order.  Pages are independent, so a
+ * large listing is spread over as many cores as there are workers.
+ *
+ * The stages share a ring of slots, indexed by free-running counters that
+ * are only advanced by the stage that owns them.  Workers claim pages by
+ * advancing the claimed counter.  A stage that runs out of work sleeps on
+ * the doorbell, which is only rung if someone is asleep.
+ *
+ * While the pipeline runs, the writer owns the file, the xref, the
+ * object numbers and the page tree.  pipe_stop waits for it to finish and takes them back,
+ * so it must be called before anything else is written.
+ */
+
+#define PIPE_SLOTS (8)      /* Minimum slots; at least 2 per worker */
+
+typedef struct {
+    unsigned int n;         /* Lines in this page */
+    GRID grid;              /* Page text, exchanged with the PDF's */
+    char *pagebuf;          /* Rendered page */
+    size_t pbsize;
+    size_t pbused;
+#define SLOTBUF &slot->pagebuf, &slot->pbsize, &slot->pbused
+    char *lzwbuf;           /* Compressed page */
+    size_t lzwsize;
+    size_t lzwused;
+    int codec;              /* Codec of lzwbuf's data */
+    PHKEY k;                /* Hash of pagebuf */
+    int ready;              /* Ready to write */
+} PSLOT;
+
+struct pipe {
+    PSLOT *slot;
+    unsigned int nslots;
+    unsigned int queued;    /* Pages queued by caller */
+    unsigned int claimed;   /* Pages claimed by workers */
+    unsigned int written;   /* Pages written */
+    unsigned int sleepers;  /* Threads waiting for the doorbell */
+    int stop;               /* Caller is done */
+    int error;              /* First error from a worker */
+    int running;
+    pthread_mutex_t lock;
+    pthread_cond_t doorbell;
+    unsigned int nworkers;  /* Workers started */
+    unsigned int nctx;      /* Worker contexts allocated */
+    pthread_t *workers;
+    PDF *wctx;              /* Worker contexts: ABORT target */
+    pthread_t writer;
+    PDF octx;               /* Writer context */
+};
+
+#define PIPE_GET(v)    __atomic_load_n (&(v), __ATOMIC_SEQ_CST)
+#define PIPE_SET(v, n) __atomic_store_n (&(v), (n), __ATOMIC_SEQ_CST)
+
+/* Wait for a condition, which is re-evaluated each time the doorbell rings */
+
+#define PIPE_WAIT(pp, cond) {                                           \
+    if (!(cond)) {                                                      \
+        pthread_mutex_lock (&(pp)->lock);                               \
+        __atomic_add_fetch (&(pp)->sleepers, 1, __ATOMIC_SEQ_CST);      \
+        while (!(cond)) {                                               \
+            pthread_cond_wait (&(pp)->doorbell, &(pp)->lock);           \
+        }                                                               \
+        __atomic_sub_fetch (&(pp)->sleepers, 1, __ATOMIC_SEQ_CST);      \
+        pthread_mutex_unlock (&(pp)->lock);                             \
+    } }
+
+static void pipe_ring (struct pipe *pp) {
+    if (PIPE_GET (pp->sleepers)) {
+        pthread_mutex_lock (&pp->lock);
+        pthread_cond_broadcast (&pp->doorbell);
+        pthread_mutex_unlock (&pp->lock);
+    }
+    return;
+}
+
+static void pipe_error (struct pipe *pp, int err) {
+    int none = 0;
+
+    (void) __atomic_compare_exchange_n (&pp->error, &none, err, 0,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    pipe_ring (pp);
+    return;
+}
+
+/* Start the pipeline for a session, if not running.
+ * Returns 0 if threads can't be used; pages are then written directly.
+ */
+
+static int pipe_start (PDF *pdf) {
+    struct pipe *pp = pdf->pipe;
+    unsigned int n = pdf->p.threads, ns, i;
+
+    if (pp && pp->running) {
+        return 1;
+    }
+    if (!pp) {
+        if (!(pp = (struct pipe *) calloc (1, sizeof (struct pipe)))) {
+            return 0;
+        }
+        pthread_mutex_init (&pp->lock, NULL);
+        pthread_cond_init (&pp->doorbell, NULL);
+        pdf->pipe = pp;
+    }
+
+    /* Slots are only added.  The ring is empty, so the size can change. */
+
+    ns = (2 * n > PIPE_SLOTS)? 2 * n: PIPE_SLOTS;
+    if (ns > pp->nslots) {
+        PSLOT *sp = (PSLOT *) realloc (pp->slot, ns * sizeof (PSLOT));
+
+        if (!sp) {
+            return 0;
+        }
+        memset (sp + pp->nslots, 0, (ns - pp->nslots) * sizeof (PSLOT));
+        pp->slot = sp;
+        pp->nslots = ns;
+    }
+    if (n > pp->nctx) {
+        pthread_t *tp = (pthread_t *) realloc (pp->workers, n * sizeof (pthread_t));
+        PDF *cp;
+
+        if (!tp) {
+            return 0;
+        }
+        pp->workers = tp;
+        if (!(cp = (PDF *) realloc (pp->wctx, n * sizeof (PDF)))) {
+            return 0;
+        }
+        pp->wctx = cp;
+        pp->nctx = n;
+    }
+
+    pp->queued =
+        pp->claimed =
+        pp->written = 0;
+    pp->stop =
+        pp->error = 0;
+
+    /* Parameters are locked while printing, so the threads use copies */
+
+    memcpy (&pp->octx, pdf, sizeof (PDF));
+    pp->octx.errnum = 0;
+    if (pthread_create (&pp->writer, NULL, pipe_write, &pp->octx)) {
+        return 0;
+    }
+    for (i = 0; i < n; i++) {
+        memcpy (&pp->wctx[i], pdf, sizeof (PDF));
+        pp->wctx[i].cbuf = NULL;
+        pp->wctx[i].csize = 0;
+        if (pthread_create (&pp->workers[i], NULL, pipe_render, &pp->wctx[i])) {
+            break;
+        }
+    }
+    pp->nworkers = i;
+    pp->running = 1;
+
+    if (!i) {
+        (void) pipe_stop (pdf);
+        return 0;
+    }
+    return 1;
+}
+
+/* Queue the current page.
+ * Its grid is exchanged with that of a free slot.
+ */
+
+static void pipe_page (PDF *pdf) {
+    struct pipe *pp = pdf->pipe;
+    PSLOT *slot;
+    GRID t, *g;
+    unsigned int l;
+    int r;
+
+    PIPE_WAIT (pp, pp->queued - PIPE_GET (pp->written) < pp->nslots || PIPE_GET (pp->error));
+    if ((r = PIPE_GET (pp->error)) != 0) {
+        ABORT (r);
+    }
+
+    slot = &pp->slot[pp->queued % pp->nslots];
+    slot->n = (pdf->line < pdf->nlines)? pdf->line: pdf->nlines;
+
+    t = slot->grid;
+    slot->grid = pdf->grid;
+    pdf->grid = t;
+
+    /* Lines written below the page for the next one's TOF offset
+     * are moved back.  The slot's grid is empty, so its base is free.
+     */
+
+    g = &slot->grid;
+    gridsize (pdf, &pdf->grid, g->rows, g->cols);
+    pdf->grid.base = g->base;
+
+    for (l = pdf->lpp; l < g->rows; l++) {
+        unsigned int p = GRID_ROW (g, l);
+
+        if (!g->len[p]) {
+            continue;
+        }
+        pdf->grid.len[p] = g->len[p];
+        if ((pdf->grid.wide[p] = g->wide[p]) != NULL) {
+            pdf->grid.wsize[p] = g->wsize[p];
+            g->wide[p] = NULL;
+            g->wsize[p] = 0;
+        } else {
+            memcpy (pdf->grid.cells + ((size_t) p * g->cols),
+                    g->cells + ((size_t) p * g->cols), g->len[p]);
+        }
+        g->len[p] = 0;
+    }
+
+    PIPE_SET (pp->queued, pp->queued + 1);
+    pipe_ring (pp);
+    return;
+}
+
+/* Worker thread: render and compress pages */
+
+static void *pipe_render (void *arg) {
+    PDF *pdf = (PDF *) arg;
+    struct pipe *pp = pdf->pipe;
+    int r;
+
+    if ((r = setjmp (pdf->env)) != 0) {
+        pipe_error (pp, r);
+        free (pdf->cbuf);
+        return NULL;
+    }
+
+    for (;;) {
+        PSLOT *slot;
+        unsigned int c, obj;
+        int seen;
+
+        PIPE_WAIT (pp, PIPE_GET (pp->queued) != PIPE_GET (pp->claimed) ||
+                       PIPE_GET (pp->stop) || PIPE_GET (pp->error));
+        if (PIPE_GET (pp->error)) {
+            break;
+        }
+        c = PIPE_GET (pp->claimed);
+        if (c == PIPE_GET (pp->queued)) {
+            if (PIPE_GET (pp->stop)) {
+                break;
+            }
+            continue;
+        }
+        if (!__atomic_compare_exchange_n (&pp->claimed, &c, c + 1, 0,
+                                          __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+            continue;
+        }
+        slot = &pp->slot[c % pp->nslots];
+
+        slot->pbused = 0;
+        rdpage (pdf, SLOTBUF, &slot->grid, slot->n);
+
+        /* A page that the writer has already written is not compressed.
+         * The table belongs to the writer, which adds to it under the lock.
+         */
+
+        phkey (slot->pagebuf, slot->pbused, &slot->k);
+        pthread_mutex_lock (&pp->lock);
+        seen = phseen (&pp->octx.phtab, &slot->k);
+        pthread_mutex_unlock (&pp->lock);
+        obj = 0;
+        if (seen) {
+            phhash (slot->pagebuf, slot->pbused, &slot->k);
+            pthread_mutex_lock (&pp->lock);
+            obj = phfind (&pp->octx.phtab, &slot->k);
+            pthread_mutex_unlock (&pp->lock);
+        }
+        if (obj) {
+            slot->codec = PDF_CODEC_NONE;
+            PIPE_SET (slot->ready, 1);
+            pipe_ring (pp);
+            continue;
+        }
+
+        pdf->lzwbuf = slot->lzwbuf;
+        pdf->lzwsize = slot->lzwsize;
+        slot->codec = cpcontent (pdf, slot->pagebuf, slot->pbused);
+        slot->lzwbuf = pdf->lzwbuf;
+        slot->lzwsize = pdf->lzwsize;
+        slot->lzwused = pdf->lzwused;
+        pdf->lzwbuf = NULL;
+
+        PIPE_SET (slot->ready, 1);
+        pipe_ring (pp);
+    }
+    free (pdf->cbuf);
+    return NULL;
+}
+
+/* Writer thread: write pages in order */
+
+static void *pipe_write (void *arg) {
+    PDF *pdf = (PDF *) arg;
+    struct pipe *pp = pdf->pipe;
+    unsigned int obj;
+    int r;
+
+    if ((r = setjmp (pdf->env)) != 0) {
+        pipe_error (pp, r);
+        return NULL;
+    }
+
+    for (;;) {
+        PSLOT *slot = &pp->slot[pp->written % pp->nslots];
+
+        PIPE_WAIT (pp, PIPE_GET (slot->ready) || PIPE_GET (pp->error) ||
+                       (PIPE_GET (pp->stop) && PIPE_GET (pp->queued) == pp->written));
+        if (PIPE_GET (pp->error) || !PIPE_GET (slot->ready)) {
+            break;
         }
-        pdf->lines = p;
 
-        s = (unsigned int *) realloc (pdf->linesize, (line +1) * sizeof (unsigned int *));
-        if (!s) {
-            ABORT( errno );
+        /* Pages are written in order, so a duplicate's first copy is
+         * always in the table, even if its worker didn't find it.
+         */
+
+        if ((obj = phlookup (&pdf->phtab, &slot->k, slot->pagebuf, slot->pbused)) == 0) {
+            obj = addobj (pdf);
+            wrcontent (pdf, obj, "", slot->pagebuf, slot->pbused,
+                       slot->codec, slot->lzwbuf, slot->lzwused);
+            if (pdf->errnum) {
+                pipe_error (pp, pdf->errnum);
+                break;
+            }
+            pthread_mutex_lock (&pp->lock);
+            phadd (&pdf->phtab, &slot->k, obj);
+            pthread_mutex_unlock (&pp->lock);
         }
-        pdf->linesize = s;
-
-        s = (unsigned int *) realloc (pdf->linelen, (line +1) * sizeof (unsigned int *));
-        if (!s) {
-            ABORT( errno );
+        wrleaf (pdf, obj);
+        if (pdf->p.durability == PDF_SYNC_PAGE) {
+            osync (pdf);
         }
-        pdf->linelen = s;
+        trimpage (pdf, &slot->pagebuf, &slot->pbsize, slot->pbused,
+                  &slot->lzwbuf, &slot->lzwsize);
 
-        for (i = pdf->nlines; i < line; i++) {
-            pdf->lines[i] = NULL;
-            pdf->linelen[i] = 0;
-            pdf->linesize[i] = 0;
-        }
-        pdf->nlines = line;
+        PIPE_SET (slot->ready, 0);
+        PIPE_SET (pp->written, pp->written + 1);
+        pipe_ring (pp);
     }
+    return NULL;
+}
 
-    linelen = pdf->linelen[line-1] + textlen;
-    if (linelen +1 > pdf->linesize[line-1]) {
-        short *p;
-        p = (short *) realloc (pdf->lines[line-1], (linelen +1) * sizeof (short));
-        if (!p) {
-            ABORT( errno );
-        }
-        pdf->lines[line-1] = p;
-        pdf->linesize[line-1] = linelen;
+/* Stop the pipeline once all queued pages are written.
+ * Returns any error from the threads.
+ */
+
+static int pipe_stop (PDF *pdf) {
+    struct pipe *pp = pdf->pipe;
+    unsigned int i;
+    int r;
+
+    if (!pp || !pp->running) {
+        return PDF_OK;
     }
-    memcpy (pdf->lines[line-1] + pdf->linelen[line-1], text, textlen * sizeof (short));
 
-    pdf->linelen[line-1] = linelen;
-    pdf->lines[line-1][linelen] = '\0';
+    PIPE_SET (pp->stop, 1);
+    pipe_ring (pp);
 
-    return;
-}
+    for (i = 0; i < pp->nworkers; i++) {
+        pthread_join (pp->workers[i], NULL);
+    }
+    pthread_join (pp->writer, NULL);
+    pp->running = 0;
 
-/* Draw a circle of radius r
- */
+    /* Take back what the writer owned */
 
-static void circle (PDF *pdf, double x, double y, double r) {
-    double k = CircleK * r;
-    char buf[1024];
-    size_t len;
+    pdf->obj = pp->octx.obj;
+    pdf->xref = pp->octx.xref;
+    pdf->xsize = pp->octx.xsize;
+    pdf->pt = pp->octx.pt;
+    pdf->xmoved = pp->octx.xmoved;
+    pdf->xmsize = pp->octx.xmsize;
+    pdf->xmused = pp->octx.xmused;
+    pdf->phtab = pp->octx.phtab;
+    pdf->oused = pp->octx.oused;
+    pdf->opos = pp->octx.opos;
+    pdf->oalloc = pp->octx.oalloc;
+    pdf->oerr = pp->octx.oerr;
 
-    len = sprintf (buf, 
-        " %f %f m %f %f %f %f %f %f c %f %f %f %f %f %f c"
-        " %f %f %f %f %f %f c %f %f %f %f %f %f c", 
-        x-r, y,
-        x-r, y+k, x-k, y+r, x, y+r,  /* TL quadrant */
-        x+k, y+r, x+r, y+k, x+r, y,  /* TR */
-        x+r, y-k, x+k, y-r, x, y-r,  /* BR */
-        x-k, y-r, x-r, y-k, x-r, y); /* BL */
+    for (i = 0; i < pp->nslots; i++) {
+        pp->slot[i].ready = 0;
+    }
 
-    wrstm (pdf, FORMBUF, buf, len);
-    return;
+    r = pp->error;
+    pp->error = 0;
 
+    return r;
 }
 
-/* strcasecmp
- *
- * Not available everywhere, easier to replace...
- */
+/* Release the pipeline */
 
-static int xstrcasecmp (const char *s1, const char *s2) {
+static void pipe_free (PDF *pdf) {
+    struct pipe *pp = pdf->pipe;
+    unsigned int s;
 
-    while (*s1 && *s2) {
-        if (*s1 != *s2 && tolower (*s1) != tolower (*s2)) {
-            break;
-        }
-        s1++;
-        s2++;
-    }
-    if (!*s1 && !*s2) {
-        return 0;
+    if (!pp) {
+        return;
     }
-    return tolower (*s1) - tolower (*s2);
-}
-
-/* Encode a stream, currently LZW.
- * A reasonable trade-off - deflate is better compression, but much more
- * expensive to compute.  Tests show LZW compressing LPT output 5:1.
- *
- * If the compression fails (unlikely, but possible, with worst-case
- * expansion of 1.125 - 1.5), returns non-zero to cause the text to be
- * written instead.
- */
+    (void) pipe_stop (pdf);
 
-static int encstm (PDF *pdf, char *stream, size_t len) {
-    t_lzw lzw;
+    for (s = 0; s < pp->nslots; s++) {
+        PSLOT *slot = &pp->slot[s];
 
-    pdf->lzwused = 0;
-    lzw_init (&lzw, LZW_BUFFER, LZWBUF);
-    lzw_encode (&lzw, stream, len);
+        gridfree (&slot->grid);
+        pool_put (slot->pagebuf, slot->pbsize);
+        pool_put (slot->lzwbuf, slot->lzwsize);
+    }
+    free (pp->slot);
+    free (pp->workers);
+    free (pp->wctx);
+    pthread_mutex_destroy (&pp->lock);
+    pthread_cond_destroy (&pp->doorbell);
+    free (pp);
+    pdf->pipe = NULL;
 
-#ifdef ERRDEBUG
-    return 1;
-#endif
-    return pdf->lzwused >= len;
+    return;
 }
+#endif
 
 /* *********************** LZW *********************** */
 
@@ -4569,10 +8313,11 @@ static int encstm (PDF *pdf, char *stream, size_t len) {
 
 static void lzw_init(t_lzw *lzw, int mode, ...) {
     va_list ap;
-    unsigned int i;
 
     if (mode != LZW_REINIT) {
-        memset (lzw, 0, sizeof(*lzw));
+        lzw->fh = NULL;
+        lzw->bitbuf = 0;
+        lzw->nbits = 0;
         va_start (ap, mode);
         if (mode == LZW_FILE) {
             lzw->fh = va_arg (ap, FILE *);
@@ -4584,12 +8329,9 @@ static void lzw_init(t_lzw *lzw, int mode, ...) {
         va_end (ap);
     }
 
-    for (i = 0; i < LZW_IDCODES; i++) {
-        lzw->dict[i].prev =  TREE_NULL;
-        lzw->dict[i].first = TREE_NULL;
-        lzw->dict[i].next =  TREE_NULL;
-        lzw->dict[i].ch = i;
-    }
+    /* Identity codes are implicit; only strings are in the table */
+
+    memset (lzw->key, 0, sizeof (lzw->key));
 
     lzw->assigned = LZW_IDCODES-1;
     lzw->codesize = LZW_MINBITS;
@@ -4615,10 +8357,11 @@ static void lzw_encode (t_lzw *lzw, char *stream, size_t len) {
     len--;
     while (len--) {
         t_lzwCode nc;
+        unsigned int slot = 0;
 
         c = 0xff & *stream++;
 
-        nc = lzw_lookup_str (lzw, code, c);
+        nc = lzw_lookup_str (lzw, code, c, &slot);
 
         if (nc == TREE_NULL) {
             t_lzwCode tmp;
@@ -4628,7 +8371,7 @@ static void lzw_encode (t_lzw *lzw, char *stream, size_t len) {
             }
             lzw_writebits (lzw, code, lzw->codesize);
 
-            tmp = lzw_add_str (lzw, code, c);
+            tmp = lzw_add_str (lzw, slot, code, c);
             if (tmp == TREE_NULL) {
                 lzw_writebits (lzw, LZW_CLRCODE, lzw->codesize);
                 lzw_init (lzw, LZW_REINIT);
@@ -4644,86 +8387,748 @@ static void lzw_encode (t_lzw *lzw, char *stream, size_t len) {
         lzw->codesize++;
     }
     lzw_writebits (lzw, code, lzw->codesize);
+
+    /* The decoder adds a string when it reads the last code, which
+     * can widen the EOD code.
+     */
+    if (lzw->assigned + 1 == (1 << lzw->codesize) && lzw->codesize < LZW_MAXBITS) {
+        lzw->codesize++;
+    }
     lzw_writebits (lzw, LZW_EODCODE, lzw->codesize);
     lzw_flushbits(lzw);
 
     return;
 }
 
-/* Add a prefix string to the directory.
+/* Add a prefix string to the directory, at the free slot found by
+ * lzw_lookup_str.
  * Returns TREE_NULL if full, new code otherwise.
  */
-static t_lzwCode lzw_add_str (t_lzw *lzw, t_lzwCode code, char c) {
+static t_lzwCode lzw_add_str (t_lzw *lzw, unsigned int slot, t_lzwCode code, int c) {
     t_lzwCode nc = ++lzw->assigned;
 
     if (nc >= LZW_DSIZE) {
         return TREE_NULL;
     }
-    lzw->dict[nc].ch = c;
-    lzw->dict[nc].prev = code;
-    lzw->dict[nc].first = TREE_NULL;
-    lzw->dict[nc].next = lzw->dict[code].first;
-    lzw->dict[code].first = nc;
+    lzw->key[slot] = (((uint32_t)code << 8) | c) + 1;
+    lzw->code[slot] = nc;
 
     return nc;
 }
 
 /* Lookup a (prefix code, char) string in the directory.
- * Return its code, or TREE_NULL.
+ * Return its code, or TREE_NULL and the slot where it would go.
  */
-static t_lzwCode lzw_lookup_str (t_lzw *lzw, t_lzwCode code, char c) {
-    t_lzwCode nc;
+static t_lzwCode lzw_lookup_str (t_lzw *lzw, t_lzwCode code, int c, unsigned int *slot) {
+    uint32_t key = (((uint32_t)code << 8) | c) + 1;
+    unsigned int h = LZW_HASH (key);
 
-    for (nc = lzw->dict[code].first;
-        nc != TREE_NULL; nc = lzw->dict[nc].next) {
-        if (code == lzw->dict[nc].prev && c == lzw->dict[nc].ch)
-            return nc;
+    while (lzw->key[h]) {
+        if (lzw->key[h] == key) {
+            return lzw->code[h];
+        }
+        h = (h + 1) & (LZW_HSIZE -1);
     }
+    *slot = h;
 
     return TREE_NULL;
 }
 
 /* Pack and write a variable number of bits to the output file or buffer.
  * Packing is big-endian.
- * Bits that don't fill a byte are buffered.
+ * Bits accumulate until a 32-bit word can be written.
  */
 static void lzw_writebits (t_lzw *lzw, unsigned int bits,
                             unsigned int nbits) {
     lzw->bitbuf = (lzw->bitbuf << nbits) | (bits & ((1 << nbits)-1));
 
     nbits += lzw->nbits;
-    while (nbits >= 8) {
-        nbits -= 8;
+    if (nbits >= 32) {
+        nbits -= 32;
+        lzw_putword (lzw, (uint32_t)(lzw->bitbuf >> nbits), 4);
+    }
 
-        if (lzw->fh) {
-            fputc ((lzw->bitbuf >> nbits) & 0xFF, lzw->fh);
-        } else {
-            if (*lzw->outused >= *lzw->outsize) {
-                uint8_t *p;
+    lzw->nbits = nbits;
+}
 
-                p = (uint8_t *) realloc (*lzw->outbuf, *lzw->outsize + LZW_BUFALCQ);
-                if (!p) {
-                    exit (errno);
-                }
-                *lzw->outbuf = p;
-                *lzw->outsize += LZW_BUFALCQ;
-            }
-            (*lzw->outbuf)[*lzw->outused] = (lzw->bitbuf >> nbits) & 0xFF;
-            ++*lzw->outused;
-        }
+/* Write the high nbytes of a word to the output file or buffer.
+ * The buffer grows geometrically.
+ */
+static void lzw_putword (t_lzw *lzw, uint32_t word, unsigned int nbytes) {
+    uint8_t b[4], *p;
+    unsigned int i;
+
+    for (i = 0; i < nbytes; i++) {
+        b[i] = (uint8_t)(word >> (24 - (8 * i)));
+    }
+    if (lzw->fh) {
+        fwrite (b, nbytes, 1, lzw->fh);
+        return;
+    }
+    if (!*lzw->outbuf && (*lzw->outbuf = (uint8_t *) pool_get (LZW_BUFALCQ, lzw->outsize)) == NULL) {
+        *lzw->outsize = 0;
     }
+    if (*lzw->outused + nbytes > *lzw->outsize) {
+        size_t size = *lzw->outsize * 2;
 
-    lzw->nbits = nbits;
+        if (size < LZW_BUFALCQ) {
+            size = LZW_BUFALCQ;
+        }
+        p = (uint8_t *) realloc (*lzw->outbuf, size);
+        if (!p) {
+            exit (errno);
+        }
+        *lzw->outbuf = p;
+        *lzw->outsize = size;
+    }
+    p = *lzw->outbuf + *lzw->outused;
+    for (i = 0; i < nbytes; i++) {
+        p[i] = b[i];
+    }
+    *lzw->outused += nbytes;
 }
 
 /* Flush any buffered bits, padding unused bits with 0.
- * There can be at most 7, since more would have been
+ * There can be at most 31, since more would have been
  * written by lzw_writebits when they were added.
  */
 static void lzw_flushbits (t_lzw *lzw) {
-    if (lzw->nbits) {
-        lzw_writebits(lzw, 0, 8-lzw->nbits);
+    unsigned int nbytes = (lzw->nbits + 7) / 8;
+
+    if (nbytes) {
+        lzw_putword (lzw, (uint32_t)(lzw->bitbuf << (32 - lzw->nbits)), nbytes);
+    }
+    lzw->nbits = 0;
+}
+
+/* ********************** Deflate ********************** */
+
+/* Deflate (RFC 1951) in a zlib (RFC 1950) wrapper, for FlateDecode.
+ *
+ * The whole stream is in memory, so LZ77 matching uses hash chains over
+ * the input itself rather than a sliding window.  p.level selects how
+ * hard to look for matches, much as zlib's levels do.  Each block of
+ * symbols is written with dynamic Huffman codes, the fixed codes or
+ * stored, whichever is smallest.
+ */
+
+#define DF_WSIZE    (32768)             /* Window size */
+#define DF_WMASK    (DF_WSIZE -1)
+#define DF_MINMATCH (3)
+#define DF_MAXMATCH (258)
+#define DF_MAXDIST  (DF_WSIZE - DF_MAXMATCH - DF_MINMATCH -1)
+#define DF_HBITS    (14)                /* Hash table size */
+#define DF_HSIZE    (1 << DF_HBITS)
+#define DF_HASH(p)  ((((uint32_t)(p)[0] << 10) ^ ((uint32_t)(p)[1] << 5) ^ (p)[2]) & (DF_HSIZE -1))
+#define DF_BLOCK    (16384)             /* Symbols per block */
+#define DF_LCODES   (286)               /* Literal/length codes */
+#define DF_FCODES   (288)               /* Fixed literal/length codes, 2 unused */
+#define DF_DCODES   (30)                /* Distance codes */
+#define DF_BLCODES  (19)                /* Code length codes */
+#define DF_MAXBITS  (15)                /* Longest code */
+#define DF_MAXBLBITS (7)                /* Longest code length code */
+#define DF_MAXSTORED (65535)            /* Largest stored block */
+
+static const uint16_t df_lbase[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t df_lext[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t df_dbase[DF_DCODES] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577 };
+static const uint8_t df_dext[DF_DCODES] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+static const uint8_t df_blorder[DF_BLCODES] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+/* Match effort by level: chain length, length that ends the search,
+ * and whether to defer a match in case the next byte has a longer one.
+ */
+static const struct {
+    uint16_t chain;
+    uint16_t nice;
+    uint8_t  lazy;
+} df_levels[10] = {
+    {    0,   0, 0 },
+    {    4,   8, 0 }, {    8,  16, 0 }, {   32,  32, 0 },
+    {   16,  16, 1 }, {   32,  32, 1 }, {  128, 128, 1 },
+    {  256, 128, 1 }, { 1024, 258, 1 }, { 4096, 258, 1 } };
+
+typedef struct {
+    PDF          *pdf;                  /* ABORT target */
+    const uint8_t *in;                  /* Input */
+    size_t        len;
+    char        **outbuf;               /* Output buffer */
+    size_t       *outsize;
+    size_t       *outused;
+    uint64_t      bitbuf;               /* Bits pending output, LSB first */
+    unsigned int  nbits;
+    uint32_t     *head;                 /* Most recent position +1 by hash */
+    uint32_t     *prev;                 /* Previous position +1 with hash */
+    uint16_t     *lit;                  /* Literal or match length */
+    uint16_t     *dist;                 /* Match distance, 0 for literal */
+    unsigned int  nsym;                 /* Symbols in block */
+    size_t        bstart;               /* Input offset of block */
+    size_t        emitted;              /* Input covered by symbols */
+    uint8_t       lcode[DF_MAXMATCH +1];/* Length -> length code */
+    uint8_t       dcode[512];           /* Distance -> distance code */
+} t_deflate;
+
+/* Make room for n bytes of output */
+
+static void df_room (t_deflate *df, size_t n) {
+    PDF *pdf = df->pdf;
+
+    if (*df->outused + n > *df->outsize) {
+        size_t size = *df->outsize * 2;
+        char *p;
+
+        if (size < *df->outused + n + 256) {
+            size = *df->outused + n + 256;
+        }
+        if (!(p = (char *) realloc (*df->outbuf, size))) {
+            ABORT (errno);
+        }
+        *df->outbuf = p;
+        *df->outsize = size;
+    }
+}
+
+/* Pack bits, LSB first.  n is at most 16. */
+
+static void df_putbits (t_deflate *df, uint32_t bits, unsigned int n) {
+    df->bitbuf |= (uint64_t)bits << df->nbits;
+    df->nbits += n;
+    if (df->nbits >= 32) {
+        uint8_t *p;
+
+        df_room (df, 4);
+        p = (uint8_t *)*df->outbuf + *df->outused;
+        p[0] = (uint8_t) df->bitbuf;
+        p[1] = (uint8_t)(df->bitbuf >> 8);
+        p[2] = (uint8_t)(df->bitbuf >> 16);
+        p[3] = (uint8_t)(df->bitbuf >> 24);
+        *df->outused += 4;
+        df->bitbuf >>= 32;
+        df->nbits -= 32;
+    }
+}
+
+/* Flush pending bits to a byte boundary */
+
+static void df_align (t_deflate *df) {
+    df_room (df, 8);
+    while (df->nbits > 0) {
+        (*df->outbuf)[(*df->outused)++] = (char)(df->bitbuf & 0xFF);
+        df->bitbuf >>= 8;
+        df->nbits = (df->nbits > 8)? df->nbits - 8: 0;
+    }
+    df->bitbuf = 0;
+}
+
+/* Compute length-limited Huffman code lengths.
+ * If the optimal code is too long, the frequencies are flattened and
+ * the code rebuilt.  At least two codes are always assigned.
+ */
+
+static void df_lengths (uint8_t *lens, const uint32_t *freq, int n, int limit) {
+    uint32_t w[2 * DF_LCODES];
+    int sym[DF_LCODES], parent[2 * DF_LCODES];
+    uint8_t depth[2 * DF_LCODES];
+    int i, j, k, nsym = 0, maxd;
+
+    for (i = 0; i < n; i++) {
+        lens[i] = 0;
+        if (freq[i]) {
+            sym[nsym] = i;
+            w[nsym++] = freq[i];
+        }
+    }
+    for (i = 0; nsym < 2; i++) {
+        if (!freq[i]) {
+            sym[nsym] = i;
+            w[nsym++] = 1;
+        }
+    }
+
+    /* Sort by weight */
+
+    for (i = 1; i < nsym; i++) {
+        uint32_t tw = w[i];
+        int ts = sym[i];
+
+        for (j = i; j > 0 && w[j-1] > tw; j--) {
+            w[j] = w[j-1];
+            sym[j] = sym[j-1];
+        }
+        w[j] = tw;
+        sym[j] = ts;
+    }
+
+    for (;;) {
+        int leaf = 0, node = nsym;
+
+        /* Two-queue merge: leaves are sorted, and internal nodes are
+         * created in increasing weight order.
+         */
+        for (k = nsym; k < 2 * nsym - 1; k++) {
+            int a, b;
+
+            if (leaf < nsym && (node >= k || w[leaf] <= w[node])) {
+                a = leaf++;
+            } else {
+                a = node++;
+            }
+            if (leaf < nsym && (node >= k || w[leaf] <= w[node])) {
+                b = leaf++;
+            } else {
+                b = node++;
+            }
+            w[k] = w[a] + w[b];
+            parent[a] = parent[b] = k;
+        }
+        depth[2 * nsym - 2] = 0;
+        maxd = 0;
+        for (k = 2 * nsym - 3; k >= 0; k--) {
+            depth[k] = depth[parent[k]] + 1;
+            if (k < nsym && depth[k] > maxd) {
+                maxd = depth[k];
+            }
+        }
+        if (maxd <= limit) {
+            break;
+        }
+        for (i = 0; i < nsym; i++) {
+            w[i] = (w[i] + 1) >> 1;
+        }
+    }
+
+    for (i = 0; i < nsym; i++) {
+        lens[sym[i]] = depth[i];
+    }
+}
+
+/* Assign canonical codes, bit-reversed for LSB-first output */
+
+static void df_codes (uint16_t *codes, const uint8_t *lens, int n) {
+    uint16_t count[DF_MAXBITS +1], next[DF_MAXBITS +1];
+    int i, code = 0;
+
+    memset (count, 0, sizeof (count));
+    for (i = 0; i < n; i++) {
+        count[lens[i]]++;
+    }
+    count[0] = 0;
+    for (i = 1; i <= DF_MAXBITS; i++) {
+        code = (code + count[i-1]) << 1;
+        next[i] = code;
+    }
+    for (i = 0; i < n; i++) {
+        int l = lens[i], c, r = 0;
+
+        if (!l) {
+            continue;
+        }
+        c = next[l]++;
+        while (l--) {
+            r = (r << 1) | (c & 1);
+            c >>= 1;
+        }
+        codes[i] = r;
+    }
+}
+
+static unsigned int df_dcode (t_deflate *df, unsigned int dist) {
+    return (dist <= 256)? df->dcode[dist -1]: df->dcode[256 + ((dist -1) >> 7)];
+}
+
+/* Write the block's symbols with the given codes */
+
+static void df_symbols (t_deflate *df, const uint16_t *lcodes, const uint8_t *llens,
+                        const uint16_t *dcodes, const uint8_t *dlens) {
+    unsigned int i;
+
+    for (i = 0; i < df->nsym; i++) {
+        unsigned int l = df->lit[i], d = df->dist[i], c;
+
+        if (!d) {
+            df_putbits (df, lcodes[l], llens[l]);
+            continue;
+        }
+        c = df->lcode[l];
+        df_putbits (df, lcodes[257 + c], llens[257 + c]);
+        if (df_lext[c]) {
+            df_putbits (df, l - df_lbase[c], df_lext[c]);
+        }
+        c = df_dcode (df, d);
+        df_putbits (df, dcodes[c], dlens[c]);
+        if (df_dext[c]) {
+            df_putbits (df, d - df_dbase[c], df_dext[c]);
+        }
+    }
+    df_putbits (df, lcodes[256], llens[256]);
+}
+
+/* Write a block, choosing the smallest encoding */
+
+static void df_block (t_deflate *df, int last) {
+    uint32_t lfreq[DF_LCODES], dfreq[DF_DCODES], blfreq[DF_BLCODES];
+    uint8_t llens[DF_LCODES], dlens[DF_DCODES], bllens[DF_BLCODES];
+    uint8_t flens[DF_FCODES], fdlens[DF_DCODES];
+    uint16_t lcodes[DF_FCODES], dcodes[DF_DCODES], blcodes[DF_BLCODES];
+    uint8_t all[DF_LCODES + DF_DCODES], rle[DF_LCODES + DF_DCODES], rlex[DF_LCODES + DF_DCODES];
+    size_t extra = 0, dyn, fix, stored, blen = df->emitted - df->bstart;
+    unsigned int i, nrle = 0, hlit, hdist, hclen, n;
+
+    memset (lfreq, 0, sizeof (lfreq));
+    memset (dfreq, 0, sizeof (dfreq));
+    memset (blfreq, 0, sizeof (blfreq));
+    for (i = 0; i < df->nsym; i++) {
+        if (!df->dist[i]) {
+            lfreq[df->lit[i]]++;
+        } else {
+            unsigned int lc = df->lcode[df->lit[i]], dc = df_dcode (df, df->dist[i]);
+
+            lfreq[257 + lc]++;
+            dfreq[dc]++;
+            extra += df_lext[lc] + df_dext[dc];
+        }
+    }
+    lfreq[256] = 1;
+
+    df_lengths (llens, lfreq, DF_LCODES, DF_MAXBITS);
+    df_lengths (dlens, dfreq, DF_DCODES, DF_MAXBITS);
+
+    for (hlit = DF_LCODES; hlit > 257 && !llens[hlit-1]; hlit--)
+        ;
+    for (hdist = DF_DCODES; hdist > 1 && !dlens[hdist-1]; hdist--)
+        ;
+
+    /* Run-length encode the code lengths */
+
+    memcpy (all, llens, hlit);
+    memcpy (all + hlit, dlens, hdist);
+    n = hlit + hdist;
+    for (i = 0; i < n; ) {
+        unsigned int v = all[i], r = 1;
+
+        while (i + r < n && all[i + r] == v) {
+            r++;
+        }
+        i += r;
+        if (!v) {
+            while (r >= 11) {
+                unsigned int k = (r > 138)? 138: r;
+                rle[nrle] = 18;
+                rlex[nrle++] = k - 11;
+                r -= k;
+            }
+            if (r >= 3) {
+                rle[nrle] = 17;
+                rlex[nrle++] = r - 3;
+                r = 0;
+            }
+        } else {
+            rle[nrle] = v;
+            rlex[nrle++] = 0;
+            r--;
+            while (r >= 3) {
+                unsigned int k = (r > 6)? 6: r;
+                rle[nrle] = 16;
+                rlex[nrle++] = k - 3;
+                r -= k;
+            }
+        }
+        while (r--) {
+            rle[nrle] = v;
+            rlex[nrle++] = 0;
+        }
+    }
+    for (i = 0; i < nrle; i++) {
+        blfreq[rle[i]]++;
+    }
+    df_lengths (bllens, blfreq, DF_BLCODES, DF_MAXBLBITS);
+    for (hclen = DF_BLCODES; hclen > 4 && !bllens[df_blorder[hclen-1]]; hclen--)
+        ;
+
+    /* Sizes in bits */
+
+    dyn = 3 + 5 + 5 + 4 + 3 * hclen + extra;
+    for (i = 0; i < nrle; i++) {
+        dyn += bllens[rle[i]] + ((rle[i] == 16)? 2: (rle[i] == 17)? 3: (rle[i] == 18)? 7: 0);
+    }
+    fix = 3 + extra;
+
+    /* The fixed code lengths include the two unused codes, without
+     * which the 9-bit codes would be assigned wrongly.
+     */
+    for (i = 0; i < DF_FCODES; i++) {
+        flens[i] = (i < 144)? 8: (i < 256)? 9: (i < 280)? 7: 8;
+    }
+    for (i = 0; i < DF_LCODES; i++) {
+        dyn += (size_t)lfreq[i] * llens[i];
+        fix += (size_t)lfreq[i] * flens[i];
+    }
+    for (i = 0; i < DF_DCODES; i++) {
+        fdlens[i] = 5;
+        dyn += (size_t)dfreq[i] * dlens[i];
+        fix += (size_t)dfreq[i] * 5;
+    }
+    stored = ((blen + DF_MAXSTORED -1) / DF_MAXSTORED + !blen) * (3 + 7 + 32) + 8 * blen;
+
+    if (stored < dyn && stored < fix) {
+        const uint8_t *p = df->in + df->bstart;
+
+        do {
+            n = (blen > DF_MAXSTORED)? DF_MAXSTORED: (unsigned int)blen;
+            blen -= n;
+            df_putbits (df, (last && !blen)? 1: 0, 3);
+            df_align (df);
+            df_room (df, n + 4);
+            (*df->outbuf)[(*df->outused)++] = (char)(n & 0xFF);
+            (*df->outbuf)[(*df->outused)++] = (char)(n >> 8);
+            (*df->outbuf)[(*df->outused)++] = (char)(~n & 0xFF);
+            (*df->outbuf)[(*df->outused)++] = (char)((~n >> 8) & 0xFF);
+            memcpy (*df->outbuf + *df->outused, p, n);
+            *df->outused += n;
+            p += n;
+        } while (blen);
+    } else if (fix <= dyn) {
+        df_putbits (df, last | (1 << 1), 3);
+        df_codes (lcodes, flens, DF_FCODES);
+        df_codes (dcodes, fdlens, DF_DCODES);
+        df_symbols (df, lcodes, flens, dcodes, fdlens);
+    } else {
+        df_putbits (df, last | (2 << 1), 3);
+        df_putbits (df, hlit - 257, 5);
+        df_putbits (df, hdist - 1, 5);
+        df_putbits (df, hclen - 4, 4);
+        for (i = 0; i < hclen; i++) {
+            df_putbits (df, bllens[df_blorder[i]], 3);
+        }
+        df_codes (blcodes, bllens, DF_BLCODES);
+        for (i = 0; i < nrle; i++) {
+            df_putbits (df, blcodes[rle[i]], bllens[rle[i]]);
+            if (rle[i] >= 16) {
+                df_putbits (df, rlex[i], (rle[i] == 16)? 2: (rle[i] == 17)? 3: 7);
+            }
+        }
+        df_codes (lcodes, llens, DF_LCODES);
+        df_codes (dcodes, dlens, DF_DCODES);
+        df_symbols (df, lcodes, llens, dcodes, dlens);
+    }
+
+    df->nsym = 0;
+    df->bstart = df->emitted;
+}
+
+/* Queue a literal (dist 0) or match */
+
+static void df_emit (t_deflate *df, unsigned int lit, unsigned int dist) {
+    df->lit[df->nsym] = lit;
+    df->dist[df->nsym++] = dist;
+    df->emitted += dist? lit: 1;
+    if (df->nsym == DF_BLOCK) {
+        df_block (df, 0);
+    }
+}
+
+/* Add a position to the hash chains.  Returns the previous head. */
+
+static uint32_t df_insert (t_deflate *df, size_t pos) {
+    uint32_t h, cand;
+
+    if (pos + DF_MINMATCH > df->len) {
+        return 0;
+    }
+    h = DF_HASH (df->in + pos);
+    cand = df->head[h];
+    df->prev[pos & DF_WMASK] = cand;
+    df->head[h] = (uint32_t)pos + 1;
+    return cand;
+}
+
+/* Find the longest match at pos that is longer than best.
+ * Returns its length (best if none), and its distance in *dist.
+ */
+
+static unsigned int df_match (t_deflate *df, size_t pos, uint32_t cand, unsigned int best,
+                              unsigned int chain, unsigned int nice, unsigned int *dist) {
+    const uint8_t *s = df->in + pos;
+    size_t limit = (pos > DF_MAXDIST)? pos - DF_MAXDIST: 0;
+    unsigned int max = (df->len - pos > DF_MAXMATCH)? DF_MAXMATCH: (unsigned int)(df->len - pos);
+
+    *dist = 0;
+    if (best >= max) {
+        return best;
+    }
+    while (cand && chain--) {
+        size_t c = cand - 1;
+        const uint8_t *m = df->in + c;
+
+        if (c < limit) {
+            break;
+        }
+        if (m[best] == s[best] && m[0] == s[0] && m[1] == s[1]) {
+            unsigned int l = 2;
+
+            while (l < max && m[l] == s[l]) {
+                l++;
+            }
+            if (l > best) {
+                best = l;
+                *dist = (unsigned int)(pos - c);
+                if (l >= nice || l >= max) {
+                    break;
+                }
+            }
+        }
+        cand = df->prev[c & DF_WMASK];
+        if (cand > c) {
+            break;
+        }
+    }
+    return best;
+}
+
+/* Compress a stream into a buffer */
+
+static void deflate (PDF *pdf, const char *stream, size_t len,
+                     char **buf, size_t *bufsize, size_t *bufused) {
+    static const uint8_t flg[10] = { 0x01, 0x01, 0x5E, 0x5E, 0x5E, 0x5E, 0x9C, 0xDA, 0xDA, 0xDA };
+    t_deflate df;
+    unsigned int level = pdf->p.level, chain, nice, lazy, i, c;
+    size_t pos;
+    uint32_t a = 1, b = 0;
+    void *mem;
+
+    if (level < 1 || level > 9) {
+        level = 6;
+    }
+    chain = df_levels[level].chain;
+    nice  = df_levels[level].nice;
+    lazy  = df_levels[level].lazy;
+
+    memset (&df, 0, sizeof (df));
+    df.pdf = pdf;
+    df.in = (const uint8_t *)stream;
+    df.len = len;
+    df.outbuf = buf;
+    df.outsize = bufsize;
+    df.outused = bufused;
+
+    if (!(mem = calloc (1, (DF_HSIZE + DF_WSIZE) * sizeof (uint32_t) +
+                           2 * DF_BLOCK * sizeof (uint16_t)))) {
+        ABORT (errno);
+    }
+    df.head = (uint32_t *) mem;
+    df.prev = df.head + DF_HSIZE;
+    df.lit  = (uint16_t *)(df.prev + DF_WSIZE);
+    df.dist = df.lit + DF_BLOCK;
+
+    for (c = 0; c < 29; c++) {
+        unsigned int end = (c < 28)? df_lbase[c+1]: DF_MAXMATCH +1;
+
+        for (i = df_lbase[c]; i < end; i++) {
+            df.lcode[i] = c;
+        }
+    }
+    for (c = 0; c < DF_DCODES; c++) {
+        unsigned int end = (c < DF_DCODES -1)? df_dbase[c+1]: DF_WSIZE +1;
+
+        for (i = df_dbase[c]; i < end; i++) {
+            if (i <= 256) {
+                df.dcode[i -1] = c;
+            } else {
+                df.dcode[256 + ((i -1) >> 7)] = c;
+            }
+        }
+    }
+
+    df_room (&df, 2);
+    (*buf)[(*bufused)++] = 0x78;
+    (*buf)[(*bufused)++] = flg[level];
+
+    pos = 0;
+    if (!lazy) {
+        while (pos < len) {
+            uint32_t cand = df_insert (&df, pos);
+            unsigned int ml = DF_MINMATCH -1, md = 0;
+
+            if (cand) {
+                ml = df_match (&df, pos, cand, ml, chain, nice, &md);
+            }
+            if (md) {
+                df_emit (&df, ml, md);
+                for (i = 1; i < ml; i++) {
+                    (void) df_insert (&df, pos + i);
+                }
+                pos += ml;
+            } else {
+                df_emit (&df, df.in[pos], 0);
+                pos++;
+            }
+        }
+    } else {
+        unsigned int pl = DF_MINMATCH -1, pd = 0, avail = 0;
+
+        while (pos < len) {
+            uint32_t cand = df_insert (&df, pos);
+            unsigned int ml = DF_MINMATCH -1, md = 0;
+
+            if (cand && pl < nice) {
+                ml = df_match (&df, pos, cand, (pl > ml)? pl: ml, chain, nice, &md);
+            }
+            if (avail && pd && !md) {
+                /* The previous match is at least as long: take it */
+                df_emit (&df, pl, pd);
+                for (i = pos + 1; i < pos - 1 + pl; i++) {
+                    (void) df_insert (&df, i);
+                }
+                pos = pos - 1 + pl;
+                avail = 0;
+                pl = DF_MINMATCH -1;
+                pd = 0;
+                continue;
+            }
+            if (avail) {
+                df_emit (&df, df.in[pos -1], 0);
+            }
+            avail = 1;
+            pl = md? ml: DF_MINMATCH -1;
+            pd = md;
+            pos++;
+        }
+        if (avail) {
+            df_emit (&df, df.in[pos -1], 0);
+        }
+    }
+    df_block (&df, 1);
+    df_align (&df);
+    free (mem);
+
+    /* Adler-32, in chunks that can not overflow */
+
+    pos = 0;
+    while (pos < len) {
+        size_t n = (len - pos > 5552)? 5552: len - pos;
+
+        while (n--) {
+            a += df.in[pos++];
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
     }
+    df_room (&df, 4);
+    (*buf)[(*bufused)++] = (char)(b >> 8);
+    (*buf)[(*bufused)++] = (char)(b & 0xFF);
+    (*buf)[(*bufused)++] = (char)(a >> 8);
+    (*buf)[(*bufused)++] = (char)(a & 0xFF);
 }
 
 /* *********************** SHA1 *********************** */
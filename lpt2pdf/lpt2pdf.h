@@ -31,7 +31,8 @@
  *
  * The API for the library is fairly straightforward:
  *  PDF_HANDLE handle = pdf_open ("pdf_file.pdf");
- *     "-" will use stdout (which must be seekable - e.g. not a pipe.)
+ *     "-" will use stdout.  Output to a pipe is written as it is produced; such a
+ *     handle can't be reopened or snapshot.
  *     Returns NULL on error; errno may give a clue.
  *
  * int pdf_reopen (handle)
@@ -83,6 +84,29 @@
  *                                                Image can be used for logos, special forms.  It is 
  *                                                scaled to fit the width of the page, less margins.
  *                                                Aspect ratio is maintained. 
+ *       PDF_THREADS           Count  0           Number of worker threads that render and compress completed
+ *                                                pages while pdf_print returns.  Pages are written in order
+ *                                                by another thread.  0 does all work in pdf_print.
+ *                                                Ignored where threads are not available.
+ *       PDF_COMPRESSION       keyword "LZW"      Compression of page content and form image streams:
+ *                                    "LZW"       - LZWDecode
+ *                                    "FLATE"     - FlateDecode; smaller, but slower to compress
+ *                                    "AUTO"      - Both; the smaller is kept for each stream
+ *                                    "NONE"      - Uncompressed
+ *       PDF_FLATE_LEVEL       Level  6           FLATE/AUTO effort, 1 (fastest) - 9 (smallest)
+ *       PDF_COMPACT           Flag   0           1 drops trailing blanks and writes blank lines as moves, for
+ *                                                smaller content streams.  Uncompressed streams also write
+ *                                                long runs of spaces as moves.  The pages look the same.
+ *       PDF_PREALLOCATE       MB     0           Space reserved ahead of the data written to the file, so that
+ *                                                a file appended to for a long time isn't fragmented.  0 for
+ *                                                none.  Ignored where fallocate is not available.
+ *       PDF_DURABILITY        keyword "NONE"     When the output file is synced to storage:
+ *                                    "NONE"      - Never; the system writes it when it chooses
+ *                                    "JOB"       - When the file is closed
+ *                                    "CHECKPOINT" - Also at each pdf_checkpoint
+ *                                    "PAGE"      - Also after each page is written
+ *                                                Handles in the same process that sync at the same time
+ *                                                share the wait.  Output to a pipe is never synced.
  *
  *    Sanity checks for values are limited; you can produce unreasonable results with unreasonable input.
  *
@@ -125,11 +149,18 @@
  *     Checkpoint a file - this means write the metadata to make it readable, but leave it open.
  *     Any partially-written page is NOT flushed.  The next pdf_print will make the file unreadable
  *     again.  This is useful for cases where a file is left open for write for long periods with no
- *     data being added, as in device simulators.  Similar to fflush, but rather more expensive.
+ *     data being added, as in device simulators.  Similar to fflush, but rather more expensive:
+ *     the metadata is written as an update, whose cost is proportional to the pages written since
+ *     the last checkpoint.  pdf_close writes it in full.
  *
  * int pdf_snapshot (PDF_HANDLE, filename)
  *     Checkpoint and atomically copy a file to a new file.  The handle remains open.  The new file
- *     will not contain the last page if that page isn't full.
+ *     will not contain the last page if that page isn't full.  Where the filesystem allows, the
+ *     copy shares the data (a reflink) or is made by the kernel.
+ *
+ * int pdf_snapshot_update (PDF_HANDLE, filename)
+ *     As pdf_snapshot, but if filename is the last snapshot taken with this handle and has not
+ *     been modified since, only the data that has changed since that snapshot is copied.
  *
  * int pdf_close (handle)
  *     Closes file after writing metadata.
@@ -202,6 +233,12 @@ int pdf_set (PDF_HANDLE pdf, int arg,...);
 #define PDF_FORM_IMAGE    (17)
 #define PDF_BAR_HEIGHT    (18)
 #define PDF_LPP           (19)
+#define PDF_THREADS       (20)
+#define PDF_COMPRESSION   (21)
+#define PDF_FLATE_LEVEL   (22)
+#define PDF_COMPACT       (23)
+#define PDF_PREALLOCATE   (24)
+#define PDF_DURABILITY    (25)
 
 int pdf_print (PDF_HANDLE pdf, const char *string, size_t length);
 #define PDF_USE_STRLEN ((size_t)(~0u))
@@ -218,6 +255,8 @@ int pdf_checkpoint (PDF_HANDLE pdf);
 
 int pdf_snapshot (PDF_HANDLE, const char *filename);
 
+int pdf_snapshot_update (PDF_HANDLE, const char *filename);
+
 int pdf_close (PDF_HANDLE pdf);
 
 int pdf_error (PDF_HANDLE pdf);
@@ -301,6 +340,9 @@ E__(Bad filename - null or not .pdf)
 #define PDF_E_UNSUP_PNG        (PDF_E_BASE +  21)
     E__(PNG Image file version not supported)
 
+#define PDF_E_NOT_SEEKABLE     (PDF_E_BASE +  22)
+    E__(Not possible with output to a pipe)
+
 #undef E__
 #ifdef PDF_BUILD_
 };
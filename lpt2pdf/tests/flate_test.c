@@ -0,0 +1,102 @@
+/* Flate encoder test
+ *
+ * Deflates inputs at each compression level, and inflates them with
+ * zlib.  The inputs use all 256 byte values, in short inputs that are
+ * written with the fixed Huffman codes, and in longer ones that are
+ * written with dynamic codes.  Each must inflate to its input.
+ *
+ * Build and run in the lpt2pdf directory:
+ *      gcc -o flate_test tests/flate_test.c -lz && ./flate_test
+ */
+
+/* As lpt2pdf.c, which is included after zlib.h */
+
+#if defined (__linux__) && !defined (_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <zlib.h>
+
+/* zlib has functions of the same names */
+
+#define crc32 lpt2pdf_crc32
+#define deflate lpt2pdf_deflate
+#define main lpt2pdf_main
+#include "../lpt2pdf.c"
+#undef main
+
+#define MAXLEN (100000)
+
+static PDF ctx;
+static char *buf;
+static size_t bufsize;
+
+/* Deflate and inflate one input.  Returns 1 if it fails. */
+
+static unsigned int check (const uint8_t *in, size_t len, const char *what) {
+    static uint8_t out[MAXLEN];
+    uLongf olen = sizeof (out);
+    size_t used = 0;
+    int r;
+
+    deflate (&ctx, (const char *) in, len, &buf, &bufsize, &used);
+    r = uncompress (out, &olen, (const Bytef *) buf, (uLong) used);
+    if (r == Z_OK && olen == len && !memcmp (in, out, len)) {
+        return 0;
+    }
+    fprintf (stderr, "%s, level %u, %u bytes: %s\n", what, ctx.p.level,
+             (unsigned int) len, (r != Z_OK)? zError (r): "wrong data");
+    return 1;
+}
+
+int main (void) {
+    static uint8_t in[MAXLEN];
+    unsigned int level, c, seed = 1, tests = 0, failed = 0;
+    size_t i;
+
+    memcpy (&ctx, &defaults, sizeof (ctx));
+    if (setjmp (ctx.env)) {
+        fprintf (stderr, "deflate failed: %s\n", strerror (ctx.errnum));
+        return 2;
+    }
+
+    for (level = 1; level <= 9; level++) {
+        ctx.p.level = level;
+
+        /* Each byte value alone, and all of them in order */
+
+        for (c = 0; c < 256; c++) {
+            in[0] = (uint8_t) c;
+            failed += check (in, 1, "One byte");
+            tests++;
+        }
+        for (c = 0; c < 256; c++) {
+            in[c] = (uint8_t) c;
+        }
+        failed += check (in, 256, "All bytes");
+        for (c = 0; c < 256; c++) {
+            in[c] = (uint8_t) (255 - c);
+        }
+        failed += check (in, 256, "All bytes, reversed");
+        tests += 2;
+
+        /* Random bytes, which don't compress, and repeated text with
+         * every byte value, which does.
+         */
+
+        for (i = 0; i < MAXLEN; i++) {
+            seed = seed * 1103515245u + 12345u;
+            in[i] = (uint8_t) (seed >> 16);
+        }
+        failed += check (in, 1000, "Random bytes");
+        failed += check (in, MAXLEN, "Random bytes");
+        for (i = 0; i < MAXLEN; i++) {
+            in[i] = (uint8_t) ((i % 300 < 256)? i % 300: ' ');
+        }
+        failed += check (in, MAXLEN, "Repeated bytes");
+        tests += 3;
+    }
+
+    printf ("flate: %u streams, %u failed\n", tests, failed);
+    return failed? 1: 0;
+}
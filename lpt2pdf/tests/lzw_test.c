@@ -0,0 +1,146 @@
+/* LZW encoder test
+ *
+ * Encodes prefixes of a text-like buffer at every length, and decodes
+ * them as a PDF reader does (LZWDecode, EarlyChange 0).  Each stream
+ * must decode to its input and end with EOD, followed only by padding.
+ * Some of them end just where the last data code widens the codes, so
+ * that EOD is one bit wider than that code; there must be some.
+ *
+ * Build and run in the lpt2pdf directory:
+ *      gcc -o lzw_test tests/lzw_test.c && ./lzw_test
+ */
+
+#define main lpt2pdf_main
+#include "../lpt2pdf.c"
+#undef main
+
+#define MAXLEN (12000)
+
+/* Read a code of width bits, or -1 at the end of the data */
+
+static int rdcode (const uint8_t *in, size_t len, size_t *bit, unsigned int width) {
+    unsigned int i;
+    int code = 0;
+
+    if (*bit + width > len * 8) {
+        return -1;
+    }
+    for (i = 0; i < width; i++, (*bit)++) {
+        code = (code << 1) | ((in[*bit >> 3] >> (7 - (*bit & 7))) & 1);
+    }
+    return code;
+}
+
+/* Decode a stream.
+ * Returns the length decoded, or -1 if the stream is malformed.
+ * *wide is set if the code before EOD widened the codes.
+ */
+
+static long decode (const uint8_t *in, size_t len, uint8_t *out, size_t outsize, int *wide) {
+    static uint16_t prefix[LZW_DSIZE], slen[LZW_DSIZE];
+    static uint8_t suffix[LZW_DSIZE], first[LZW_DSIZE];
+    unsigned int width = LZW_MINBITS, next = LZW_IDCODES, c, i;
+    int code, prev = -1;
+    size_t bit = 0, n = 0;
+
+    *wide = 0;
+    for (c = 0; c < 256; c++) {
+        suffix[c] = first[c] = (uint8_t) c;
+        slen[c] = 1;
+    }
+    for (;;) {
+        if ((code = rdcode (in, len, &bit, width)) < 0) {
+            return -1;                          /* No EOD */
+        }
+        if (code == LZW_CLRCODE) {
+            width = LZW_MINBITS;
+            next = LZW_IDCODES;
+            prev = -1;
+            *wide = 0;
+            continue;
+        }
+        if (code == LZW_EODCODE) {
+            break;
+        }
+        if (prev < 0) {
+            if (code > 0xFF || n >= outsize) {
+                return -1;
+            }
+            out[n++] = (uint8_t) code;
+            prev = code;
+            continue;
+        }
+        if ((unsigned int) code > next || (code == (int) next && next == LZW_DSIZE)) {
+            return -1;
+        }
+        if (next < LZW_DSIZE) {
+            prefix[next] = (uint16_t) prev;
+            suffix[next] = first[((unsigned int) code < next)? code: prev];
+            first[next] = first[prev];
+            slen[next] = slen[prev] + 1;
+            next++;
+            *wide = 0;
+            if (next == (1u << width) && width < LZW_MAXBITS) {
+                width++;
+                *wide = 1;
+            }
+        }
+        if (n + slen[code] > outsize) {
+            return -1;
+        }
+        for (c = code, i = slen[code]; i-- > 0; c = prefix[c]) {
+            out[n + i] = suffix[c];
+        }
+        n += slen[code];
+        prev = code;
+    }
+    if (len * 8 - bit >= 8) {
+        return -1;                              /* Data after EOD */
+    }
+    return (long) n;
+}
+
+int main (void) {
+    static t_lzw lzw;
+    static uint8_t in[MAXLEN], out[MAXLEN], enc[2 * MAXLEN + 16];
+    unsigned int seed = 1, streams = 0, widened = 0, failed = 0;
+    size_t len, elen;
+    long n;
+    int wide;
+    FILE *fh;
+
+    for (len = 0; len < MAXLEN; len++) {
+        seed = seed * 1103515245u + 12345u;
+        in[len] = (uint8_t) "EEEETTAAOINS  \n\xE9"[(seed >> 16) % 16];
+    }
+    if ((fh = tmpfile ()) == NULL) {
+        perror ("tmpfile");
+        return 2;
+    }
+    for (len = 0; len <= MAXLEN; len++) {
+        rewind (fh);
+        lzw_init (&lzw, LZW_FILE, fh);
+        lzw_encode (&lzw, (char *) in, len);
+        elen = (size_t) ftell (fh);
+        rewind (fh);
+        if (elen > sizeof (enc) || fread (enc, 1, elen, fh) != elen) {
+            perror ("fread");
+            return 2;
+        }
+        n = decode (enc, elen, out, sizeof (out), &wide);
+        streams++;
+        if (n != (long) len || memcmp (in, out, len)) {
+            if (failed++ < 10) {
+                fprintf (stderr, "Length %u: decoded %ld%s\n", (unsigned int) len, n,
+                         wide? ", EOD after a code width change": "");
+            }
+            continue;
+        }
+        widened += wide;
+    }
+    fclose (fh);
+
+    printf ("lzw: %u streams, %u end at a code width change, %u failed\n",
+            streams, widened, failed);
+    return (failed || !widened)? 1: 0;
+}